@@ -0,0 +1,182 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Async.h
+///
+/// Background execution of jobs returning Expected.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <QFuture>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QtConcurrentRun>
+
+#include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "Expected.h"
+
+namespace Async
+{
+
+namespace Detail
+{
+
+template <class T>
+struct State
+{
+	State(): m_cancelled(false)
+	{
+	}
+
+	QMutex m_mutex;
+	boost::optional<Expected<T> > m_result;
+	bool m_cancelled;
+};
+
+template <class T, class F>
+struct Job
+{
+	typedef void result_type;
+
+	Job(const boost::shared_ptr<State<T> > &state, const F &f):
+		m_state(state), m_f(f)
+	{
+	}
+
+	void operator()() const
+	{
+		// Result of cancelled job is released here, in the worker thread.
+		Expected<T> result = m_f();
+		QMutexLocker lock(&m_state->m_mutex);
+		if (!m_state->m_cancelled)
+			m_state->m_result = result;
+	}
+
+private:
+	boost::shared_ptr<State<T> > m_state;
+	F m_f;
+};
+
+/* Cancels the job when the last copy of Future is gone. */
+template <class T>
+struct Handle
+{
+	Handle(const boost::shared_ptr<State<T> > &state, const QFuture<void> &future):
+		m_state(state), m_future(future)
+	{
+	}
+
+	~Handle()
+	{
+		cancel();
+	}
+
+	void cancel()
+	{
+		QMutexLocker lock(&m_state->m_mutex);
+		m_state->m_cancelled = true;
+		m_state->m_result = boost::none;
+	}
+
+	boost::shared_ptr<State<T> > m_state;
+	QFuture<void> m_future;
+};
+
+} // namespace Detail
+
+////////////////////////////////////////////////////////////
+// Future
+
+/* Result of a job running in the global thread pool.
+ * Copies share the job. Job is cancelled when no copies are left: it is not
+ * interrupted, but its result is dropped as soon as it finishes. */
+template <class T>
+struct Future
+{
+	/* Invalid future. */
+	Future()
+	{
+	}
+
+	/* 'f' is a functor returning Expected<T>. */
+	template <class F>
+	static Future run(const F &f)
+	{
+		boost::shared_ptr<Detail::State<T> > state(new Detail::State<T>());
+		Future future;
+		future.m_handle.reset(new Detail::Handle<T>(state,
+				QtConcurrent::run(Detail::Job<T, F>(state, f))));
+		return future;
+	}
+
+	bool isValid() const
+	{
+		return m_handle;
+	}
+
+	/* Waits for the job. Result is kept for other callers. */
+	Expected<T> get() const
+	{
+		wait();
+		QMutexLocker lock(&m_handle->m_state->m_mutex);
+		if (!m_handle->m_state->m_result)
+			return Expected<T>::fromMessage("Operation was cancelled");
+		return *m_handle->m_state->m_result;
+	}
+
+	/* Waits for the job and moves its result out, for results owning
+	 * resources. Other copies see the job as cancelled. */
+	Expected<T> take()
+	{
+		Expected<T> result = get();
+		m_handle->cancel();
+		return result;
+	}
+
+	/* Returns immediately. */
+	void cancel()
+	{
+		if (m_handle)
+			m_handle->cancel();
+	}
+
+	/* Once it returns, result of cancelled job is released. */
+	void wait() const
+	{
+		if (m_handle)
+			m_handle->m_future.waitForFinished();
+	}
+
+private:
+	boost::shared_ptr<Detail::Handle<T> > m_handle;
+};
+
+} // namespace Async
+
+#endif // ASYNC_H
@@ -0,0 +1,304 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file AsyncIO.cpp
+///
+/// Batched positioned I/O with deep queue: io_uring or thread pool.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <QtConcurrentMap>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "AsyncIO.h"
+#include "Util.h"
+
+using namespace AsyncIO;
+
+namespace
+{
+
+Expected<void> ioError(const Request &request, int error)
+{
+	return Expected<void>::fromMessage(QString("Unable to %1 at %2: %3")
+			.arg(request.m_type == Request::READ ? "read" : "write")
+			.arg(request.m_offset).arg(strerror(error)));
+}
+
+Expected<void> eofError(const Request &request)
+{
+	return Expected<void>::fromMessage(QString("Unexpected end of file at %1")
+			.arg(request.m_offset));
+}
+
+struct PoolJob
+{
+	typedef Expected<void> result_type;
+
+	Expected<void> operator()(const Request &request) const
+	{
+		quint64 done = 0;
+		while (done < request.m_size)
+		{
+			ssize_t ret = (request.m_type == Request::READ) ?
+				pread(request.m_fd, request.m_buf + done, request.m_size - done,
+					  request.m_offset + done) :
+				pwrite(request.m_fd, request.m_buf + done, request.m_size - done,
+					   request.m_offset + done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+				return ioError(request, errno);
+			if (ret == 0)
+				return eofError(request);
+			done += ret;
+		}
+		return Expected<void>();
+	}
+};
+
+} // namespace
+
+////////////////////////////////////////////////////////////
+// Buffer
+
+Expected<boost::shared_ptr<Buffer> > Buffer::create(quint64 size)
+{
+	void *data;
+	if (posix_memalign(&data, DIRECT_ALIGNMENT, size))
+	{
+		return Expected<boost::shared_ptr<Buffer> >::fromMessage(
+				QString("Unable to allocate %1 bytes").arg(size));
+	}
+	return boost::shared_ptr<Buffer>(new Buffer(static_cast<char *>(data), size));
+}
+
+Buffer::~Buffer()
+{
+	free(m_data);
+}
+
+////////////////////////////////////////////////////////////
+// Queue
+
+Expected<boost::shared_ptr<Queue> > Queue::create(unsigned depth)
+{
+	struct io_uring *ring = NULL;
+#ifdef HAVE_LIBURING
+	ring = new struct io_uring;
+	int ret = io_uring_queue_init(depth, ring, 0);
+	if (ret < 0)
+	{
+		Logger::info(QString("io_uring is not available: %1, using thread pool")
+				.arg(strerror(-ret)));
+		delete ring;
+		ring = NULL;
+	}
+#endif
+	return boost::shared_ptr<Queue>(new Queue(depth, ring));
+}
+
+Queue::~Queue()
+{
+	closeRing();
+}
+
+void Queue::closeRing()
+{
+#ifdef HAVE_LIBURING
+	if (m_ring)
+	{
+		io_uring_queue_exit(m_ring);
+		delete m_ring;
+		m_ring = NULL;
+	}
+#endif
+	m_buffer.reset();
+}
+
+Expected<void> Queue::registerBuffer(const boost::shared_ptr<Buffer> &buffer)
+{
+	m_buffer.reset();
+#ifdef HAVE_LIBURING
+	if (!m_ring)
+		return Expected<void>();
+	io_uring_unregister_buffers(m_ring);
+	struct iovec iov;
+	iov.iov_base = buffer->getData();
+	iov.iov_len = buffer->getSize();
+	int ret = io_uring_register_buffers(m_ring, &iov, 1);
+	// Locked memory limit may be too low, plain I/O still works.
+	if (ret < 0)
+	{
+		Logger::info(QString("Unable to register buffer: %1").arg(strerror(-ret)));
+		return Expected<void>();
+	}
+	m_buffer = buffer;
+#else
+	Q_UNUSED(buffer);
+#endif
+	return Expected<void>();
+}
+
+Expected<void> Queue::run(const QList<Request> &requests)
+{
+	return m_ring ? runRing(requests) : runPool(requests);
+}
+
+Expected<void> Queue::runPool(const QList<Request> &requests)
+{
+	QList<Expected<void> > results = QtConcurrent::blockingMapped(
+			requests, PoolJob());
+	Q_FOREACH(const Expected<void> &res, results)
+	{
+		if (!res.isOk())
+			return res;
+	}
+	return Expected<void>();
+}
+
+Expected<void> Queue::runRing(const QList<Request> &requests)
+{
+#ifdef HAVE_LIBURING
+	QVector<quint64> done(requests.size(), 0);
+	QList<int> pending;
+	for (int i = 0; i < requests.size(); ++i)
+		pending << i;
+
+	Expected<void> res;
+	unsigned inflight = 0;
+	// Prepared entries the kernel has not taken yet.
+	unsigned queued = 0;
+	bool waitFailed = false;
+	while (inflight > 0 || (res.isOk() && (!pending.isEmpty() || queued > 0)))
+	{
+		// Nothing new is submitted after failure, in-flight requests are drained.
+		while (res.isOk() && !pending.isEmpty() && inflight + queued < m_depth)
+		{
+			struct io_uring_sqe *sqe = io_uring_get_sqe(m_ring);
+			if (!sqe)
+				break;
+			int i = pending.takeFirst();
+			const Request &r = requests[i];
+			char *buf = r.m_buf + done[i];
+			unsigned size = qMin<quint64>(r.m_size - done[i], UINT_MAX);
+			quint64 offset = r.m_offset + done[i];
+			bool fixed = m_buffer && m_buffer->contains(buf, size);
+			if (r.m_type == Request::READ && fixed)
+				io_uring_prep_read_fixed(sqe, r.m_fd, buf, size, offset, 0);
+			else if (r.m_type == Request::READ)
+				io_uring_prep_read(sqe, r.m_fd, buf, size, offset);
+			else if (fixed)
+				io_uring_prep_write_fixed(sqe, r.m_fd, buf, size, offset, 0);
+			else
+				io_uring_prep_write(sqe, r.m_fd, buf, size, offset);
+			io_uring_sqe_set_data(sqe, reinterpret_cast<void *>((quintptr)i));
+			++queued;
+		}
+		if (res.isOk() && queued > 0)
+		{
+			int ret = io_uring_submit(m_ring);
+			if (ret >= 0)
+			{
+				inflight += ret;
+				queued -= ret;
+			}
+			// Retried once completions free the ring.
+			else if (inflight == 0 || (ret != -EAGAIN && ret != -EBUSY && ret != -EINTR))
+			{
+				res = Expected<void>::fromMessage(QString("Unable to submit I/O: %1")
+						.arg(strerror(-ret)));
+			}
+		}
+		if (inflight == 0)
+		{
+			if (res.isOk() && queued > 0)
+				res = Expected<void>::fromMessage("Unable to submit I/O");
+			// Entries left in the ring point to caller buffers.
+			if (queued > 0)
+			{
+				Logger::info("io_uring failed, using thread pool");
+				closeRing();
+			}
+			break;
+		}
+
+		struct io_uring_cqe *cqe;
+		int ret = io_uring_wait_cqe(m_ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0)
+		{
+			// Buffers stay in use until every request completes. Ring is
+			// broken if waiting fails twice in a row, nothing can be drained.
+			if (waitFailed)
+			{
+				closeRing();
+				return res;
+			}
+			waitFailed = true;
+			if (res.isOk())
+			{
+				res = Expected<void>::fromMessage(QString("Unable to wait for I/O: %1")
+						.arg(strerror(-ret)));
+			}
+			continue;
+		}
+		waitFailed = false;
+		int i = (int)reinterpret_cast<quintptr>(io_uring_cqe_get_data(cqe));
+		int result = cqe->res;
+		io_uring_cqe_seen(m_ring, cqe);
+		--inflight;
+
+		if (result == -EINTR || result == -EAGAIN)
+			pending << i;
+		else if (result < 0)
+		{
+			if (res.isOk())
+				res = ioError(requests[i], -result);
+		}
+		else if (result == 0)
+		{
+			if (res.isOk())
+				res = eofError(requests[i]);
+		}
+		else if ((done[i] += result) < requests[i].m_size)
+			pending << i;
+	}
+	return res;
+#else
+	Q_UNUSED(requests);
+	return Expected<void>::fromMessage("io_uring support is not built");
+#endif
+}
@@ -0,0 +1,149 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file AsyncIO.h
+///
+/// Batched positioned I/O with deep queue: io_uring or thread pool.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#ifndef ASYNCIO_H
+#define ASYNCIO_H
+
+#include <QString>
+#include <QList>
+
+#include <boost/shared_ptr.hpp>
+
+#include "Expected.h"
+
+struct io_uring;
+
+namespace AsyncIO
+{
+
+// Alignment of O_DIRECT buffers, offsets and sizes.
+enum {DIRECT_ALIGNMENT = 4096};
+
+////////////////////////////////////////////////////////////
+// Buffer
+
+/* Memory suitable for O_DIRECT transfers. */
+struct Buffer
+{
+	static Expected<boost::shared_ptr<Buffer> > create(quint64 size);
+
+	~Buffer();
+
+	char* getData() const
+	{
+		return m_data;
+	}
+
+	quint64 getSize() const
+	{
+		return m_size;
+	}
+
+	bool contains(const char *buf, quint64 size) const
+	{
+		return buf >= m_data && buf + size <= m_data + m_size;
+	}
+
+private:
+	Buffer(char *data, quint64 size):
+		m_data(data), m_size(size)
+	{
+	}
+
+	char *m_data;
+	quint64 m_size;
+};
+
+////////////////////////////////////////////////////////////
+// Request
+
+struct Request
+{
+	enum Type
+	{
+		READ,
+		WRITE
+	};
+
+	Request(Type type, int fd, quint64 offset, char *buf, quint64 size):
+		m_type(type), m_fd(fd), m_offset(offset), m_buf(buf), m_size(size)
+	{
+	}
+
+	Type m_type;
+	int m_fd;
+	quint64 m_offset;
+	char *m_buf;
+	quint64 m_size;
+};
+
+////////////////////////////////////////////////////////////
+// Queue
+
+/* Keeps up to 'depth' requests in flight. Uses io_uring if the kernel
+ * supports it, pread/pwrite on the thread pool otherwise. */
+struct Queue
+{
+	static Expected<boost::shared_ptr<Queue> > create(unsigned depth);
+
+	~Queue();
+
+	bool isRing() const
+	{
+		return m_ring;
+	}
+
+	/* Requests within the buffer use fixed buffer I/O.
+	 * Replaces previously registered buffer. */
+	Expected<void> registerBuffer(const boost::shared_ptr<Buffer> &buffer);
+	/* Submits requests in batches and waits for all of them.
+	 * Short transfers are continued, end of file is an error. */
+	Expected<void> run(const QList<Request> &requests);
+
+private:
+	Queue(unsigned depth, struct io_uring *ring):
+		m_depth(depth), m_ring(ring)
+	{
+	}
+
+	Expected<void> runRing(const QList<Request> &requests);
+	Expected<void> runPool(const QList<Request> &requests);
+	/* Drops entries the kernel has not taken, later runs use the pool. */
+	void closeRing();
+
+	unsigned m_depth;
+	// NULL if io_uring is not available or failed.
+	struct io_uring *m_ring;
+	boost::shared_ptr<Buffer> m_buffer;
+};
+
+} // namespace AsyncIO
+
+#endif // ASYNCIO_H
@@ -0,0 +1,350 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Cache.cpp
+///
+/// Persistent cache of disk metadata, invalidated when any layer changes.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <sstream>
+
+#include <QFile>
+#include <QDir>
+#include <QFileInfo>
+#include <QCryptographicHash>
+
+#include <boost/property_tree/json_parser.hpp>
+
+#include "Cache.h"
+#include "Util.h"
+
+namespace pt = boost::property_tree;
+using namespace Cache;
+
+namespace
+{
+
+const char CACHE_DIR[] = "/var/cache/prl-disk-tool";
+
+// Covers qcow2 header with extensions in most cases.
+enum {HEADER_STAMP_SIZE = 4096};
+
+QString getEntryPath(const QString &diskPath)
+{
+	struct stat st;
+	if (stat(QSTR2UTF8(diskPath), &st))
+		return QString();
+	return QString("%1/%2-%3.json").arg(CACHE_DIR)
+		.arg((quint64)st.st_dev).arg((quint64)st.st_ino);
+}
+
+bool readJson(const QString &path, pt::ptree &pt)
+{
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+	try
+	{
+		QByteArray json = file.readAll();
+		std::istringstream stream(std::string(json.constData(), json.size()));
+		pt::read_json(stream, pt);
+	}
+	catch (const pt::ptree_error &e)
+	{
+		Logger::info(QString("Ignoring cache %1: %2").arg(path).arg(e.what()));
+		return false;
+	}
+	return true;
+}
+
+Expected<void> writeJson(const QString &path, const pt::ptree &pt)
+{
+	QString dir = QFileInfo(path).path();
+	if (!QDir().mkpath(dir))
+		return Expected<void>::fromMessage(QString("Unable to create %1").arg(dir));
+
+	std::ostringstream out;
+	pt::write_json(out, pt, false);
+	// Concurrent readers see either old or new file.
+	QString tmpPath = QString("%1.%2").arg(path).arg(getpid());
+	QFile file(tmpPath);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+		file.write(out.str().c_str(), out.str().size()) != (qint64)out.str().size())
+	{
+		QFile::remove(tmpPath);
+		return Expected<void>::fromMessage(QString("Unable to write %1").arg(tmpPath));
+	}
+	// Renamed file must not turn out empty after a crash.
+	if (!file.flush() || fsync(file.handle()))
+	{
+		QFile::remove(tmpPath);
+		return Expected<void>::fromMessage(QString("Unable to sync %1: %2")
+				.arg(tmpPath).arg(strerror(errno)));
+	}
+	file.close();
+	if (rename(QSTR2UTF8(tmpPath), QSTR2UTF8(path)))
+	{
+		QFile::remove(tmpPath);
+		return Expected<void>::fromMessage(QString("Unable to rename %1: %2")
+				.arg(tmpPath).arg(strerror(errno)));
+	}
+	return Expected<void>();
+}
+
+QString getStorePath(const QString &name, const QString &key)
+{
+	return QString("%1/%2/%3.json").arg(CACHE_DIR).arg(name)
+		.arg(QString(QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Md5).toHex()));
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////
+// Stamp
+
+Expected<Stamp> Stamp::read(const QString &path)
+{
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly))
+		return Expected<Stamp>::fromMessage(QString("Unable to open %1").arg(path));
+
+	struct stat st;
+	if (fstat(file.handle(), &st))
+	{
+		return Expected<Stamp>::fromMessage(QString("Unable to stat %1: %2")
+				.arg(path).arg(strerror(errno)));
+	}
+	Stamp s;
+	s.m_path = path;
+	s.m_device = st.st_dev;
+	s.m_inode = st.st_ino;
+	s.m_size = st.st_size;
+	s.m_mtimeSec = st.st_mtim.tv_sec;
+	s.m_mtimeNsec = st.st_mtim.tv_nsec;
+	s.m_header = QCryptographicHash::hash(file.read(HEADER_STAMP_SIZE),
+			QCryptographicHash::Md5).toHex();
+	return s;
+}
+
+Expected<Stamp> Stamp::load(const pt::ptree &pt)
+{
+	try
+	{
+		Stamp s;
+		s.m_path = QString::fromStdString(pt.get<std::string>("path"));
+		s.m_device = pt.get<quint64>("device");
+		s.m_inode = pt.get<quint64>("inode");
+		s.m_size = pt.get<quint64>("size");
+		s.m_mtimeSec = pt.get<qint64>("mtime-sec");
+		s.m_mtimeNsec = pt.get<qint64>("mtime-nsec");
+		s.m_header = QString::fromStdString(pt.get<std::string>("header"));
+		return s;
+	}
+	catch (const pt::ptree_error &e)
+	{
+		return Expected<Stamp>::fromMessage(QString::fromStdString(e.what()));
+	}
+}
+
+pt::ptree Stamp::save() const
+{
+	pt::ptree pt;
+	pt.put("path", m_path.toStdString());
+	pt.put("device", m_device);
+	pt.put("inode", m_inode);
+	pt.put("size", m_size);
+	pt.put("mtime-sec", m_mtimeSec);
+	pt.put("mtime-nsec", m_mtimeNsec);
+	pt.put("header", m_header.toStdString());
+	return pt;
+}
+
+bool Stamp::operator==(const Stamp &rhs) const
+{
+	return m_path == rhs.m_path && m_device == rhs.m_device &&
+		   m_inode == rhs.m_inode && m_size == rhs.m_size &&
+		   m_mtimeSec == rhs.m_mtimeSec && m_mtimeNsec == rhs.m_mtimeNsec &&
+		   m_header == rhs.m_header;
+}
+
+////////////////////////////////////////////////////////////
+// Entry
+
+bool Entry::s_readOnly = false;
+
+void Entry::setReadOnly(bool readOnly)
+{
+	s_readOnly = readOnly;
+}
+
+void Entry::remove(const QString &diskPath)
+{
+	QString path = getEntryPath(diskPath);
+	if (!path.isEmpty())
+		QFile::remove(path);
+}
+
+Entry Entry::load(const QString &diskPath)
+{
+	Entry entry(diskPath);
+	pt::ptree pt;
+	if (!readJson(getEntryPath(diskPath), pt))
+		return entry;
+
+	QList<Stamp> stamps;
+	boost::optional<pt::ptree &> layers = pt.get_child_optional("layers");
+	if (!layers)
+		return entry;
+	Q_FOREACH(const pt::ptree::value_type &v, *layers)
+	{
+		Expected<Stamp> stored = Stamp::load(v.second);
+		if (!stored.isOk())
+			return entry;
+		// Any change of any layer invalidates everything.
+		Expected<Stamp> current = Stamp::read(stored.get().m_path);
+		if (!current.isOk() || !(current.get() == stored.get()))
+		{
+			Logger::info(QString("Cache of %1 is stale").arg(diskPath));
+			return entry;
+		}
+		stamps << stored.get();
+	}
+
+	entry.m_stamps = stamps;
+	boost::optional<pt::ptree &> data = pt.get_child_optional("data");
+	if (data)
+		entry.m_data = *data;
+	return entry;
+}
+
+boost::optional<pt::ptree> Entry::get(const QString &section) const
+{
+	boost::optional<const pt::ptree &> data = m_data.get_child_optional(section.toStdString());
+	if (!data)
+		return boost::none;
+	return *data;
+}
+
+void Entry::put(const QString &section, const pt::ptree &data)
+{
+	m_data.put_child(section.toStdString(), data);
+	m_fresh.insert(section);
+}
+
+Expected<void> Entry::bind(const QStringList &layers)
+{
+	m_bound.clear();
+	Q_FOREACH(const QString &layer, layers)
+	{
+		Expected<Stamp> stamp = Stamp::read(QFileInfo(layer).absoluteFilePath());
+		if (!stamp.isOk())
+			return stamp;
+		m_bound << stamp.get();
+	}
+	return Expected<void>();
+}
+
+Expected<void> Entry::save(const QStringList &layers)
+{
+	if (s_readOnly)
+		return Expected<void>();
+
+	QList<Stamp> stamps;
+	Q_FOREACH(const QString &layer, layers)
+	{
+		Expected<Stamp> stamp = Stamp::read(QFileInfo(layer).absoluteFilePath());
+		if (!stamp.isOk())
+			return stamp;
+		Q_FOREACH(const Stamp &bound, m_bound)
+		{
+			if (bound.m_path != stamp.get().m_path)
+				continue;
+			// Fresh sections may describe either state.
+			if (!(bound == stamp.get()))
+			{
+				Logger::info(QString("%1 changed, cache of %2 is not saved")
+						.arg(bound.m_path).arg(m_diskPath));
+				return Expected<void>();
+			}
+		}
+		stamps << stamp.get();
+	}
+	// Sections loaded for other state of layers are stale.
+	if (!(stamps == m_stamps))
+	{
+		pt::ptree fresh;
+		Q_FOREACH(const QString &section, m_fresh)
+			fresh.put_child(section.toStdString(), m_data.get_child(section.toStdString()));
+		m_data = fresh;
+		m_stamps = stamps;
+	}
+
+	pt::ptree pt, stampList;
+	Q_FOREACH(const Stamp &stamp, m_stamps)
+		stampList.push_back(std::make_pair("", stamp.save()));
+	pt.put_child("layers", stampList);
+	pt.put_child("data", m_data);
+
+	QString path = getEntryPath(m_diskPath);
+	if (path.isEmpty())
+		return Expected<void>::fromMessage(QString("Unable to stat %1").arg(m_diskPath));
+	return writeJson(path, pt);
+}
+
+////////////////////////////////////////////////////////////
+// Store
+
+boost::optional<pt::ptree> Store::get(const QString &name, const QString &key)
+{
+	pt::ptree pt;
+	if (!readJson(getStorePath(name, key), pt))
+		return boost::none;
+	// Guard against hash collisions.
+	if (pt.get<std::string>("key", std::string()) != key.toStdString())
+		return boost::none;
+	boost::optional<pt::ptree &> data = pt.get_child_optional("data");
+	if (!data)
+		return boost::none;
+	return *data;
+}
+
+Expected<void> Store::put(const QString &name, const QString &key, const pt::ptree &data)
+{
+	pt::ptree pt;
+	pt.put("key", key.toStdString());
+	pt.put_child("data", data);
+	return writeJson(getStorePath(name, key), pt);
+}
+
+void Store::remove(const QString &name, const QString &key)
+{
+	QFile::remove(getStorePath(name, key));
+}
@@ -0,0 +1,130 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Cache.h
+///
+/// Persistent cache of disk metadata, invalidated when any layer changes.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <QSet>
+
+#include <boost/optional.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "Expected.h"
+
+namespace Cache
+{
+
+////////////////////////////////////////////////////////////
+// Stamp
+
+/* Identity and version of one image file. */
+struct Stamp
+{
+	static Expected<Stamp> read(const QString &path);
+	static Expected<Stamp> load(const boost::property_tree::ptree &pt);
+
+	boost::property_tree::ptree save() const;
+
+	bool operator==(const Stamp &rhs) const;
+
+	QString m_path;
+	quint64 m_device;
+	quint64 m_inode;
+	quint64 m_size;
+	qint64 m_mtimeSec;
+	qint64 m_mtimeNsec;
+	// Hash of the image header.
+	QString m_header;
+};
+
+////////////////////////////////////////////////////////////
+// Entry
+
+/* Cached data of one disk. Valid while stamps of all its layers match. */
+struct Entry
+{
+	/* Empty entry if there is no cached data or it is stale. */
+	static Entry load(const QString &diskPath);
+
+	/* Entries are neither saved nor kept, for dry runs and commands
+	 * changing images. */
+	static void setReadOnly(bool readOnly);
+	/* Drops cached data of the disk. */
+	static void remove(const QString &diskPath);
+
+	/* Data of the section, if cached. */
+	boost::optional<boost::property_tree::ptree> get(const QString &section) const;
+	void put(const QString &section, const boost::property_tree::ptree &data);
+
+	/* Records state of 'layers' before data to put is computed. */
+	Expected<void> bind(const QStringList &layers);
+	/* Binds data to the recorded state of 'layers' and stores it, layers
+	 * not recorded are stamped now. Nothing is stored if a recorded layer
+	 * changed since. Cached data of other sections is kept only if layers
+	 * did not change. */
+	Expected<void> save(const QStringList &layers);
+
+private:
+	explicit Entry(const QString &diskPath):
+		m_diskPath(diskPath)
+	{
+	}
+
+	static bool s_readOnly;
+
+	QString m_diskPath;
+	QList<Stamp> m_stamps;
+	// State of layers before fresh sections were computed.
+	QList<Stamp> m_bound;
+	boost::property_tree::ptree m_data;
+	// Sections put after load.
+	QSet<QString> m_fresh;
+};
+
+////////////////////////////////////////////////////////////
+// Store
+
+/* Data keyed by content rather than by image file.
+ * Survives image changes that do not affect the key. */
+struct Store
+{
+	static boost::optional<boost::property_tree::ptree> get(
+			const QString &name, const QString &key);
+	static Expected<void> put(const QString &name, const QString &key,
+			const boost::property_tree::ptree &data);
+	static void remove(const QString &name, const QString &key);
+};
+
+} // namespace Cache
+
+#endif // CACHE_H
@@ -36,6 +36,7 @@
 #include "Command.h"
 #include "Util.h"
 #include "StringTable.h"
+#include "Cache.h"
 
 namespace po = boost::program_options;
 
@@ -47,6 +48,8 @@ namespace
 
 const char DESCRIPTOR[] = "DiskDescriptor.xml";
 
+enum {DEDUP_MEMORY_LIMIT = 1024};
+
 // Functions
 
 /** Get size unit type by letter */
@@ -204,6 +207,15 @@ template<> const bool Traits<CompactInfo>::m_info = true;
 template<> const char Traits<MergeSnapshots>::m_action[] = "merge";
 template<> const bool Traits<MergeSnapshots>::m_info = false;
 
+template<> const char Traits<DedupInfo>::m_action[] = "dedup";
+template<> const bool Traits<DedupInfo>::m_info = true;
+
+template<> const char Traits<Defrag>::m_action[] = "defrag";
+template<> const bool Traits<Defrag>::m_info = false;
+
+template<> const char Traits<Check>::m_action[] = "check";
+template<> const bool Traits<Check>::m_info = false;
+
 template<> po::options_description Traits<Resize>::getOptions()
 {
 	po::options_description options("Disk resizing (\"resize\")");
@@ -231,6 +243,8 @@ template<> po::options_description Traits<Compact>::getOptions()
 	po::options_description options("Disk compacting (\"compact\")");
 	options.add_options()
 		("force", "Forcibly drop the suspended state")
+		("incremental", "Process only regions written since the previous compaction")
+		("compress", po::value<std::string>(), "Store data compressed afterwards (zlib|zstd)")
 		("hdd", po::value<std::string>(), "Full path to the disk")
 		;
 	return options;
@@ -255,6 +269,35 @@ template<> po::options_description Traits<MergeSnapshots>::getOptions()
 	return options;
 }
 
+template<> po::options_description Traits<DedupInfo>::getOptions()
+{
+	po::options_description options("Duplicate clusters analysis (\"dedup --info|-i\")");
+	options.add_options()
+		("memory-limit", po::value<quint64>(), "Memory for the hash index in MB (default: 1024)")
+		("hdd", po::value<std::vector<std::string> >(), "Full path to the disk, may be repeated")
+		;
+	return options;
+}
+
+template<> po::options_description Traits<Defrag>::getOptions()
+{
+	po::options_description options("Disk defragmentation (\"defrag\")");
+	options.add_options()
+		("hdd", po::value<std::string>(), "Full path to the disk")
+		;
+	return options;
+}
+
+template<> po::options_description Traits<Check>::getOptions()
+{
+	po::options_description options("Disk consistency check (\"check\")");
+	options.add_options()
+		("repair", "Reclaim leaked clusters")
+		("hdd", po::value<std::string>(), "Full path to the disk")
+		;
+	return options;
+}
+
 ////////////////////////////////////////////////////////////
 // Factory
 
@@ -334,11 +377,26 @@ template<>
 Expected<Compact> Factory<Compact>::operator()() const
 {
 	bool force = m_vm.count(OPT_FORCE);
+	bool incremental = m_vm.count(OPT_INCREMENTAL);
+	boost::optional<Qcow2::CompressionType> compress;
+	po::variables_map::const_iterator argIter;
+	if ((argIter = m_vm.find(OPT_COMPRESS)) != m_vm.end())
+	{
+		QString type = QString::fromStdString(argIter->second.as<std::string>());
+		if (type == "zlib")
+			compress = Qcow2::COMPRESSION_ZLIB;
+		else if (type == "zstd" && !Qcow2::isCompressionSupported(Qcow2::COMPRESSION_ZSTD))
+			return Expected<Compact>::fromMessage("zstd support is not built");
+		else if (type == "zstd")
+			compress = Qcow2::COMPRESSION_ZSTD;
+		else
+			return Expected<Compact>::fromMessage(QString("Unknown compression type: %1").arg(type));
+	}
 	Expected<DiskAware> disk = Factory<DiskAware>::build(m_vm);
 	if (!disk.isOk())
 		return disk;
 
-	return Compact(disk.get(), force, m_call);
+	return Compact(disk.get(), force, incremental, compress, m_gfsMap, m_call);
 }
 
 template<>
@@ -375,6 +433,52 @@ Expected<MergeSnapshots> Factory<MergeSnapshots>::operator()() const
 	}
 }
 
+template<>
+Expected<DedupInfo> Factory<DedupInfo>::operator()() const
+{
+	po::variables_map::const_iterator argIter;
+	if ((argIter = m_vm.find(OPT_DISKPATH)) == m_vm.end())
+		return Expected<DedupInfo>::fromMessage(IDS_ERR_INVALID_HDD);
+
+	QStringList disks;
+	Q_FOREACH(const std::string &arg, argIter->second.as<std::vector<std::string> >())
+	{
+		QString diskPath;
+		if (!applyDiskPath(QString::fromStdString(arg), diskPath))
+			return Expected<DedupInfo>::fromMessage(IDS_ERR_INVALID_HDD);
+		disks << diskPath;
+	}
+
+	quint64 memoryLimitMb = DEDUP_MEMORY_LIMIT;
+	if ((argIter = m_vm.find(OPT_MEMORY_LIMIT)) != m_vm.end())
+		memoryLimitMb = argIter->second.as<quint64>();
+	if (memoryLimitMb == 0)
+		return Expected<DedupInfo>::fromMessage("Invalid memory limit");
+
+	return DedupInfo(DiskAware(disks.first()), disks, memoryLimitMb);
+}
+
+template<>
+Expected<Defrag> Factory<Defrag>::operator()() const
+{
+	Expected<DiskAware> disk = Factory<DiskAware>::build(m_vm);
+	if (!disk.isOk())
+		return disk;
+
+	return Defrag(disk.get(), m_call);
+}
+
+template<>
+Expected<Check> Factory<Check>::operator()() const
+{
+	bool repair = m_vm.count(OPT_REPAIR);
+	Expected<DiskAware> disk = Factory<DiskAware>::build(m_vm);
+	if (!disk.isOk())
+		return disk;
+
+	return Check(disk.get(), repair, m_call);
+}
+
 } // namespace Command
 
 ////////////////////////////////////////////////////////////
@@ -446,7 +550,12 @@ Expected<void> Visitor::createAndExecute() const
 	Abort::Signal s;
 	s.set(m_token);
 	s.start();
-	return cmd.execute();
+	// Estimates are cached only when taken for real, on unchanged images.
+	Cache::Entry::setReadOnly(!m_call || !m_info);
+	Expected<void> res = cmd.execute();
+	if (m_call && !m_info)
+		Cache::Entry::remove(cmd.getDiskPath());
+	return res;
 }
 
 template Expected<void> Visitor::createAndExecute<Resize>() const;
@@ -454,6 +563,9 @@ template Expected<void> Visitor::createAndExecute<ResizeInfo>() const;
 template Expected<void> Visitor::createAndExecute<Compact>() const;
 template Expected<void> Visitor::createAndExecute<CompactInfo>() const;
 template Expected<void> Visitor::createAndExecute<MergeSnapshots>() const;
+template Expected<void> Visitor::createAndExecute<DedupInfo>() const;
+template Expected<void> Visitor::createAndExecute<Defrag>() const;
+template Expected<void> Visitor::createAndExecute<Check>() const;
 
 ////////////////////////////////////////////////////////////
 // UsageVisitor
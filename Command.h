@@ -41,6 +41,7 @@
 #include "GuestFSWrapper.h"
 #include "ImageInfo.h"
 #include "Abort.h"
+#include "Qcow2.h"
 
 namespace Command
 {
@@ -150,10 +151,12 @@ private:
 
 struct Compact: DiskAware
 {
-	Compact(const DiskAware &disk, bool force,
+	Compact(const DiskAware &disk, bool force, bool incremental,
+			const boost::optional<Qcow2::CompressionType> &compress,
+			const GuestFS::Map &gfsMap,
 			const boost::optional<Call> &call):
-		DiskAware(disk),  m_force(force),
-		m_call(call)
+		DiskAware(disk),  m_force(force), m_incremental(incremental),
+		m_compress(compress), m_gfsMap(gfsMap), m_call(call)
 	{
 	}
 
@@ -162,7 +165,12 @@ struct Compact: DiskAware
 
 private:
 	bool m_force;
+	// Process only regions written since the previous compaction.
+	bool m_incremental;
+	// Rewrite data as compressed clusters afterwards.
+	boost::optional<Qcow2::CompressionType> m_compress;
 
+	GuestFS::Map m_gfsMap;
 	boost::optional<Call> m_call;
 };
 
@@ -179,6 +187,57 @@ struct CompactInfo: Default
 	Expected<void> execute() const;
 };
 
+////////////////////////////////////////////////////////////
+// DedupInfo
+
+struct DedupInfo: Default
+{
+	DedupInfo(const DiskAware &disk, const QStringList &disks, quint64 memoryLimitMb):
+		Default(disk), m_disks(disks), m_memoryLimitMb(memoryLimitMb)
+	{
+	}
+
+	Expected<void> execute() const;
+
+private:
+	QStringList m_disks;
+	quint64 m_memoryLimitMb;
+};
+
+////////////////////////////////////////////////////////////
+// Defrag
+
+struct Defrag: Default
+{
+	Defrag(const DiskAware &disk, const boost::optional<Call> &call):
+		Default(disk), m_call(call)
+	{
+	}
+
+	Expected<void> execute() const;
+
+private:
+	boost::optional<Call> m_call;
+};
+
+////////////////////////////////////////////////////////////
+// Check
+
+struct Check: Default
+{
+	Check(const DiskAware &disk, bool repair, const boost::optional<Call> &call):
+		Default(disk), m_repair(repair), m_call(call)
+	{
+	}
+
+	Expected<void> execute() const;
+
+private:
+	// Reclaim leaked clusters.
+	bool m_repair;
+	boost::optional<Call> m_call;
+};
+
 namespace Merge
 {
 namespace External
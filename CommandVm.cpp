@@ -29,12 +29,18 @@
 ///
 ///////////////////////////////////////////////////////////////////////////////
 #include <sys/statvfs.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <sstream>
 #include <iomanip>
 
 #include <QFileInfo>
 #include <QMap>
+#include <QCryptographicHash>
+#include <QMutex>
+#include <QMutexLocker>
 #include <boost/scope_exit.hpp>
+#include <boost/property_tree/json_parser.hpp>
 
 #include "Command.h"
 #include "CommandVm_p.h"
@@ -43,6 +49,13 @@
 #include "GuestFSWrapper.h"
 #include "DiskLock.h"
 #include "Errors.h"
+#include "Dedup.h"
+#include "Qcow2.h"
+#include "Cache.h"
+#include "Probe.h"
+#include "Async.h"
+#include "Nbd.h"
+#include "PartTable.h"
 
 using namespace Command;
 using namespace GuestFS;
@@ -57,12 +70,22 @@ const char VIRT_SPARSIFY[] = "/usr/bin/virt-sparsify";
 const char GUESTFISH[] = "/usr/bin/guestfish";
 
 const char TMP_IMAGE_EXT[] = ".tmp";
+// Persistent dirty bitmap tracking writes since the last compaction.
+const char COMPACT_BITMAP[] = "prl-compact";
+// Sections of the metadata cache.
+const char CACHE_SECTION_RESIZE[] = "resize-info";
+const char CACHE_SECTION_COMPACT[] = "compact-info";
+// Content-keyed store of resize estimates shared by all disks.
+const char CACHE_STORE_RESIZE[] = "resize";
 
 // Numeric constants
 enum {SECTOR_SIZE = 512};
 enum {GPT_DEFAULT_END_SECTS = 127}; // guestfs somehow uses this value.
+enum {ALIGNMENT_SECTS = 128}; // virt-resize aligns partitions to this.
 enum {SWAP_HEADER_SIZE = 4096}; // for compact -i estimates
 enum {VIRT_RESIZE_COPY_SPEED = 10}; // MB/s
+enum {TRIM_MERGE_GAP = 1024 * 1024}; // fewer fstrim calls for scattered writes
+enum {MAX_ANALYSIS_APPLIANCES = 4}; // for filesystems mounted one by one
 
 // Functions
 
@@ -183,6 +206,576 @@ QString printSize(quint64 bytes, SizeUnitType unitType)
 	return QString(out.str().c_str());
 }
 
+typedef QPair<quint64, quint64> range_type;
+
+/* Dirty ranges within [start, start + size) relative to start. */
+QList<range_type> getDeviceRanges(const Qcow2::extentList_type &dirty,
+                                  quint64 start, quint64 size)
+{
+	QList<range_type> ranges;
+	Q_FOREACH(const Qcow2::Extent &extent, dirty)
+	{
+		Qcow2::Extent part = extent.intersect(start, size);
+		if (part.m_size == 0)
+			continue;
+		quint64 offset = part.m_offset - start;
+		if (!ranges.isEmpty() &&
+			ranges.last().first + ranges.last().second + TRIM_MERGE_GAP >= offset)
+			ranges.last().second = offset + part.m_size - ranges.last().first;
+		else
+			ranges << range_type(offset, part.m_size);
+	}
+	return ranges;
+}
+
+boost::optional<Qcow2::Bitmap> findCompactBitmap(const Qcow2::Image &image)
+{
+	Expected<QList<Qcow2::Bitmap> > bitmaps = image.readBitmaps();
+	if (!bitmaps.isOk())
+	{
+		Logger::info(bitmaps.getMessage());
+		return boost::optional<Qcow2::Bitmap>();
+	}
+	Q_FOREACH(const Qcow2::Bitmap &bitmap, bitmaps.get())
+	{
+		if (bitmap.m_name == COMPACT_BITMAP)
+			return bitmap;
+	}
+	return boost::optional<Qcow2::Bitmap>();
+}
+
+void printFragmentation(const Qcow2::Fragmentation &current)
+{
+	Logger::print(QString("Fragmentation: %1%").arg(current.getRatio(), 0, 'f', 1));
+	Logger::print(QString("File size: %1").arg(current.m_fileSize));
+}
+
+void printFragmentation(const Qcow2::Fragmentation &before,
+                        const Qcow2::Fragmentation &after)
+{
+	Logger::print(QString("Fragmentation: %1% -> %2%")
+			.arg(before.getRatio(), 0, 'f', 1).arg(after.getRatio(), 0, 'f', 1));
+	Logger::print(QString("File size: %1 -> %2")
+			.arg(before.m_fileSize).arg(after.m_fileSize));
+}
+
+/* Start tracking writes from now on. */
+void resetCompactBitmap(const QString &path, bool exists, const CallAdapter &adapter)
+{
+	QStringList args;
+	args << "bitmap" << (exists ? "--clear" : "--add");
+	if (exists)
+		args << "--enable";
+	args << path << COMPACT_BITMAP;
+	int ret = adapter.run(QEMU_IMG, args);
+	if (ret)
+	{
+		Logger::error(QString(IDS_ERR_SUBPROGRAM_RETURN_CODE)
+				.arg(QEMU_IMG).arg(args.join(" ")).arg(ret));
+		Logger::error("Next compaction will process the whole disk");
+	}
+}
+
+/* Fast check after operations rewriting metadata: leaked clusters are
+ * reclaimed, other problems are reported. Image must be locked. */
+void checkImage(const QString &path, const CallAdapter &adapter)
+{
+	if (!adapter.hasCall())
+		return;
+	Expected<Qcow2::Image> image = Qcow2::Image::open(path, true);
+	if (!image.isOk())
+		return;
+	Expected<Qcow2::CheckResult> result = image.get().check(true);
+	if (!result.isOk())
+	{
+		Logger::info(result.getMessage());
+		return;
+	}
+	if (result.get().m_repaired > 0)
+	{
+		Logger::info(QString("%1: reclaimed %2 leaked clusters")
+				.arg(path).arg(result.get().m_repaired));
+	}
+	if (result.get().m_corruptions > 0)
+	{
+		Logger::error(QString("%1: %2 errors found, run 'check' for details")
+				.arg(path).arg(result.get().m_corruptions));
+	}
+}
+
+/* Image can be replaced by its rewritten copy: nothing is lost and
+ * there is enough space for the copy. */
+Expected<void> checkRewritable(const Qcow2::Image &image)
+{
+	// Copy is version 3 with 16-bit refcounts, older consumers may not
+	// open an upgraded image.
+	const Qcow2::Header &header = image.getHeader();
+	if (header.m_version < 3)
+	{
+		return Expected<void>::fromMessage(QString("%1 is qcow2 version %2, "
+				"it can not be rewritten").arg(image.getPath()).arg(header.m_version));
+	}
+	if (header.m_refcountOrder != 4)
+	{
+		return Expected<void>::fromMessage(QString("%1 has %2-bit refcounts, "
+				"it can not be rewritten").arg(image.getPath()).arg(1 << header.m_refcountOrder));
+	}
+	Expected<QList<Qcow2::Bitmap> > bitmaps = image.readBitmaps();
+	if (!bitmaps.isOk())
+		return bitmaps;
+	Q_FOREACH(const Qcow2::Bitmap &bitmap, bitmaps.get())
+	{
+		if (bitmap.m_name != COMPACT_BITMAP)
+		{
+			return Expected<void>::fromMessage(
+					QString("Image has persistent bitmap '%1'").arg(bitmap.m_name));
+		}
+		Logger::info(QString("Bitmap '%1' will be dropped").arg(bitmap.m_name));
+	}
+
+	// The copy is never bigger than the image.
+	quint64 size = QFileInfo(image.getPath()).size();
+	quint64 avail = getAvailableSpace(image.getPath());
+	if (size > avail)
+		return Expected<void>::fromMessage(QString(IDS_ERR_NO_FREE_SPACE).arg(size).arg(avail));
+	return Expected<void>();
+}
+
+/* Writes image content in guest order into temporary image which then
+ * replaces the original. Data is compressed if 'compression' is set. */
+Expected<void> rewriteImage(const Qcow2::Image &image,
+                            const boost::optional<Qcow2::CompressionType> &compression,
+                            const Call &call)
+{
+	const Qcow2::Header &header = image.getHeader();
+	Qcow2::Writer::Params params(header.m_size, header.m_clusterBits);
+	if (compression)
+		params.m_compression = *compression;
+	else if (header.m_compressionType == Qcow2::COMPRESSION_ZSTD)
+		params.m_compression = Qcow2::COMPRESSION_ZSTD;
+	else if (header.m_compressionType != Qcow2::COMPRESSION_ZLIB)
+	{
+		return Expected<void>::fromMessage(QString("Unsupported compression type %1")
+				.arg(header.m_compressionType), ERR_UNSUPPORTED_IMAGE);
+	}
+	Expected<QString> backing = image.readBackingFile();
+	if (!backing.isOk())
+		return backing;
+	params.m_backingFile = backing.get();
+	Expected<QString> format = image.readBackingFormat();
+	if (!format.isOk())
+		return format;
+	params.m_backingFormat = format.get();
+
+	QString tmpPath = getTmpImagePath(image.getPath());
+	BOOST_SCOPE_EXIT(&tmpPath)
+	{
+		QFile::remove(tmpPath);
+	} BOOST_SCOPE_EXIT_END
+
+	Expected<boost::shared_ptr<Qcow2::Writer> > writer = Qcow2::Writer::create(tmpPath, params);
+	if (!writer.isOk())
+		return writer;
+	Expected<void> res = compression ?
+		writer.get()->compress(image, call.getToken()) :
+		writer.get()->copy(image, call.getToken());
+	if (!res.isOk())
+		return res;
+	if (!(res = writer.get()->finish()).isOk())
+		return res;
+
+	struct stat st;
+	if (stat(QSTR2UTF8(image.getPath()), &st) ||
+		chmod(QSTR2UTF8(tmpPath), st.st_mode & 07777) ||
+		chown(QSTR2UTF8(tmpPath), st.st_uid, st.st_gid))
+	{
+		return Expected<void>::fromMessage(QString("Unable to copy attributes of %1: %2")
+				.arg(image.getPath()).arg(strerror(errno)));
+	}
+	if (!CallAdapter(call).rename(tmpPath, image.getPath()))
+		return Expected<void>::fromMessage(QString("Unable to rename %1").arg(tmpPath));
+	return Expected<void>();
+}
+
+/* Devices shared by analysis workers. */
+struct DeviceQueue
+{
+	explicit DeviceQueue(const QStringList &devices):
+		m_devices(devices)
+	{
+	}
+
+	/* Empty string if nothing is left. */
+	QString take()
+	{
+		QMutexLocker lock(&m_mutex);
+		return m_devices.isEmpty() ? QString() : m_devices.takeFirst();
+	}
+
+	void clear()
+	{
+		QMutexLocker lock(&m_mutex);
+		m_devices.clear();
+	}
+
+	bool isEmpty()
+	{
+		QMutexLocker lock(&m_mutex);
+		return m_devices.isEmpty();
+	}
+
+private:
+	QMutex m_mutex;
+	QStringList m_devices;
+};
+
+/* Free space of filesystems taken from the queue. A guestfs handle serves
+ * one request at a time, so every worker has its own appliance. */
+struct FreeSpaceJob
+{
+	FreeSpaceJob(const boost::shared_ptr<DeviceQueue> &queue, const QString &path,
+			const boost::optional<Wrapper> &gfs = boost::optional<Wrapper>()):
+		m_queue(queue), m_path(path), m_gfs(gfs)
+	{
+	}
+
+	Expected<quint64> operator()() const
+	{
+		boost::optional<Wrapper> gfs = m_gfs;
+		if (!gfs)
+		{
+			// Others may have finished while we were waiting for a thread.
+			if (m_queue->isEmpty())
+				return 0;
+			Expected<Wrapper> created = Wrapper::createReadOnly(m_path);
+			if (!created.isOk())
+				return created;
+			gfs = created.get();
+		}
+
+		boost::shared_ptr<MountSession> session = gfs->startMountSession();
+		quint64 free = 0;
+		for (QString device = m_queue->take(); !device.isEmpty(); device = m_queue->take())
+		{
+			Expected<struct statvfs> stats = getStats(*gfs, device);
+			if (!stats.isOk())
+			{
+				m_queue->clear();
+				return stats;
+			}
+			quint64 deviceFree = stats.get().f_bfree * stats.get().f_frsize;
+			Logger::info(QString("%1: %2").arg(device).arg(deviceFree));
+			free += deviceFree;
+		}
+		return free;
+	}
+
+private:
+	static Expected<struct statvfs> getStats(const Wrapper &gfs, const QString &device)
+	{
+		Expected<Partition::Unit> unit = gfs.getPartitionList().createUnit(device);
+		if (!unit.isOk())
+			return unit;
+		return unit.get().getFilesystemStats();
+	}
+
+	boost::shared_ptr<DeviceQueue> m_queue;
+	QString m_path;
+	boost::optional<Wrapper> m_gfs;
+};
+
+/* Block size and free space of all filesystems and VGs on the disk. */
+Expected<QPair<quint64, quint64> > getFreeSpace(const Image::Chain &chain)
+{
+	const QString &path = chain.getList().last().getFilename();
+	Expected<Wrapper> gfsRes = Wrapper::createReadOnly(path);
+	if (!gfsRes.isOk())
+		return gfsRes;
+	const Wrapper& gfs = gfsRes.get();
+
+	Expected<quint64> bsizeRes = gfs.getBlockSize();
+	if (!bsizeRes.isOk())
+		return bsizeRes;
+	quint64 blockSize = bsizeRes.get();
+
+	// Something possibly mountable.
+	Expected<QMap<QString, fs_type> > filesystems =
+		gfs.getPartitionList().getFilesystems();
+	if (!filesystems.isOk())
+		return filesystems;
+	quint64 free = 0;
+	QStringList mountable;
+	Q_FOREACH(const QString& device, filesystems.get().keys())
+	{
+		Expected<Partition::Unit> unit = gfs.getPartitionList().createUnit(device);
+		if (!unit.isOk())
+			return unit;
+		if (unit.get().getFilesystem<Unknown>() != NULL ||
+			unit.get().getFilesystem<Fat>() != NULL)
+			continue;
+		if (unit.get().getFilesystem<Swap>() == NULL)
+		{
+			mountable << device;
+			continue;
+		}
+		Expected<quint64> devSize = unit.get().getSize();
+		if (!devSize.isOk())
+			return devSize;
+		quint64 deviceFree = devSize.get() - SWAP_HEADER_SIZE;
+		Logger::info(QString("%1: %2 (%3)")
+					 .arg(device)
+					 .arg(deviceFree)
+					 .arg(deviceFree / blockSize));
+		free += deviceFree;
+	}
+
+	// Mounting takes most of the time, extra appliances boot meanwhile.
+	boost::shared_ptr<DeviceQueue> queue(new DeviceQueue(mountable));
+	QList<Async::Future<quint64> > workers;
+	int extra = qMin<int>(mountable.size(), MAX_ANALYSIS_APPLIANCES) - 1;
+	for (int i = 0; i < extra; ++i)
+		workers << Async::Future<quint64>::run(FreeSpaceJob(queue, path));
+	Expected<quint64> own = FreeSpaceJob(queue, path, gfs)();
+	if (!own.isOk())
+		return own;
+	free += own.get();
+	Q_FOREACH(const Async::Future<quint64> &worker, workers)
+	{
+		Expected<quint64> res = worker.get();
+		if (!res.isOk())
+			return res;
+		free += res.get();
+	}
+
+	Expected<quint64> vgFree = gfs.getVGTotalFree();
+	if (!vgFree.isOk())
+		return vgFree;
+	Logger::info(QString("VGs: %1 (%2)")
+			.arg(vgFree.get()).arg(vgFree.get() / blockSize));
+	free += vgFree.get();
+	return qMakePair(blockSize, free);
+}
+
+/* Exact allocation of the chain from qcow2 metadata.
+ * Empty if metadata cannot be read, estimates are used then. */
+boost::optional<Qcow2::Allocation> getAllocation(const Image::Chain &chain)
+{
+	QList<Qcow2::Image> layers;
+	Q_FOREACH(const Image::Info &info, chain.getList())
+	{
+		Expected<Qcow2::Image> image = Qcow2::Image::open(info.getFilename());
+		if (!image.isOk())
+		{
+			Logger::info(image.getMessage());
+			return boost::none;
+		}
+		layers << image.get();
+	}
+	Expected<Qcow2::Allocation> allocation = Qcow2::Allocation::build(layers);
+	if (!allocation.isOk())
+	{
+		Logger::info(allocation.getMessage());
+		return boost::none;
+	}
+	return allocation.get();
+}
+
+boost::property_tree::ptree saveResizeData(const ResizeData &info)
+{
+	boost::property_tree::ptree data;
+	data.put("min-size", info.m_minSize);
+	data.put("min-size-keep-fs", info.m_minSizeKeepFS);
+	data.put("last-partition", info.m_lastPartition.toStdString());
+	data.put("fs-supported", info.m_fsSupported);
+	data.put("partition-supported", info.m_partitionSupported);
+	data.put("dirty", info.m_dirty);
+	return data;
+}
+
+ResizeData loadResizeData(quint64 currentSize, const boost::property_tree::ptree &data)
+{
+	ResizeData info(currentSize);
+	info.m_minSize = data.get<quint64>("min-size", info.m_minSize);
+	info.m_minSizeKeepFS = data.get<quint64>("min-size-keep-fs", info.m_minSizeKeepFS);
+	info.m_lastPartition = QString::fromStdString(data.get<std::string>("last-partition", ""));
+	info.m_fsSupported = data.get<bool>("fs-supported", true);
+	info.m_partitionSupported = data.get<bool>("partition-supported", true);
+	info.m_dirty = data.get<bool>("dirty", false);
+	return info;
+}
+
+/* Filesystems on partitions of the disk chain, read natively. */
+Expected<QList<Partition::Probed> > probePartitions(const QString &path)
+{
+	Expected<Image::Chain> chain = Image::Unit(path).getChain();
+	if (!chain.isOk())
+		return chain;
+	Expected<boost::shared_ptr<Probe::Disk> > disk = Probe::openDisk(chain.get().getPaths());
+	if (!disk.isOk())
+		return disk;
+	return Partition::probe(*disk.get());
+}
+
+/* Extents of LVM physical volumes on partitions not used by any logical
+ * volume, as disk ranges by group name. Read natively from group metadata.
+ * Groups with volumes outside of the disk are not reported. */
+Expected<QMap<QString, QList<range_type> > > getFreeExtents(const Probe::Disk &disk)
+{
+	Expected<Probe::Table> table = Probe::readTable(disk);
+	if (!table.isOk())
+		return table;
+
+	// Partitions by volume ID, metadata by group name.
+	QMap<QString, int> volumes;
+	QMap<QString, QString> metadata;
+	const QList<Probe::Partition> &partitions = table.get().m_partitions;
+	for (int i = 0; i < partitions.size(); ++i)
+	{
+		Expected<Lvm::Label> label = Lvm::Label::read(disk, partitions[i].m_start);
+		if (!label.isOk())
+		{
+			if (label.getCode() == ERR_UNSUPPORTED_FS)
+				continue;
+			return label;
+		}
+		volumes.insert(label.get().getId(), i);
+		if (label.get().getMetadata().isEmpty())
+			continue;
+		// Copies are written together, differing ones are being updated.
+		QString group = label.get().getGroupName();
+		if (metadata.contains(group) && metadata.value(group) != label.get().getMetadata())
+		{
+			return Expected<void>::fromMessage(
+					QString("Inconsistent metadata of VG '%1'").arg(group));
+		}
+		metadata.insert(group, label.get().getMetadata());
+	}
+
+	QMap<QString, QList<range_type> > result;
+	Q_FOREACH(const QString &group, metadata.keys())
+	{
+		Expected<Lvm::Config> config = Lvm::Config::create(metadata.value(group), group);
+		if (!config.isOk())
+			return config;
+		quint64 extent = config.get().getGroup().getExtentSizeInSectors() * SECTOR_SIZE;
+		QList<range_type> ranges;
+		bool whole = true;
+		Q_FOREACH(const Lvm::Volume &volume, config.get().getVolumes())
+		{
+			if (!volumes.contains(volume.getId()))
+			{
+				whole = false;
+				break;
+			}
+			const Probe::Partition &partition = partitions[volumes.value(volume.getId())];
+			quint64 start = volume.getStartInSectors() * SECTOR_SIZE;
+			if (extent == 0 || start + volume.getSizeInExtents() * extent > partition.m_size)
+			{
+				return Expected<void>::fromMessage(
+						QString("LVM volume %1 does not fit its partition").arg(volume.getId()));
+			}
+			Expected<QList<range_type> > free = config.get().getFreeExtents(volume);
+			if (!free.isOk())
+				return free;
+			Q_FOREACH(const range_type &range, free.get())
+			{
+				ranges << range_type(partition.m_start + start + range.first * extent,
+									 range.second * extent);
+			}
+		}
+		if (whole)
+			result.insert(group, ranges);
+		else
+			Logger::info(QString("VG '%1' is not entirely on the disk").arg(group));
+	}
+	return result;
+}
+
+/* Discards extents no logical volume uses. All of them: lvremove and
+ * lvreduce free extents without writing them, the dirty bitmap misses
+ * these. Returns groups whose free space is done, virt-sparsify finds it
+ * only by filling groups with temporary volumes. */
+Expected<QStringList> discardFreeExtents(const QString &path, bool dryRun)
+{
+	QStringList groups;
+	QList<range_type> ranges;
+	{
+		Expected<Image::Chain> chain = Image::Unit(path).getChain();
+		if (!chain.isOk())
+			return chain;
+		Expected<boost::shared_ptr<Probe::Disk> > disk = Probe::openDisk(chain.get().getPaths());
+		if (!disk.isOk())
+			return disk;
+		Expected<QMap<QString, QList<range_type> > > free = getFreeExtents(*disk.get());
+		if (!free.isOk())
+			return free;
+		groups = free.get().keys();
+		Q_FOREACH(const QString &group, groups)
+		{
+			ranges << free.get().value(group);
+		}
+	}
+	if (ranges.isEmpty())
+		return groups;
+
+	quint64 total = 0;
+	Q_FOREACH(const range_type &range, ranges)
+		total += range.second;
+	if (dryRun)
+	{
+		Logger::info(QString("Discard %1 bytes of free LVM extents in %2").arg(total).arg(path));
+		return groups;
+	}
+	Logger::info(QString("Free LVM extents: %1").arg(total));
+
+	// Read-only disk is closed, the image is locked by the export.
+	Expected<boost::shared_ptr<Nbd::Export> > nbd = Nbd::Export::open(path, true);
+	if (!nbd.isOk())
+		return nbd;
+	// Contents of free extents do not matter, clusters are just dropped.
+	Q_FOREACH(const range_type &range, ranges)
+	{
+		Expected<void> res = nbd.get()->trim(range.first, range.second);
+		if (!res.isOk())
+			return res;
+	}
+	Expected<void> res = nbd.get()->flush();
+	if (!res.isOk())
+		return res;
+	return groups;
+}
+
+/* Identity of everything resize estimates depend on: disk size, partition
+ * table and the last filesystem with its change marker. Read natively,
+ * without appliance. Empty if filesystem has no usable marker. */
+QString getResizeKey(const Image::Chain &chain)
+{
+	Expected<boost::shared_ptr<Probe::Disk> > disk = Probe::openDisk(chain.getPaths());
+	if (!disk.isOk())
+	{
+		Logger::info(disk.getMessage());
+		return QString();
+	}
+	Expected<Probe::Table> table = Probe::readTable(*disk.get());
+	if (!table.isOk() || table.get().m_partitions.isEmpty())
+		return QString();
+
+	const QList<Probe::Partition> &partitions = table.get().m_partitions;
+	int last = 0;
+	for (int i = 1; i < partitions.size(); ++i)
+	{
+		if (partitions[i].getEnd() > partitions[last].getEnd())
+			last = i;
+	}
+	Expected<QString> fs = Probe::readFsStamp(*disk.get(), partitions[last].m_start);
+	if (!fs.isOk() || fs.get().isEmpty())
+		return QString();
+
+	return QString("%1:%2:%3").arg(disk.get()->getSize())
+		.arg(QString(QCryptographicHash::hash(table.get().m_raw, QCryptographicHash::Md5).toHex()))
+		.arg(fs.get());
+}
+
 } // namespace
 
 namespace Command
@@ -264,6 +857,14 @@ Expected<Partition::Unit> ResizeHelper::getLastPartition()
 Expected<ResizeData> ResizeHelper::getResizeData()
 {
 	ResizeData info(m_image.getVirtualSize());
+	// Empty table needs no appliance.
+	Expected<Probe::Table> table = readTable();
+	if (table.isOk() && table.get().m_partitions.isEmpty())
+	{
+		info.m_minSizeKeepFS = 0;
+		return info;
+	}
+
 	Expected<Partition::Unit> lastPartition = getLastPartition();
 	if (!lastPartition.isOk())
 	{
@@ -280,6 +881,8 @@ Expected<ResizeData> ResizeHelper::getResizeData()
 	Expected<Wrapper> gfs = getGFSReadonly();
 	if (!gfs.isOk())
 		return gfs;
+	// Minimum size and statistics may both need the filesystem mounted.
+	boost::shared_ptr<MountSession> session = gfs.get().startMountSession();
 
 	Expected<Partition::Stats> stats = lastPartition.get().getStats();
 	if (!stats.isOk())
@@ -364,7 +967,23 @@ Expected<void> ResizeHelper::shrinkFSIfNeeded(quint64 mb)
 	{
 		// Shrinking empty space is not enough.
 		// We have to resize filesystem ourselves.
-		return lastPartition.get().shrinkContent(-fsDelta.get());
+		quint64 dec = -fsDelta.get();
+		Expected<Partition::Stats> stats = lastPartition.get().getStats();
+		if (!stats.isOk())
+			return stats;
+		// Data placement may hold minimum size above the target.
+		Expected<quint64> minSize = lastPartition.get().getMinSize();
+		if (minSize.isOk() && stats.get().size > dec &&
+			minSize.get() > stats.get().size - dec)
+		{
+			Logger::info(QString("Minimum size %1 is above %2, packing %3")
+					.arg(minSize.get()).arg(stats.get().size - dec)
+					.arg(lastPartition.get().getName()));
+			Expected<bool> packed = lastPartition.get().packContent();
+			if (!packed.isOk())
+				return packed;
+		}
+		return lastPartition.get().shrinkContent(dec);
 	}
 	return Expected<void>();
 }
@@ -386,11 +1005,7 @@ Expected<void> ResizeHelper::expandToFit(quint64 mb, const Wrapper &gfs)
 	/* Getting partition table type fails on non-resized GPT.
 	 * So we take it from original image.
 	 */
-	Expected<Wrapper> oldGFS = getGFSReadonly();
-	if (!oldGFS.isOk())
-		return oldGFS;
-
-	Expected<QString> partTable = oldGFS.get().getPartitionTable();
+	Expected<QString> partTable = getPartitionTable();
 	if (!partTable.isOk())
 		return partTable;
 
@@ -477,6 +1092,57 @@ Expected<Wrapper> ResizeHelper::getGFSReadonly()
 	return m_gfsMap.getReadonly(m_image.getFilename());
 }
 
+Expected<Probe::Table> ResizeHelper::readTable() const
+{
+	Expected<Image::Chain> chain = Image::Unit(m_image.getFilename()).getChain();
+	if (!chain.isOk())
+		return chain;
+	Expected<boost::shared_ptr<Probe::Disk> > disk = Probe::openDisk(chain.get().getPaths());
+	if (!disk.isOk())
+		return disk;
+	return Probe::readTable(*disk.get());
+}
+
+Expected<void> ResizeHelper::expandGPT(const QString &path)
+{
+	QString target = path.isEmpty() ? m_image.getFilename() : path;
+	// Dry run shows appliance actions.
+	if (m_call)
+	{
+		Expected<boost::shared_ptr<Nbd::Export> > disk = Nbd::Export::open(target, true);
+		Expected<void> res = disk;
+		if (disk.isOk())
+			res = PartTable::expandGpt(*disk.get());
+		if (res.isOk())
+			return res;
+		Logger::info(res.getMessage());
+	}
+
+	Expected<Wrapper> gfs = getGFSWritable(target);
+	if (!gfs.isOk())
+		return gfs;
+	return gfs.get().expandGPT();
+}
+
+Expected<QString> ResizeHelper::getPartitionTable()
+{
+	Expected<Probe::Table> table = readTable();
+	if (table.isOk())
+		return table.get().m_type;
+	// libguestfs knows more table types, e.g. whole-disk filesystems.
+	Logger::info(table.getMessage());
+
+	Expected<Wrapper> gfs = getGFSReadonly();
+	if (!gfs.isOk())
+		return gfs;
+	return gfs.get().getPartitionTable();
+}
+
+Expected<QList<Partition::Probed> > ResizeHelper::probePartitions() const
+{
+	return ::probePartitions(m_image.getFilename());
+}
+
 Expected<Partition::Stats> ResizeHelper::expandPartition(
 	const Partition::Unit &partition, quint64 mb,
 	const QString &partTable, const Wrapper &gfs)
@@ -629,19 +1295,503 @@ Expected<void> ResizeHelper::shrinkContent(quint64 mb, VirtResize &resize)
 	if (!lastPartition.isOk())
 		return Expected<void>(lastPartition);
 
-	Expected<bool> logical = lastPartition.get().isLogical();
-	if (!logical.isOk())
-		return Expected<void>(logical);
-	if (logical.get())
+	Expected<bool> logical = lastPartition.get().isLogical();
+	if (!logical.isOk())
+		return Expected<void>(logical);
+	if (logical.get())
+	{
+		Expected<Partition::Unit> container = gfs.get().getContainer();
+		if (!container.isOk())
+			return container;
+
+		return shrinkContent(Resizer::Partition::Extended(
+					container.get(), lastPartition.get()), mb, resize);
+	}
+	return shrinkContent(Resizer::Partition::Primary(lastPartition.get()), mb, resize);
+}
+
+Expected<void> ResizeHelper::shrinkContent(const Layout::Plan &plan, VirtResize &resize)
+{
+	Expected<Wrapper> gfs = getGFSWritable();
+	if (!gfs.isOk())
+		return gfs;
+
+	Expected<void> res;
+	Q_FOREACH(const Layout::Target &target, plan.m_targets)
+	{
+		Expected<Partition::Unit> unit = gfs.get().getPartitionList().createUnit(
+				target.m_source.m_name);
+		if (!unit.isOk())
+			return unit;
+		// Swap contents are dropped rather than moved.
+		bool swap = unit.get().getFilesystem<Swap>() != NULL;
+		if (target.m_size >= target.m_source.m_size && !(swap && target.isMoved()))
+			continue;
+		if (!(res = unit.get().resizeContent(target.m_size)).isOk())
+			return res;
+	}
+
+	// virt-resize packs partitions in order, so moves need no arguments.
+	for (int i = 0; i < plan.m_targets.size() - 1; ++i)
+	{
+		const Layout::Target &target = plan.m_targets[i];
+		if (target.isResized())
+			resize.resizeForce(target.m_source.m_name, target.m_size);
+	}
+	// The last one takes what is left.
+	const Layout::Target &last = plan.m_targets.last();
+	Expected<Partition::Unit> unit = gfs.get().getPartitionList().createUnit(
+			last.m_source.m_name);
+	if (!unit.isOk())
+		return unit;
+	Resizer::Partition::Primary(unit.get()).fillVirtResize(last.m_size, resize);
+	return Expected<void>();
+}
+
+Expected<Layout::Plan> ResizeHelper::planLayout(quint64 mb)
+{
+	Expected<Wrapper> gfs = getGFSWritable();
+	if (!gfs.isOk())
+		return gfs;
+	Expected<quint64> sectorSize = gfs.get().getSectorSize();
+	if (!sectorSize.isOk())
+		return sectorSize;
+	Expected<quint64> overhead = gfs.get().getVirtResizeOverhead();
+	if (!overhead.isOk())
+		return overhead;
+	quint64 size = convertMbToBytes(mb);
+	if (size <= overhead.get())
+		return Expected<void>::fromMessage(QString("Disk size %1 is below overhead").arg(size));
+
+	Expected<QList<Partition::Unit> > partitions = gfs.get().getPartitions();
+	if (!partitions.isOk())
+		return partitions;
+	// Minimum sizes may need filesystems mounted.
+	boost::shared_ptr<MountSession> session = gfs.get().startMountSession();
+	QList<Layout::Partition> layout;
+	Q_FOREACH(const Partition::Unit &unit, partitions.get())
+	{
+		Expected<bool> extended = unit.isExtended();
+		if (!extended.isOk())
+			return extended;
+		if (extended.get())
+		{
+			return Expected<void>::fromMessage(QString("%1: extended partition layout is not planned")
+					.arg(unit.getName()), ERR_UNSUPPORTED_PARTITION);
+		}
+		Expected<Partition::Stats> stats = unit.getStats();
+		if (!stats.isOk())
+			return stats;
+
+		Layout::Partition partition(unit.getName(), stats.get().start, stats.get().size);
+		Expected<quint64> minSize = unit.getMinSize();
+		if (minSize.isOk())
+			partition.m_minSize = qMin(minSize.get(), partition.m_size);
+		else
+			Logger::info(QString("%1: %2, keeping size").arg(unit.getName()).arg(minSize.getMessage()));
+		// Physical volume is resized in whole extents.
+		const Volume::Physical *pv = unit.getFilesystem<Volume::Physical>();
+		if (pv != NULL)
+			partition.m_step = pv->getPhysical().getGroup().getExtentSizeInSectors() * SECTOR_SIZE;
+		// Unrecognized content (e.g. BIOS boot) may be referenced by absolute sectors.
+		partition.m_movable = unit.getFilesystem<Unknown>() == NULL;
+		layout << partition;
+	}
+
+	// Same space as virt-resize leaves for itself.
+	Layout::Geometry geometry(size - overhead.get(), ALIGNMENT_SECTS * sectorSize.get());
+	Expected<Layout::Plan> plan = Layout::Planner(layout, geometry).plan();
+	if (plan.isOk())
+		Logger::info(QString("Layout plan moves %1 bytes").arg(plan.get().getMovedBytes()));
+	return plan;
+}
+
+Expected<void> ResizeHelper::relocate(
+		const Layout::Plan &plan, quint64 mb, const QString &snapshot)
+{
+	// Dry run shows virt-resize command line.
+	if (!m_call)
+		return Expected<void>::fromMessage("Dry run", ERR_UNSUPPORTED_IMAGE);
+	if (!Nbd::Export::isAvailable())
+		return Expected<void>::fromMessage("Relocation needs NBD support", ERR_UNSUPPORTED_IMAGE);
+	// Allocation is read natively, it fails before any change if unsupported.
+	Expected<Qcow2::extentList_type> allocated = readAllocated();
+	if (!allocated.isOk())
+		return allocated;
+
+	Relocate::Checkpoint checkpoint(m_image.getFilename());
+	checkpoint.m_snapshot = snapshot;
+	checkpoint.m_size = convertMbToBytes(mb);
+	Q_FOREACH(const Layout::Step &step, plan.m_steps)
+	{
+		const Layout::Target &target = plan.m_targets[step.m_target];
+		if (step.m_action == Layout::Step::MOVE)
+		{
+			checkpoint.m_moves << Relocate::Move(target.m_source.m_start, target.m_start,
+					qMin(target.m_size, target.m_source.m_size));
+		}
+	}
+	quint64 sectorSize;
+	{
+		Expected<Wrapper> gfs = getGFSWritable();
+		if (!gfs.isOk())
+			return gfs;
+		Expected<QString> partTable = gfs.get().getPartitionTable();
+		if (!partTable.isOk())
+			return partTable;
+		checkpoint.m_gpt = partTable.get() == "gpt";
+		Expected<quint64> sectorSizeRes = gfs.get().getSectorSize();
+		if (!sectorSizeRes.isOk())
+			return sectorSizeRes;
+		sectorSize = sectorSizeRes.get();
+	}
+
+	// Interrupted table change is rolled back to the snapshot on resume.
+	Expected<void> res = checkpoint.save();
+	if (!res.isOk())
+		return res;
+	res = moveEntries(plan, sectorSize);
+	if (res.isOk())
+	{
+		checkpoint.m_table = true;
+		res = checkpoint.save();
+	}
+	if (res.isOk())
+	{
+		// qemu-nbd needs the image unlocked.
+		m_gfsMap.close(m_image.getFilename());
+		res = relocate(checkpoint, allocated.get());
+	}
+	if (res.isOk())
+		return res;
+
+	// Caller rolls back to the snapshot while it exists.
+	if (!checkpoint.m_snapshot.isEmpty())
+		checkpoint.remove();
+	// Table is changed, virt-resize must not run on it.
+	if (res.getCode() == ERR_UNSUPPORTED_IMAGE)
+		return Expected<void>::fromMessage(res.getMessage());
+	return res;
+}
+
+Expected<void> ResizeHelper::moveEntries(const Layout::Plan &plan, quint64 sectorSize)
+{
+	// Table is changed first, so a resumed run needs no appliance.
+	Expected<Wrapper> gfs = getGFSWritable();
+	if (!gfs.isOk())
+		return gfs;
+	Expected<void> res;
+	if (!(res = gfs.get().deactivateVGs()).isOk())
+		return res;
+	Q_FOREACH(const Layout::Step &step, plan.m_steps)
+	{
+		const Layout::Target &target = plan.m_targets[step.m_target];
+		// Moved partition gets its final place at once.
+		if (step.m_action != Layout::Step::MOVE && target.isMoved())
+			continue;
+		Expected<Partition::Unit> unit = gfs.get().getPartitionList().createUnit(
+				target.m_source.m_name);
+		if (!unit.isOk())
+			return unit;
+		res = gfs.get().resizePartition(unit.get(), target.m_start / sectorSize,
+				(target.m_start + target.m_size) / sectorSize - 1);
+		if (!res.isOk())
+			return res;
+	}
+	return gfs.get().sync();
+}
+
+Expected<void> ResizeHelper::relocate(Relocate::Checkpoint &checkpoint)
+{
+	Logger::info(QString("Relocating partitions of %1").arg(checkpoint.m_path));
+	if (!checkpoint.m_table)
+	{
+		// Nothing is moved yet, the table may be half changed.
+		Logger::info(QString("Rolling back to snapshot %1").arg(checkpoint.m_snapshot));
+		Image::Unit unit(m_image.getFilename());
+		Expected<void> res;
+		if (!(res = unit.applySnapshot(checkpoint.m_snapshot, m_adapter)).isOk())
+			return res;
+		if (!(res = unit.deleteSnapshot(checkpoint.m_snapshot, m_adapter)).isOk())
+			return res;
+		if (m_call)
+			checkpoint.remove();
+		return res;
+	}
+
+	Qcow2::extentList_type allocated;
+	if (m_call && checkpoint.m_current < checkpoint.m_moves.size())
+	{
+		Expected<Qcow2::extentList_type> res = readAllocated();
+		if (!res.isOk())
+			return res;
+		allocated = res.get();
+	}
+	return relocate(checkpoint, allocated);
+}
+
+Expected<void> ResizeHelper::relocate(Relocate::Checkpoint &checkpoint,
+		const Qcow2::extentList_type &allocated)
+{
+	Expected<void> res;
+	if (!m_call)
+	{
+		// Dry run shows what is left.
+		for (int i = checkpoint.m_current; i < checkpoint.m_moves.size(); ++i)
+		{
+			const Relocate::Move &move = checkpoint.m_moves[i];
+			quint64 done = i == checkpoint.m_current ? checkpoint.m_done : 0;
+			Logger::info(QString("Move %1 bytes from %2 to %3, %4 done")
+					.arg(move.m_size).arg(move.m_src).arg(move.m_dst).arg(done));
+		}
+	}
+	else if (checkpoint.m_current < checkpoint.m_moves.size())
+	{
+		Expected<boost::shared_ptr<Nbd::Export> > disk = Nbd::Export::open(
+				m_image.getFilename(), true);
+		if (!disk.isOk())
+			return disk;
+		Relocate::Engine engine(*disk.get(), allocated, m_call->getToken());
+		if (!(res = engine.run(checkpoint)).isOk())
+			return res;
+	}
+
+	// Images with snapshots can not be truncated.
+	if (!checkpoint.m_snapshot.isEmpty())
+	{
+		res = Image::Unit(m_image.getFilename()).deleteSnapshot(checkpoint.m_snapshot, m_adapter);
+		if (!res.isOk())
+			return res;
+		checkpoint.m_snapshot.clear();
+		if (m_call && !(res = checkpoint.save()).isOk())
+			return res;
+	}
+
+	QStringList args;
+	args << "resize" << "--shrink" << m_image.getFilename() << QString::number(checkpoint.m_size);
+	int ret = m_adapter.run(QEMU_IMG, args);
+	if (ret)
+	{
+		return Expected<void>::fromMessage(QString(IDS_ERR_SUBPROGRAM_RETURN_CODE)
+		                                   .arg(QEMU_IMG).arg(args.join(" ")).arg(ret));
+	}
+	if (checkpoint.m_gpt && !(res = expandGPT()).isOk())
+		return res;
+	if (m_call)
+		checkpoint.remove();
+	return res;
+}
+
+Expected<Qcow2::extentList_type> ResizeHelper::readAllocated() const
+{
+	Expected<QList<Qcow2::Image> > layers = openLayers();
+	if (!layers.isOk())
+		return layers;
+	Expected<Qcow2::Allocation> allocation = Qcow2::Allocation::build(layers.get());
+	if (!allocation.isOk())
+		return allocation;
+	return allocation.get().unite(0, allocation.get().getLayerCount() - 1);
+}
+
+Expected<QList<Qcow2::Image> > ResizeHelper::openLayers() const
+{
+	// Dry run shows virt-resize command line.
+	if (!m_call)
+		return Expected<void>::fromMessage("Dry run", ERR_UNSUPPORTED_IMAGE);
+
+	Expected<Image::Chain> chain = Image::Unit(m_image.getFilename()).getChain();
+	if (!chain.isOk())
+		return chain;
+	QList<Qcow2::Image> layers;
+	Q_FOREACH(const Image::Info &info, chain.get().getList())
+	{
+		Expected<Qcow2::Image> layer = Qcow2::Image::open(info.getFilename());
+		if (!layer.isOk())
+			return layer;
+		if (!layers.isEmpty() &&
+			layer.get().getHeader().m_clusterBits != layers.last().getHeader().m_clusterBits)
+		{
+			return Expected<void>::fromMessage(QString("%1: cluster size differs in backing chain")
+					.arg(layer.get().getPath()), ERR_UNSUPPORTED_IMAGE);
+		}
+		// Otherwise found only while copying, after the source is changed.
+		quint32 compression = layer.get().getHeader().m_compressionType;
+		if (!Qcow2::isCompressionSupported(compression))
+		{
+			return Expected<void>::fromMessage(QString("%1: compression type %2 is not supported")
+					.arg(layer.get().getPath()).arg(compression), ERR_UNSUPPORTED_IMAGE);
+		}
+		layers << layer.get();
+	}
+	return layers;
+}
+
+Expected<void> ResizeHelper::copyLayers(
+		const QList<Qcow2::Image> &layers, quint64 mb, const QString &dst) const
+{
+	Qcow2::Writer::Params params(convertMbToBytes(mb), layers.last().getHeader().m_clusterBits);
+	Expected<boost::shared_ptr<Qcow2::Writer> > writer = Qcow2::Writer::create(dst, params);
+	if (!writer.isOk())
+		return writer;
+	Expected<void> res = writer.get()->copy(layers, params.m_size, m_call->getToken());
+	if (!res.isOk())
+		return res;
+	return writer.get()->finish();
+}
+
+Expected<void> ResizeHelper::copyTruncated(quint64 mb, const QString &dst)
+{
+	Expected<QList<Qcow2::Image> > layers = openLayers();
+	if (!layers.isOk())
+		return layers;
+
+	quint64 size = convertMbToBytes(mb);
+	QString partTable;
+	Expected<Probe::Table> table = readTable();
+	if (table.isOk())
+	{
+		partTable = table.get().m_type;
+		quint64 end = size;
+		if (partTable == "gpt")
+			end -= GPT_DEFAULT_END_SECTS * SECTOR_SIZE;
+		Q_FOREACH(const Probe::Partition &partition, table.get().m_partitions)
+		{
+			if (partition.getEnd() > end)
+			{
+				return Expected<void>::fromMessage(QString("Partition at %1 does not fit into new disk")
+						.arg(partition.m_start), ERR_UNSUPPORTED_IMAGE);
+			}
+		}
+	}
+	else
+	{
+		Logger::info(table.getMessage());
+		Expected<Wrapper> gfs = getGFSReadonly();
+		if (!gfs.isOk())
+			return gfs;
+		Expected<QString> partTableRes = gfs.get().getPartitionTable();
+		if (!partTableRes.isOk())
+			return partTableRes;
+		partTable = partTableRes.get();
+		Expected<quint64> sectorSize = gfs.get().getSectorSize();
+		if (!sectorSize.isOk())
+			return sectorSize;
+		quint64 end = size;
+		if (partTable == "gpt")
+			end -= GPT_DEFAULT_END_SECTS * sectorSize.get();
+
+		Expected<QList<Partition::Unit> > partitions = gfs.get().getPartitions();
+		if (!partitions.isOk())
+			return partitions;
+		Q_FOREACH(const Partition::Unit &unit, partitions.get())
+		{
+			Expected<Partition::Stats> stats = unit.getStats();
+			if (!stats.isOk())
+				return stats;
+			if (stats.get().end >= end)
+			{
+				return Expected<void>::fromMessage(QString("%1 does not fit into new disk")
+						.arg(unit.getName()), ERR_UNSUPPORTED_IMAGE);
+			}
+		}
+	}
+
+	Expected<void> res = copyLayers(layers.get(), mb, dst);
+	if (!res.isOk())
+		return res;
+	if (partTable != "gpt")
+		return Expected<void>();
+	// Backup GPT header was left beyond the end of the new disk.
+	return expandGPT(dst);
+}
+
+Expected<void> ResizeHelper::copySparse(quint64 mb, const QString &dst)
+{
+	Expected<QList<Qcow2::Image> > layers = openLayers();
+	if (!layers.isOk())
+		return layers;
+
+	Expected<Wrapper> gfs = getGFSWritable();
+	if (!gfs.isOk())
+		return gfs;
+	Expected<Partition::Unit> lastPartition = gfs.get().getLastPartition();
+	if (!lastPartition.isOk())
+		return lastPartition;
+	Expected<bool> logical = lastPartition.get().isLogical();
+	if (!logical.isOk())
+		return logical;
+	if (logical.get() || lastPartition.get().getFilesystem<Volume::Physical>() != NULL)
+	{
+		return Expected<void>::fromMessage(QString("%1: native copy is not supported")
+				.arg(lastPartition.get().getName()), ERR_UNSUPPORTED_IMAGE);
+	}
+
+	Expected<QString> partTable = gfs.get().getPartitionTable();
+	if (!partTable.isOk())
+		return partTable;
+	Expected<quint64> sectorSize = gfs.get().getSectorSize();
+	if (!sectorSize.isOk())
+		return sectorSize;
+	Expected<Partition::Stats> stats = lastPartition.get().getStats();
+	if (!stats.isOk())
+		return stats;
+	// Same layout as virt-resize --shrink produces.
+	Expected<Partition::Stats> newStats = calculateNewPartition(
+			mb, stats.get(), sectorSize.get(), partTable.get());
+	if (!newStats.isOk())
+		return newStats;
+
+	// Discarded blocks become unallocated clusters and are not copied.
+	Expected<QList<Partition::Unit> > partitions = gfs.get().getPartitions();
+	if (!partitions.isOk())
+		return partitions;
+	Q_FOREACH(const Partition::Unit &unit, partitions.get())
+	{
+		if (unit.getFilesystem<Swap>() != NULL)
+		{
+			// Only the header is copied.
+			Expected<Partition::Stats> unitStats = unit.getStats();
+			if (!unitStats.isOk())
+				return unitStats;
+			Expected<void> res = unit.resizeContent(unit.getName() == lastPartition.get().getName() ?
+					newStats.get().size : unitStats.get().size);
+			if (!res.isOk())
+				return res;
+			continue;
+		}
+		if (unit.getFilesystem<Ext>() == NULL && unit.getFilesystem<Xfs>() == NULL &&
+			unit.getFilesystem<Ntfs>() == NULL && unit.getFilesystem<Btrfs>() == NULL)
+			continue;
+		// Whole filesystem, ntfs-3g rejects ranges.
+		Expected<void> res = gfs.get().trim(unit.getName(), QList<QPair<quint64, quint64> >());
+		if (!res.isOk())
+			Logger::info(QString("%1: %2, copying all blocks").arg(unit.getName()).arg(res.getMessage()));
+	}
+
+	Expected<void> res;
+	if (newStats.get().end < stats.get().end)
 	{
-		Expected<Partition::Unit> container = gfs.get().getContainer();
-		if (!container.isOk())
-			return container;
+		res = gfs.get().resizePartition(lastPartition.get(),
+				stats.get().start / sectorSize.get(),
+				newStats.get().end / sectorSize.get());
+		if (!res.isOk())
+			return res;
+	}
+	if (!(res = gfs.get().sync()).isOk())
+		return res;
 
-		return shrinkContent(Resizer::Partition::Extended(
-					container.get(), lastPartition.get()), mb, resize);
+	// Source is changed already, virt-resize must not run on it.
+	if (!(res = copyLayers(layers.get(), mb, dst)).isOk())
+	{
+		if (res.getCode() == ERR_UNSUPPORTED_IMAGE)
+			return Expected<void>::fromMessage(res.getMessage());
+		return res;
 	}
-	return shrinkContent(Resizer::Partition::Primary(lastPartition.get()), mb, resize);
+
+	if (partTable.get() != "gpt")
+		return Expected<void>();
+	// Backup GPT header was left beyond the end of the new disk.
+	return expandGPT(dst);
 }
 
 ////////////////////////////////////////////////////////////
@@ -693,11 +1843,7 @@ namespace Resizer
 
 Expected<mode_type> getModeIgnore(ResizeHelper& helper, quint64 sizeMb)
 {
-	Expected<Wrapper> gfs = helper.getGFSReadonly();
-	if (!gfs.isOk())
-		return Expected<void>(gfs);
-
-	Expected<QString> partTable = gfs.get().getPartitionTable();
+	Expected<QString> partTable = helper.getPartitionTable();
 	if (!partTable.isOk())
 	{
 		if (partTable.getCode() == ERR_NO_PARTITION_TABLE)
@@ -719,6 +1865,19 @@ Expected<mode_type> getModeIgnore(ResizeHelper& helper, quint64 sizeMb)
 
 Expected<mode_type> getModeConsider(ResizeHelper &helper, quint64 sizeMb)
 {
+	// Appliance confirms only what is not recognized, it knows more types.
+	Expected<QList<GuestFS::Partition::Probed> > probed = helper.probePartitions();
+	if (probed.isOk() &&
+		boost::get<GuestFS::Unknown>(&probed.get().last().m_filesystem) == NULL)
+	{
+		if (helper.getImage().getVirtualSize() > convertMbToBytes(sizeMb))
+			return mode_type(Consider::Shrink());
+		else
+			return mode_type(Consider::Expand());
+	}
+	else if (!probed.isOk())
+		Logger::info(probed.getMessage());
+
 	Expected<GuestFS::Partition::Unit> lastPartition = helper.getLastPartition();
 	if (lastPartition.isOk())
 	{
@@ -795,7 +1954,17 @@ Expected<void> Shrink<VirtResize>::execute(
 		QFile::remove(tmpPath.get());
 	} BOOST_SCOPE_EXIT_END
 
-	Expected<void> res;
+	// Partitions stay in place, so there is nothing to do but truncate.
+	Expected<void> res = helper.copyTruncated(sizeMb, tmpPath.get());
+	if (res.isOk())
+	{
+		adapter.rename(tmpPath.get(), image.getFilename());
+		return res;
+	}
+	if (res.getCode() != ERR_UNSUPPORTED_IMAGE)
+		return res;
+	Logger::info(res.getMessage());
+
 	if (!(res = VirtResize(adapter)(image.getFilename(), tmpPath.get(), sizeMb)).isOk())
 		return res;
 	adapter.rename(tmpPath.get(), image.getFilename());
@@ -899,8 +2068,41 @@ Expected<void> Consider::Shrink::execute(ResizeHelper& helper, quint64 sizeMb) c
 
 	VirtResize resize(adapter);
 	Expected<void> res;
-	if (!(res = helper.shrinkContent(sizeMb, resize)).isOk())
-		return res;
+	// Free space is not necessarily in the last partition.
+	Expected<Layout::Plan> plan = helper.planLayout(sizeMb);
+	if (!plan.isOk())
+		Logger::info(plan.getMessage());
+	if (plan.isOk() && plan.get().isMoving())
+	{
+		if (!(res = helper.shrinkContent(plan.get(), resize)).isOk())
+			return res;
+		// Copies data of moved partitions only.
+		res = helper.relocate(plan.get(), sizeMb, snapshot.get());
+		if (res.isOk())
+		{
+			// Snapshot is already dropped, nothing to roll back.
+			QFile::remove(tmpPath.get());
+			return res;
+		}
+		if (res.getCode() != ERR_UNSUPPORTED_IMAGE)
+			return res;
+		Logger::info(res.getMessage());
+	}
+	else
+	{
+		if (!(res = helper.shrinkContent(sizeMb, resize)).isOk())
+			return res;
+		res = helper.copySparse(sizeMb, tmpPath.get());
+		if (res.isOk())
+		{
+			adapter.rename(tmpPath.get(), image.getFilename());
+			return res;
+		}
+		if (res.getCode() != ERR_UNSUPPORTED_IMAGE)
+			return res;
+		Logger::info(res.getMessage());
+	}
+
 	// We are going to execute virt-resize while handle is opered.
 	Expected<Wrapper> gfs = helper.getGFSWritable();
 	if (!gfs.isOk())
@@ -988,11 +2190,7 @@ Expected<void> Gpt<Ignore::Expand>::execute(ResizeHelper& helper, quint64 sizeMb
 		return res;
 
 	// Windows does not see additional space if backup GPT header is not moved.
-	Expected<Wrapper> gfs = helper.getGFSWritable();
-	if (!gfs.isOk())
-		return gfs;
-
-	return gfs.get().expandGPT();
+	return helper.expandGPT();
 }
 
 } // namespace Resizer
@@ -1148,6 +2346,27 @@ Expected<void> Resize::execute() const
 	Expected<boost::shared_ptr<DiskLockGuard> > hddGuard = DiskLockGuard::openWrite(getDiskPath());
 	if (!hddGuard.isOk())
 		return hddGuard;
+
+	GuestFS::Map gfsMap(m_gfsMap);
+	// Interrupted relocation left the disk half done and a snapshot behind.
+	boost::optional<Relocate::Checkpoint> checkpoint = Relocate::Checkpoint::load(getDiskPath());
+	if (checkpoint)
+	{
+		Expected<Image::Chain> chain = Image::Unit(getDiskPath()).getChain();
+		if (!chain.isOk())
+			return chain;
+		Expected<void> res = ResizeHelper(chain.get().getList().last(), gfsMap, m_call)
+			.relocate(*checkpoint);
+		// Dry run can not tell what follows the pending relocation.
+		if (!res.isOk() || !m_call)
+			return res;
+	}
+
+	// Mode selection considering partitions always inspects the disk.
+	// Appliance boots while the chain is parsed.
+	if (m_resizeLastPartition)
+		gfsMap.launchReadonly(getDiskPath());
+
 	Expected<Image::Chain> result = Image::Unit(getDiskPath()).getChainNoSnapshots();
 	if (!result.isOk())
 		return result;
@@ -1155,16 +2374,24 @@ Expected<void> Resize::execute() const
 	if (convertMbToBytes(m_sizeMb) == snapshotChain.getList().last().getVirtualSize())
 		return Expected<void>();
 
-	ResizeHelper helper(snapshotChain.getList().last(), m_gfsMap, m_call);
+	{
+		// GuestFS handles are closed when helper goes out of scope.
+		ResizeHelper helper(snapshotChain.getList().last(), gfsMap, m_call);
 
-	Expected<Resizer::mode_type> mode = m_resizeLastPartition ?
-		Resizer::getModeConsider(helper, m_sizeMb) :
-		Resizer::getModeIgnore(helper, m_sizeMb);
+		Expected<Resizer::mode_type> mode = m_resizeLastPartition ?
+			Resizer::getModeConsider(helper, m_sizeMb) :
+			Resizer::getModeIgnore(helper, m_sizeMb);
 
-	if (!mode.isOk())
-		return mode;
+		if (!mode.isOk())
+			return mode;
+
+		Expected<void> res = boost::apply_visitor(Visitor::Resize(helper, m_sizeMb), mode.get());
+		if (!res.isOk())
+			return res;
+	}
 
-	return boost::apply_visitor(Visitor::Resize(helper, m_sizeMb), mode.get());
+	checkImage(snapshotChain.getList().last().getFilename(), CallAdapter(m_call));
+	return Expected<void>();
 }
 
 ////////////////////////////////////////////////////////////
@@ -1179,11 +2406,50 @@ Expected<void> ResizeInfo::execute() const
 	if (!result.isOk())
 		return result;
 	Image::Chain snapshotChain = result.get();
-	ResizeHelper resizer(snapshotChain.getList().last(), GuestFS::Map());
-	Expected<ResizeData> infoRes = resizer.getResizeData();
-	if (!infoRes.isOk())
-		return infoRes;
-	infoRes.get().print(m_unitType);
+
+	quint64 currentSize = snapshotChain.getList().last().getVirtualSize();
+	Cache::Entry cache = Cache::Entry::load(getDiskPath());
+	boost::optional<boost::property_tree::ptree> cached = cache.get(CACHE_SECTION_RESIZE);
+	if (cached)
+	{
+		loadResizeData(currentSize, *cached).print(m_unitType);
+		return Expected<void>();
+	}
+
+	Expected<void> res = cache.bind(snapshotChain.getPaths());
+	if (!res.isOk())
+		Logger::info(res.getMessage());
+	// Image changed, but guest filesystem might not (e.g. idle VM).
+	QString key = getResizeKey(snapshotChain);
+	if (!key.isEmpty())
+		cached = Cache::Store::get(CACHE_STORE_RESIZE, key);
+	if (cached)
+	{
+		Logger::info(QString("Filesystem is unchanged: %1").arg(key));
+		loadResizeData(currentSize, *cached).print(m_unitType);
+		cache.put(CACHE_SECTION_RESIZE, *cached);
+	}
+	else
+	{
+		ResizeHelper resizer(snapshotChain.getList().last(), GuestFS::Map());
+		Expected<ResizeData> infoRes = resizer.getResizeData();
+		if (!infoRes.isOk())
+			return infoRes;
+		infoRes.get().print(m_unitType);
+
+		boost::property_tree::ptree data = saveResizeData(infoRes.get());
+		cache.put(CACHE_SECTION_RESIZE, data);
+		// Dirty estimates are not bound to filesystem state.
+		if (!key.isEmpty() && !infoRes.get().m_dirty)
+		{
+			res = Cache::Store::put(CACHE_STORE_RESIZE, key, data);
+			if (!res.isOk())
+				Logger::info(res.getMessage());
+		}
+	}
+	res = cache.save(snapshotChain.getPaths());
+	if (!res.isOk())
+		Logger::info(res.getMessage());
 	return Expected<void>();
 }
 
@@ -1197,35 +2463,219 @@ Expected<void> Compact::execute() const
 		return hddGuard;
 	CallAdapter adapter(m_call);
 
+	// Writes since the previous compaction, if they are known.
+	boost::optional<Qcow2::Bitmap> bitmap;
+	boost::optional<Qcow2::extentList_type> dirty;
+	Expected<Qcow2::Image> image = Qcow2::Image::open(getDiskPath());
+	if (image.isOk())
+		bitmap = findCompactBitmap(image.get());
+	bool incremental = m_incremental;
+	// Persistent bitmaps are a version 3 feature, qemu-img can not add one.
+	if (incremental && image.isOk() && image.get().getHeader().m_version < 3)
+	{
+		Logger::info(QString("%1 is qcow2 version %2, incremental compaction needs version 3, "
+				"compacting the whole disk").arg(getDiskPath())
+				.arg(image.get().getHeader().m_version));
+		incremental = false;
+	}
+	if (m_compress)
+	{
+		// Snapshots are not copied into the compressed image.
+		Expected<void> res = Image::Unit(getDiskPath()).checkSnapshots();
+		if (!res.isOk())
+			return res;
+		if (!image.isOk())
+			return image;
+		if (!(res = checkRewritable(image.get())).isOk())
+			return res;
+	}
+	if (incremental && bitmap && !bitmap->isInUse() && bitmap->isEnabled())
+	{
+		Expected<Qcow2::extentList_type> extents = image.get().readDirty(*bitmap);
+		if (!extents.isOk())
+			return extents;
+		dirty = extents.get();
+		quint64 changed = 0;
+		Q_FOREACH(const Qcow2::Extent &extent, *dirty)
+			changed += extent.m_size;
+		Logger::info(QString("Changed since the previous compaction: %1").arg(changed));
+		if (dirty->isEmpty() && !m_compress)
+			return Expected<void>();
+	}
+	else if (incremental)
+		Logger::info("No valid dirty bitmap, compacting the whole disk");
+
 	QStringList args;
 	args << "--machine-readable" << "--in-place" << getDiskPath();
+	// Discarding free extents is safe, failures are left to virt-sparsify.
+	Expected<QStringList> lvm = discardFreeExtents(getDiskPath(), !m_call);
+	if (!lvm.isOk())
+		Logger::info(lvm.getMessage());
+	else
+	{
+		Q_FOREACH(const QString &group, lvm.get())
+			args << "--ignore" << group;
+	}
+	// Filesystems left to virt-sparsify.
+	int remaining = 0;
+	{
+		GuestFS::Map gfsMap(m_gfsMap);
+		// Partitioned disks without LVM need no appliance to be classified.
+		QList<Partition::Probed> partitions;
+		// Logical volumes and whole disk filesystems.
+		QMap<QString, fs_type> volumes;
+		Expected<QList<Partition::Probed> > probed = probePartitions(getDiskPath());
+		if (probed.isOk())
+			partitions = probed.get();
+		else
+		{
+			Logger::info(probed.getMessage());
+			Expected<Wrapper> gfsRes = gfsMap.getReadonly(getDiskPath());
+			if (!gfsRes.isOk())
+				return gfsRes;
+			const Wrapper& gfs = gfsRes.get();
+
+			Expected<QList<Partition::Unit> > units = gfs.getPartitions();
+			if (!units.isOk())
+				return units;
+			QStringList partNames;
+			Q_FOREACH(const Partition::Unit &unit, units.get())
+				partNames << unit.getName();
+
+			// Something possibly mountable.
+			Expected<QMap<QString, fs_type> > filesystems =
+				gfs.getPartitionList().getFilesystems();
+			if (!filesystems.isOk())
+				return filesystems;
+			Q_FOREACH(const QString& device, filesystems.get().keys())
+			{
+				Expected<Partition::Unit> unit = gfs.getPartitionList().createUnit(device);
+				if (!unit.isOk())
+					return unit;
+				if (!partNames.contains(device))
+				{
+					volumes.insert(device, unit.get().getFilesystem());
+					continue;
+				}
+				Expected<Partition::Stats> stats = unit.get().getStats();
+				if (!stats.isOk())
+					return stats;
+				partitions << Partition::Probed(device, stats.get(), unit.get().getFilesystem());
+			}
+		}
 
-	Expected<Wrapper> gfsRes = Wrapper::createReadOnly(getDiskPath());
-	if (!gfsRes.isOk())
-		return gfsRes;
-	const Wrapper& gfs = gfsRes.get();
+		Q_FOREACH(const QString& device, volumes.keys())
+		{
+			// virt-sparsify fails on FAT because fstrim() is unimplemented
+			fs_type filesystem = volumes.value(device);
+			if (boost::get<Fat>(&filesystem) != NULL)
+				args << "--ignore" << device;
+			// Processed entirely.
+			else
+				++remaining;
+		}
 
-	// Something possibly mountable.
-	Expected<QMap<QString, fs_type> > filesystems =
-		gfs.getPartitionList().getFilesystems();
-	if (!filesystems.isOk())
-		return filesystems;
-	Q_FOREACH(const QString& device, filesystems.get().keys())
+		QStringList trims;
+		QStringList swaps;
+		Q_FOREACH(const Partition::Probed &partition, partitions)
+		{
+			const QString &device = partition.m_name;
+			const fs_type &filesystem = partition.m_filesystem;
+			const Partition::Stats &stats = partition.m_stats;
+			if (boost::get<Fat>(&filesystem) != NULL)
+			{
+				args << "--ignore" << device;
+				continue;
+			}
+			// Swap partition is discarded behind its header here.
+			if (boost::get<Swap>(&filesystem) != NULL)
+			{
+				args << "--ignore" << device;
+				if (dirty && getDeviceRanges(*dirty, stats.start, stats.size).isEmpty())
+					Logger::info(QString("%1: unchanged").arg(device));
+				else
+					swaps << device;
+				continue;
+			}
+			if (!dirty)
+			{
+				++remaining;
+				continue;
+			}
+
+			// Blocks freed by deletions are mostly outside of the written
+			// ranges, so changed filesystems are trimmed whole.
+			if (getDeviceRanges(*dirty, stats.start, stats.size).isEmpty())
+			{
+				Logger::info(QString("%1: unchanged").arg(device));
+				args << "--ignore" << device;
+			}
+			else if (boost::get<Ext>(&filesystem) != NULL ||
+					 boost::get<Xfs>(&filesystem) != NULL ||
+					 boost::get<Btrfs>(&filesystem) != NULL ||
+					 boost::get<Ntfs>(&filesystem) != NULL)
+			{
+				args << "--ignore" << device;
+				trims << device;
+			}
+			else
+				++remaining;
+		}
+
+		if (!trims.isEmpty() || !swaps.isEmpty())
+		{
+			// Drops read-only handle.
+			Expected<Wrapper> gfsRes = gfsMap.getWritable(getDiskPath());
+			if (!gfsRes.isOk())
+				return gfsRes;
+			Q_FOREACH(const QString &device, trims)
+			{
+				Expected<void> res = gfsRes.get().trim(device, QList<range_type>());
+				if (!res.isOk())
+					return res;
+			}
+			Q_FOREACH(const QString &device, swaps)
+			{
+				Expected<Partition::Unit> unit = gfsRes.get().getPartitionList().createUnit(device);
+				if (!unit.isOk())
+					return unit;
+				Expected<Partition::Stats> stats = unit.get().getStats();
+				if (!stats.isOk())
+					return stats;
+				// Same size, contents are dropped.
+				Expected<void> res = unit.get().resizeContent(stats.get().size);
+				if (!res.isOk())
+					return res;
+			}
+		}
+	}
+
+	if (!dirty || remaining > 0)
 	{
-		Expected<Partition::Unit> unit = gfs.getPartitionList().createUnit(device);
-		if (!unit.isOk())
-			return unit;
-		// virt-sparsify fails on FAT because fstrim() is unimplemented
-		if (unit.get().getFilesystem<Fat>() != NULL)
-			args << "--ignore" << device;
+		int ret = adapter.run(VIRT_SPARSIFY, args);
+		if (ret)
+		{
+			return Expected<void>::fromMessage(QString(IDS_ERR_SUBPROGRAM_RETURN_CODE)
+											   .arg(VIRT_SPARSIFY).arg(args.join(" ")).arg(ret));
+		}
 	}
 
-	int ret = adapter.run(VIRT_SPARSIFY, args);
-	if (ret)
+	if (m_compress && !m_call)
+		Logger::info(QString("Rewrite %1 compressed").arg(getDiskPath()));
+	else if (m_compress)
 	{
-		return Expected<void>::fromMessage(QString(IDS_ERR_SUBPROGRAM_RETURN_CODE)
-										   .arg(VIRT_SPARSIFY).arg(args.join(" ")).arg(ret));
+		// Sparsified image.
+		Expected<Qcow2::Image> sparse = Qcow2::Image::open(getDiskPath());
+		if (!sparse.isOk())
+			return sparse;
+		Expected<void> res = rewriteImage(sparse.get(), m_compress, m_call.get());
+		if (!res.isOk())
+			return res;
 	}
+
+	// Compressed copy has no bitmaps.
+	if (incremental || bitmap)
+		resetCompactBitmap(getDiskPath(), bitmap && !m_compress, adapter);
 	return Expected<void>();
 }
 
@@ -1242,58 +2692,34 @@ Expected<void> CompactInfo::execute() const
 		return result;
 	Image::Chain snapshotChain = result.get();
 
-	Expected<Wrapper> gfsRes = Wrapper::createReadOnly(
-			snapshotChain.getList().last().getFilename());
-	if (!gfsRes.isOk())
-		return gfsRes;
-	const Wrapper& gfs = gfsRes.get();
-
-	Expected<quint64> bsizeRes = gfs.getBlockSize();
-	if (!bsizeRes.isOk())
-		return bsizeRes;
-	quint64 blockSize = bsizeRes.get();
-
-	// Something possibly mountable.
-	Expected<QMap<QString, fs_type> > filesystems =
-		gfs.getPartitionList().getFilesystems();
-	if (!filesystems.isOk())
-		return filesystems;
-	quint64 free = 0;
-	Q_FOREACH(const QString& device, filesystems.get().keys())
+	Cache::Entry cache = Cache::Entry::load(getDiskPath());
+	boost::optional<boost::property_tree::ptree> cached = cache.get(CACHE_SECTION_COMPACT);
+	quint64 blockSize, free;
+	if (cached)
 	{
-		Expected<Partition::Unit> unit = gfs.getPartitionList().createUnit(device);
-		if (!unit.isOk())
-			return unit;
-		if (unit.get().getFilesystem<Unknown>() != NULL ||
-			unit.get().getFilesystem<Fat>() != NULL)
-			continue;
-		quint64 deviceFree;
-		if (unit.get().getFilesystem<Swap>() != NULL)
-		{
-			Expected<quint64> devSize = unit.get().getSize();
-			if (!devSize.isOk())
-				return devSize;
-			deviceFree = devSize.get() - SWAP_HEADER_SIZE;
-		}
-		else
-		{
-			Expected<struct statvfs> stats = unit.get().getFilesystemStats();
-			if (!stats.isOk())
-				return stats;
-			deviceFree = stats.get().f_bfree * stats.get().f_frsize;
-		}
-		Logger::info(QString("%1: %2 (%3)")
-					 .arg(device)
-					 .arg(deviceFree)
-					 .arg(deviceFree / blockSize));
-		free += deviceFree;
+		blockSize = cached->get<quint64>("block-size", SECTOR_SIZE);
+		free = cached->get<quint64>("free", 0);
 	}
-	Expected<quint64> vgFree = gfs.getVGTotalFree();
-	if (!vgFree.isOk())
-		return vgFree;
-	Logger::info(QString("VGs: %1 (%2)")
-			.arg(vgFree.get()).arg(vgFree.get() / blockSize));
-	free += vgFree.get();
+	else
+	{
+		Expected<void> res = cache.bind(snapshotChain.getPaths());
+		if (!res.isOk())
+			Logger::info(res.getMessage());
+		Expected<QPair<quint64, quint64> > space = getFreeSpace(snapshotChain);
+		if (!space.isOk())
+			return space;
+		blockSize = space.get().first;
+		free = space.get().second;
+
+		boost::property_tree::ptree data;
+		data.put("block-size", blockSize);
+		data.put("free", free);
+		cache.put(CACHE_SECTION_COMPACT, data);
+		res = cache.save(snapshotChain.getPaths());
+		if (!res.isOk())
+			Logger::info(res.getMessage());
+	}
+
 	quint64 size = snapshotChain.getList().last().getVirtualSize();
 	// Approximate: qemu-img does not provide a way to get allocated block count.
 	quint64 allocated = snapshotChain.getList().last().getActualSize();
@@ -1306,6 +2732,101 @@ Expected<void> CompactInfo::execute() const
 	return Expected<void>();
 }
 
+////////////////////////////////////////////////////////////
+// DedupInfo
+
+Expected<void> DedupInfo::execute() const
+{
+	QList<boost::shared_ptr<DiskLockGuard> > guards;
+	Q_FOREACH(const QString &disk, m_disks)
+	{
+		Expected<boost::shared_ptr<DiskLockGuard> > guard = DiskLockGuard::openRead(disk);
+		if (!guard.isOk())
+			return guard;
+		guards << guard.get();
+	}
+
+	Expected<boost::property_tree::ptree> report =
+		Dedup::Analyzer(m_disks, m_memoryLimitMb << 20).analyze();
+	if (!report.isOk())
+		return report;
+
+	std::ostringstream out;
+	boost::property_tree::write_json(out, report.get());
+	Logger::print(QString::fromStdString(out.str()));
+	return Expected<void>();
+}
+
+////////////////////////////////////////////////////////////
+// Defrag
+
+Expected<void> Defrag::execute() const
+{
+	Expected<boost::shared_ptr<DiskLockGuard> > hddGuard = DiskLockGuard::openWrite(getDiskPath());
+	if (!hddGuard.isOk())
+		return hddGuard;
+	Expected<Image::Chain> chain = Image::Unit(getDiskPath()).getChainNoSnapshots();
+	if (!chain.isOk())
+		return chain;
+	QString path = chain.get().getList().last().getFilename();
+
+	Expected<Qcow2::Image> image = Qcow2::Image::open(path);
+	if (!image.isOk())
+		return image;
+	Expected<Qcow2::Fragmentation> before = Qcow2::Fragmentation::measure(image.get());
+	if (!before.isOk())
+		return before;
+	Expected<void> res = checkRewritable(image.get());
+	if (!res.isOk())
+		return res;
+	if (!m_call)
+	{
+		printFragmentation(before.get());
+		return Expected<void>();
+	}
+	if (!(res = rewriteImage(image.get(), boost::optional<Qcow2::CompressionType>(),
+			m_call.get())).isOk())
+		return res;
+
+	Expected<Qcow2::Image> result = Qcow2::Image::open(path);
+	if (!result.isOk())
+		return result;
+	Expected<Qcow2::Fragmentation> after = Qcow2::Fragmentation::measure(result.get());
+	if (!after.isOk())
+		return after;
+	printFragmentation(before.get(), after.get());
+	return Expected<void>();
+}
+
+////////////////////////////////////////////////////////////
+// Check
+
+Expected<void> Check::execute() const
+{
+	bool repair = m_repair && m_call;
+	Expected<boost::shared_ptr<DiskLockGuard> > hddGuard = repair ?
+		DiskLockGuard::openWrite(getDiskPath()) : DiskLockGuard::openRead(getDiskPath());
+	if (!hddGuard.isOk())
+		return hddGuard;
+	Expected<Qcow2::Image> image = Qcow2::Image::open(getDiskPath(), repair);
+	if (!image.isOk())
+		return image;
+	Expected<Qcow2::CheckResult> result = image.get().check(repair);
+	if (!result.isOk())
+		return result;
+
+	Q_FOREACH(const QString &message, result.get().m_messages)
+		Logger::print(message);
+	Logger::print(QString("Clusters in use: %1").arg(result.get().m_clusters));
+	Logger::print(QString("Leaked clusters: %1").arg(result.get().m_leaks));
+	if (result.get().m_repaired > 0)
+		Logger::print(QString("Reclaimed clusters: %1").arg(result.get().m_repaired));
+	Logger::print(QString("Errors: %1").arg(result.get().m_corruptions));
+	if (result.get().m_corruptions > 0)
+		return Expected<void>::fromMessage(QString("%1 is corrupted").arg(getDiskPath()));
+	return Expected<void>();
+}
+
 namespace Merge
 {
 namespace External
@@ -1316,6 +2837,15 @@ namespace External
 
 quint64 Direct::getNeededSpace(const Image::Chain &snapshotChain) const
 {
+	boost::optional<Qcow2::Allocation> allocation = getAllocation(snapshotChain);
+	if (allocation)
+	{
+		// Base receives everything allocated above it.
+		const Qcow2::Allocation &a = *allocation;
+		return Qcow2::Allocation::getSize(a.unite(0, a.getLayerCount() - 1)) -
+			   Qcow2::Allocation::getSize(a.getLayer(0));
+	}
+
 	quint64	virtualSizeMax = snapshotChain.getVirtualSizeMax();
 	const QList<Image::Info> chain = snapshotChain.getList();
 	// A'[n] = A[n]
@@ -1349,6 +2879,21 @@ Expected<void> Direct::doCommit(const QList<Image::Info> &chain) const
 
 quint64 Sequential::getNeededSpace(const Image::Chain &snapshotChain) const
 {
+	boost::optional<Qcow2::Allocation> allocation = getAllocation(snapshotChain);
+	if (allocation)
+	{
+		// Each image receives everything allocated above it.
+		const Qcow2::Allocation &a = *allocation;
+		int top = a.getLayerCount() - 1;
+		quint64 delta = 0;
+		for (int i = top - 1; i >= 0; --i)
+		{
+			delta += Qcow2::Allocation::getSize(a.unite(i, top)) -
+					 Qcow2::Allocation::getSize(a.getLayer(i));
+		}
+		return delta;
+	}
+
 	// Base image is resized in-place.
 	quint64	actualSizeSum = snapshotChain.getActualSizeSum(),
 			virtualSizeMax = snapshotChain.getVirtualSizeMax();
@@ -1399,7 +2944,11 @@ Expected<void> Executor::execute() const
 	}
 
 	Image::Chain snapshotChain = result.get();
-	return execute(snapshotChain);
+	Expected<void> res = execute(snapshotChain);
+	// Checked before the lock is released.
+	if (res.isOk())
+		checkImage(getDiskPath(), m_adapter);
+	return res;
 }
 
 Expected<void> Executor::execute(const Image::Chain &snapshotChain) const
@@ -1422,6 +2971,22 @@ Expected<void> Internal::execute() const
 	if (!hddGuard.isOk())
 		return hddGuard;
 
+	// All snapshots at once, qemu-img rewrites refcounts for each of them.
+	Expected<Qcow2::Image> image = Qcow2::Image::open(getDiskPath(), m_adapter.hasCall());
+	if (image.isOk())
+	{
+		Logger::info(QString("Delete %1 snapshots of %2")
+				.arg(image.get().getHeader().m_nbSnapshots).arg(getDiskPath()));
+		if (!m_adapter.hasCall())
+			return Expected<void>();
+		Expected<void> res = image.get().deleteSnapshots();
+		if (res.isOk())
+			checkImage(getDiskPath(), m_adapter);
+		if (res.isOk() || res.getCode() != ERR_UNSUPPORTED_IMAGE)
+			return res;
+		Logger::info(res.getMessage());
+	}
+
 	Expected<QStringList> snapshots = Image::Unit(getDiskPath()).getSnapshots();
 	if (!snapshots.isOk())
 		return snapshots;
@@ -1433,6 +2998,7 @@ Expected<void> Internal::execute() const
 			return res;
 	}
 
+	checkImage(getDiskPath(), m_adapter);
 	return Expected<void>();
 }
 
@@ -33,6 +33,9 @@
 
 #include "Command.h"
 #include "GuestFSWrapper.h"
+#include "Layout.h"
+#include "Relocate.h"
+#include "Probe.h"
 #include "Util.h"
 #include "Errors.h"
 
@@ -83,6 +86,12 @@ struct ResizeHelper
 	Expected<void> mergeIntoPrevious(const QString &path);
 	Expected<GuestFS::Wrapper> getGFSWritable(const QString &path = QString());
 	Expected<GuestFS::Wrapper> getGFSReadonly();
+	/* Partition table type, read natively if possible. */
+	Expected<QString> getPartitionTable();
+	/* Partitions with filesystems recognized without appliance. */
+	Expected<QList<GuestFS::Partition::Probed> > probePartitions() const;
+	/* Moves backup GPT header to the end of the disk, natively if possible. */
+	Expected<void> expandGPT(const QString &path = QString());
 
 	template <class T>
 	Expected<void> resizeContent(const T &partition, qint64 delta);
@@ -90,7 +99,23 @@ struct ResizeHelper
 	template <class T>
 	Expected<void> shrinkContent(const T &partition, quint64 mb, VirtResize &resize);
 	Expected<void> shrinkContent(quint64 mb, VirtResize &resize);
-
+	/* Shrinks content as planned, virt-resize moves partitions. */
+	Expected<void> shrinkContent(const Layout::Plan &plan, VirtResize &resize);
+	/* Layout of all partitions fitting 'mb' with fewest bytes moved. */
+	Expected<Layout::Plan> planLayout(quint64 mb);
+	/* Moves partitions inside the image as planned, 'snapshot' is dropped
+	 * when done. Fails with ERR_UNSUPPORTED_IMAGE before changing anything
+	 * if it can not. */
+	Expected<void> relocate(const Layout::Plan &plan, quint64 mb, const QString &snapshot);
+	/* Moves data, truncates the image and fixes GPT as checkpointed.
+	 * Rolls back to the snapshot if the table change was interrupted. */
+	Expected<void> relocate(Relocate::Checkpoint &checkpoint);
+	/* Natively copies shrunk disk into 'dst' skipping unused blocks.
+	 * Fails with ERR_UNSUPPORTED_IMAGE before changing the source if
+	 * virt-resize should be used. */
+	Expected<void> copySparse(quint64 mb, const QString &dst);
+	/* Same, but partitions are not changed and must fit into new disk. */
+	Expected<void> copyTruncated(quint64 mb, const QString &dst);
 
 	const boost::optional<Call>& getCall() const
 	{
@@ -109,6 +134,16 @@ private:
 			quint64 mb, const GuestFS::Partition::Stats &stats,
 			quint64 sectorSize, const QString &partTable);
 	Expected<qint64> calculateFSDelta(quint64 mb, const GuestFS::Partition::Unit &lastPartition);
+	Expected<QList<Qcow2::Image> > openLayers() const;
+	/* Partition table without appliance. */
+	Expected<Probe::Table> readTable() const;
+	/* Guest ranges allocated anywhere in the chain. */
+	Expected<Qcow2::extentList_type> readAllocated() const;
+	Expected<void> moveEntries(const Layout::Plan &plan, quint64 sectorSize);
+	Expected<void> relocate(Relocate::Checkpoint &checkpoint,
+	                        const Qcow2::extentList_type &allocated);
+	Expected<void> copyLayers(const QList<Qcow2::Image> &layers,
+	                          quint64 mb, const QString &dst) const;
 
 private:
 	const Image::Info &m_image;
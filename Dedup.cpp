@@ -0,0 +1,739 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Dedup.cpp
+///
+/// Duplicate cluster analysis across images and backing chains.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+#include <string.h>
+
+#include <QFileInfo>
+#include <QMap>
+#include <QMutexLocker>
+#include <QThread>
+#include <QCryptographicHash>
+#include <QtEndian>
+#include <QtConcurrentMap>
+
+#include <boost/optional.hpp>
+
+#include "Dedup.h"
+#include "ImageInfo.h"
+#include "Util.h"
+
+using namespace Dedup;
+
+namespace pt = boost::property_tree;
+
+namespace
+{
+
+const char TMP_TEMPLATE[] = "/tmp/prl-disk-tool-dedup.XXXXXX";
+
+enum {MIN_BUCKET_RECORDS = 1024};
+enum {BASE_CANDIDATES = 10};
+
+bool isZero(const char *buf, quint64 size)
+{
+	return buf[0] == 0 && !memcmp(buf, buf + 1, size - 1);
+}
+
+////////////////////////////////////////////////////////////
+// Job
+
+/* One L2 table of a layer. */
+struct Job
+{
+	const Qcow2::Image *m_image;
+	quint32 m_layer;
+	quint64 m_l1Index;
+	quint64 m_l2Offset;
+	// Allocation bitmap of the layer, jobs write disjoint words.
+	quint64 *m_allocated;
+};
+
+////////////////////////////////////////////////////////////
+// HashState
+
+struct HashState
+{
+	HashState(Index &index, quint64 chunkSize, int layers):
+		m_index(index), m_chunkSize(chunkSize),
+		m_dataChunks(layers, 0), m_zeroChunks(layers, 0)
+	{
+	}
+
+	void setError(const Expected<void> &error)
+	{
+		QMutexLocker l(&m_mutex);
+		if (m_result.isOk())
+			m_result = error;
+	}
+
+	bool isFailed()
+	{
+		QMutexLocker l(&m_mutex);
+		return !m_result.isOk();
+	}
+
+	Index &m_index;
+	quint64 m_chunkSize;
+	QMutex m_mutex;
+	Expected<void> m_result;
+	QVector<quint64> m_dataChunks;
+	QVector<quint64> m_zeroChunks;
+};
+
+////////////////////////////////////////////////////////////
+// HashJob
+
+struct HashJob
+{
+	typedef void result_type;
+
+	explicit HashJob(HashState &state):
+		m_state(&state)
+	{
+	}
+
+	void operator()(const Job &job) const
+	{
+		if (m_state->isFailed())
+			return;
+		Expected<void> res = execute(job);
+		if (!res.isOk())
+			m_state->setError(res);
+	}
+
+private:
+	Expected<void> execute(const Job &job) const
+	{
+		const Qcow2::Image &image = *job.m_image;
+		Expected<QVector<quint64> > l2 = image.readL2(job.m_l2Offset);
+		if (!l2.isOk())
+			return l2;
+
+		quint64 clusterSize = image.getClusterSize();
+		quint64 chunkSize = m_state->m_chunkSize;
+		quint64 chunksPerCluster = clusterSize / chunkSize;
+		quint64 first = job.m_l1Index * l2.get().size();
+		QByteArray buf(clusterSize, 0);
+		QVector<Record> records;
+		quint64 data = 0, zero = 0;
+
+		for (int i = 0; i < l2.get().size(); ++i)
+		{
+			quint64 cluster = first + i;
+			if (cluster * clusterSize >= image.getHeader().m_size)
+				break;
+			Qcow2::Cluster c = image.decode(l2.get()[i]);
+			if (c.m_type == Qcow2::Cluster::UNALLOCATED)
+				continue;
+			job.m_allocated[cluster / 64] |= 1ULL << (cluster % 64);
+			if (!c.hasData())
+				continue;
+
+			Expected<void> res = image.readCluster(c, buf.data());
+			if (!res.isOk())
+				return res;
+			for (quint64 j = 0; j < chunksPerCluster; ++j)
+			{
+				const char *chunk = buf.constData() + j * chunkSize;
+				if (isZero(chunk, chunkSize))
+				{
+					++zero;
+					continue;
+				}
+				QByteArray digest = QCryptographicHash::hash(
+						QByteArray::fromRawData(chunk, chunkSize), QCryptographicHash::Md5);
+				const uchar *d = reinterpret_cast<const uchar *>(digest.constData());
+				Record r;
+				r.m_hashHi = qFromBigEndian<quint64>(d);
+				r.m_hashLo = qFromBigEndian<quint64>(d + 8);
+				r.m_chunk = cluster * chunksPerCluster + j;
+				r.m_layer = job.m_layer;
+				r.m_reserved = 0;
+				records.append(r);
+				++data;
+			}
+		}
+
+		Expected<void> res = m_state->m_index.add(records);
+		if (!res.isOk())
+			return res;
+		QMutexLocker l(&m_state->m_mutex);
+		m_state->m_dataChunks[job.m_layer] += data;
+		m_state->m_zeroChunks[job.m_layer] += zero;
+		return Expected<void>();
+	}
+
+	HashState *m_state;
+};
+
+////////////////////////////////////////////////////////////
+// ScanJob
+
+/* Groups records of one bucket by content and by guest offset. */
+struct ScanJob
+{
+	typedef void result_type;
+	// Expected has no default constructor, QtConcurrent results need one.
+	typedef boost::optional<Expected<Stats> > slot_type;
+
+	ScanJob(const Index &index, const QList<Layer> &layers,
+			const QList<Disk> &disks, quint64 chunkSize, slot_type *results):
+		m_index(&index), m_layers(&layers), m_disks(&disks),
+		m_chunkSize(chunkSize), m_results(results)
+	{
+	}
+
+	void operator()(quint32 bucket) const
+	{
+		m_results[bucket] = execute(bucket);
+	}
+
+private:
+	Expected<Stats> execute(quint32 bucket) const
+	{
+		Expected<QVector<Record> > res = m_index->readBucket(bucket);
+		if (!res.isOk())
+			return res;
+		std::sort(res.get().data(), res.get().data() + res.get().size());
+		const QVector<Record> &records = res.get();
+
+		Context ctx(m_layers->size(), m_disks->size());
+		int n = records.size();
+		for (int i = 0, j; i < n; i = j)
+		{
+			for (j = i + 1; j < n && records[j].isSameContent(records[i]); ++j)
+				;
+			ctx.m_stats.m_chunks += j - i;
+			++ctx.m_stats.m_unique;
+			if (j - i < 2)
+				continue;
+			ctx.m_stats.m_redundant += j - i - 1;
+			processContent(records, i, j, ctx);
+
+			for (int a = i, b; a < j; a = b)
+			{
+				for (b = a + 1; b < j && records[b].m_chunk == records[a].m_chunk; ++b)
+					;
+				if (b - a > 1)
+					processOffset(records, a, b, ctx);
+			}
+		}
+		return ctx.m_stats;
+	}
+
+	/* Scratch space, marks are valid while they equal the current stamp. */
+	struct Context
+	{
+		Context(int layers, int disks):
+			m_stats(layers, disks), m_stamp(0),
+			m_layerStamp(layers, 0), m_layerCount(layers, 0),
+			m_diskStamp(disks, 0)
+		{
+		}
+
+		Stats m_stats;
+		quint64 m_stamp;
+		QVector<quint64> m_layerStamp;
+		QVector<quint64> m_layerCount;
+		QVector<quint64> m_diskStamp;
+	};
+
+	bool isVisible(const Layer::User &user, quint64 chunk) const
+	{
+		Q_FOREACH(int upper, user.m_upper)
+		{
+			if (m_layers->at(upper).isAllocated(chunk * m_chunkSize))
+				return false;
+		}
+		return true;
+	}
+
+	/* Same content anywhere: account per layer and per disk chain. */
+	void processContent(const QVector<Record> &records, int begin, int end,
+			Context &ctx) const
+	{
+		quint64 content = ++ctx.m_stamp;
+		QVector<int> distinct;
+		for (int k = begin; k < end; ++k)
+		{
+			quint32 layer = records[k].m_layer;
+			++ctx.m_stats.m_layerDuplicate[layer];
+			if (ctx.m_layerStamp[layer] != content)
+			{
+				ctx.m_layerStamp[layer] = content;
+				ctx.m_layerCount[layer] = 0;
+				distinct << layer;
+			}
+			++ctx.m_layerCount[layer];
+		}
+		if (distinct.size() < 2)
+			return;
+
+		quint64 disks = ++ctx.m_stamp;
+		Q_FOREACH(int layer, distinct)
+		{
+			Q_FOREACH(const Layer::User &user, m_layers->at(layer).m_users)
+			{
+				if (ctx.m_diskStamp[user.m_disk] == disks)
+					continue;
+				ctx.m_diskStamp[user.m_disk] = disks;
+
+				int inChain = 0;
+				quint64 stored = 0;
+				Q_FOREACH(int l, m_disks->at(user.m_disk).m_chain)
+				{
+					if (ctx.m_layerStamp[l] != content)
+						continue;
+					++inChain;
+					stored += ctx.m_layerCount[l];
+				}
+				if (inChain < distinct.size())
+					ctx.m_stats.m_diskOutside[user.m_disk] += stored;
+			}
+		}
+	}
+
+	/* Same content at the same guest offset: estimate savings for each
+	 * layer used as a common base. A disk benefits if it sees this content
+	 * and the layer is not in its chain yet. */
+	void processOffset(const QVector<Record> &records, int begin, int end,
+			Context &ctx) const
+	{
+		quint64 stamp = ++ctx.m_stamp;
+		quint64 chunk = records[begin].m_chunk;
+		quint64 visible = 0;
+		for (int k = begin; k < end; ++k)
+		{
+			Q_FOREACH(const Layer::User &user, m_layers->at(records[k].m_layer).m_users)
+			{
+				if (ctx.m_diskStamp[user.m_disk] == stamp || !isVisible(user, chunk))
+					continue;
+				ctx.m_diskStamp[user.m_disk] = stamp;
+				++visible;
+			}
+		}
+
+		for (int k = begin; k < end; ++k)
+		{
+			quint32 base = records[k].m_layer;
+			quint64 covered = 0;
+			Q_FOREACH(const Layer::User &user, m_layers->at(base).m_users)
+			{
+				if (ctx.m_diskStamp[user.m_disk] == stamp)
+					++covered;
+			}
+			ctx.m_stats.m_baseSavings[base] += visible - covered;
+		}
+	}
+
+	const Index *m_index;
+	const QList<Layer> *m_layers;
+	const QList<Disk> *m_disks;
+	quint64 m_chunkSize;
+	slot_type *m_results;
+};
+
+struct SavingsGreater
+{
+	explicit SavingsGreater(const QVector<quint64> &savings):
+		m_savings(&savings)
+	{
+	}
+
+	bool operator()(int lhs, int rhs) const
+	{
+		return m_savings->at(lhs) > m_savings->at(rhs);
+	}
+
+private:
+	const QVector<quint64> *m_savings;
+};
+
+} // namespace
+
+namespace Dedup
+{
+
+////////////////////////////////////////////////////////////
+// Layer
+
+bool Layer::isAllocated(quint64 offset) const
+{
+	quint64 cluster = offset >> m_image.getHeader().m_clusterBits;
+	if (cluster / 64 >= (quint64)m_allocated.size())
+		return false;
+	return m_allocated[cluster / 64] & (1ULL << (cluster % 64));
+}
+
+////////////////////////////////////////////////////////////
+// Index
+
+Expected<boost::shared_ptr<Index> > Index::create(quint32 buckets, quint64 bufferSize)
+{
+	quint64 records = qMax<quint64>(MIN_BUCKET_RECORDS, bufferSize / sizeof(Record) / buckets);
+	boost::shared_ptr<Index> index(new Index(records));
+	index->m_buckets.resize(buckets);
+	for (quint32 i = 0; i < buckets; ++i)
+	{
+		boost::shared_ptr<QTemporaryFile> file(new QTemporaryFile(TMP_TEMPLATE));
+		if (!file->open())
+		{
+			return Expected<boost::shared_ptr<Index> >::fromMessage(
+					QString("Unable to create temporary file: %1").arg(file->errorString()));
+		}
+		index->m_buckets[i].m_file = file;
+		index->m_buckets[i].m_mutex.reset(new QMutex());
+	}
+	return index;
+}
+
+Expected<void> Index::add(const QVector<Record> &records)
+{
+	// Grouped first, so each bucket is locked once per call.
+	QVector<QVector<Record> > groups(m_buckets.size());
+	Q_FOREACH(const Record &r, records)
+		groups[r.m_hashLo % m_buckets.size()].append(r);
+
+	for (int bucket = 0; bucket < groups.size(); ++bucket)
+	{
+		if (groups[bucket].isEmpty())
+			continue;
+		Bucket &b = m_buckets[bucket];
+		QMutexLocker l(b.m_mutex.get());
+		b.m_buffer += groups[bucket];
+		if ((quint32)b.m_buffer.size() < m_bucketRecords)
+			continue;
+		Expected<void> res = flush(bucket);
+		if (!res.isOk())
+			return res;
+	}
+	return Expected<void>();
+}
+
+Expected<void> Index::flush()
+{
+	for (quint32 i = 0; i < getBucketCount(); ++i)
+	{
+		QMutexLocker l(m_buckets[i].m_mutex.get());
+		Expected<void> res = flush(i);
+		if (!res.isOk())
+			return res;
+	}
+	return Expected<void>();
+}
+
+Expected<void> Index::flush(quint32 bucket)
+{
+	Bucket &b = m_buckets[bucket];
+	qint64 size = b.m_buffer.size() * sizeof(Record);
+	if (b.m_file->write(reinterpret_cast<const char *>(b.m_buffer.constData()), size) != size)
+	{
+		return Expected<void>::fromMessage(QString("Unable to write %1: %2")
+				.arg(b.m_file->fileName(), b.m_file->errorString()));
+	}
+	b.m_buffer.clear();
+	return Expected<void>();
+}
+
+Expected<QVector<Record> > Index::readBucket(quint32 bucket) const
+{
+	const boost::shared_ptr<QTemporaryFile> &file = m_buckets[bucket].m_file;
+	if (!file->flush() || !file->seek(0))
+	{
+		return Expected<QVector<Record> >::fromMessage(QString("Unable to read %1: %2")
+				.arg(file->fileName(), file->errorString()));
+	}
+	QVector<Record> records(file->size() / sizeof(Record));
+	char *data = reinterpret_cast<char *>(records.data());
+	qint64 size = records.size() * sizeof(Record);
+	for (qint64 done = 0; done < size; )
+	{
+		qint64 ret = file->read(data + done, size - done);
+		if (ret <= 0)
+		{
+			return Expected<QVector<Record> >::fromMessage(QString("Unable to read %1: %2")
+					.arg(file->fileName(), file->errorString()));
+		}
+		done += ret;
+	}
+	return records;
+}
+
+////////////////////////////////////////////////////////////
+// Stats
+
+Stats::Stats(int layers, int disks):
+	m_chunks(0), m_unique(0), m_redundant(0),
+	m_layerDuplicate(layers, 0), m_diskOutside(disks, 0),
+	m_baseSavings(layers, 0)
+{
+}
+
+Stats& Stats::operator+=(const Stats &rhs)
+{
+	m_chunks += rhs.m_chunks;
+	m_unique += rhs.m_unique;
+	m_redundant += rhs.m_redundant;
+	for (int i = 0; i < m_layerDuplicate.size(); ++i)
+	{
+		m_layerDuplicate[i] += rhs.m_layerDuplicate[i];
+		m_baseSavings[i] += rhs.m_baseSavings[i];
+	}
+	for (int i = 0; i < m_diskOutside.size(); ++i)
+		m_diskOutside[i] += rhs.m_diskOutside[i];
+	return *this;
+}
+
+////////////////////////////////////////////////////////////
+// Analyzer
+
+Expected<void> Analyzer::discover()
+{
+	QMap<QString, int> layers;
+	QStringList seen;
+	Q_FOREACH(const QString &path, m_diskPaths)
+	{
+		QString canonical = QFileInfo(path).canonicalFilePath();
+		if (seen.contains(canonical))
+			continue;
+		seen << canonical;
+
+		// Same chain discovery as other commands.
+		Expected<Image::Chain> chain = Image::Unit(path).getChain();
+		if (!chain.isOk())
+			return chain;
+
+		Disk disk;
+		disk.m_path = path;
+		Q_FOREACH(const Image::Info &info, chain.get().getList())
+		{
+			if (info.getFormat() != DISK_FORMAT)
+			{
+				return Expected<void>::fromMessage(QString("%1: unsupported image format %2")
+						.arg(info.getFilename(), info.getFormat()));
+			}
+			QString key = QFileInfo(info.getFilename()).canonicalFilePath();
+			if (!layers.contains(key))
+			{
+				Expected<Qcow2::Image> image = Qcow2::Image::open(info.getFilename());
+				if (!image.isOk())
+					return image;
+				layers.insert(key, m_layers.size());
+				m_layers << Layer(image.get());
+			}
+			disk.m_chain << layers.value(key);
+		}
+		m_disks << disk;
+	}
+
+	m_chunkSize = 0;
+	Q_FOREACH(const Layer &layer, m_layers)
+	{
+		if (m_chunkSize == 0 || layer.m_image.getClusterSize() < m_chunkSize)
+			m_chunkSize = layer.m_image.getClusterSize();
+	}
+
+	for (int d = 0; d < m_disks.size(); ++d)
+	{
+		Disk &disk = m_disks[d];
+		disk.m_contains = QVector<char>(m_layers.size(), 0);
+		for (int i = 0; i < disk.m_chain.size(); ++i)
+		{
+			Layer::User user;
+			user.m_disk = d;
+			user.m_upper = disk.m_chain.mid(i + 1);
+			m_layers[disk.m_chain[i]].m_users << user;
+			disk.m_contains[disk.m_chain[i]] = 1;
+		}
+	}
+	return Expected<void>();
+}
+
+Expected<boost::shared_ptr<Index> > Analyzer::hash()
+{
+	QList<Job> jobs;
+	quint64 estimate = 0;
+	for (int i = 0; i < m_layers.size(); ++i)
+	{
+		Layer &layer = m_layers[i];
+		const Qcow2::Header &header = layer.m_image.getHeader();
+		Expected<QVector<quint64> > l1 = layer.m_image.readL1();
+		if (!l1.isOk())
+			return l1;
+		layer.m_allocated = QVector<quint64>(header.m_l1Size * header.getL2Entries() / 64, 0);
+		estimate += header.getClusterCount() * (header.getClusterSize() / m_chunkSize);
+
+		for (int j = 0; j < l1.get().size(); ++j)
+		{
+			quint64 offset = Qcow2::Image::getL2Offset(l1.get()[j]);
+			if (offset == 0)
+				continue;
+			Job job = {&layer.m_image, (quint32)i, (quint64)j, offset,
+				layer.m_allocated.data()};
+			jobs << job;
+		}
+	}
+
+	// Each scanning thread sorts a whole bucket, a quarter goes to write buffers.
+	quint64 threads = qMax(1, QThread::idealThreadCount());
+	quint64 bucketSize = qMax<quint64>(m_memoryLimit / 2 / threads, 1);
+	quint64 buckets = qMax<quint64>(1, (estimate * sizeof(Record) + bucketSize - 1) / bucketSize);
+	Logger::info(QString("Hashing %1 tables in %2 layers, %3 buckets")
+			.arg(jobs.size()).arg(m_layers.size()).arg(buckets));
+
+	Expected<boost::shared_ptr<Index> > index = Index::create(buckets, m_memoryLimit / 4);
+	if (!index.isOk())
+		return index;
+
+	HashState state(*index.get(), m_chunkSize, m_layers.size());
+	QtConcurrent::blockingMap(jobs, HashJob(state));
+	if (!state.m_result.isOk())
+		return state.m_result;
+	Expected<void> res = index.get()->flush();
+	if (!res.isOk())
+		return res;
+
+	for (int i = 0; i < m_layers.size(); ++i)
+	{
+		m_layers[i].m_dataChunks = state.m_dataChunks[i];
+		m_layers[i].m_zeroChunks = state.m_zeroChunks[i];
+	}
+	return index;
+}
+
+Expected<Stats> Analyzer::scan(const Index &index) const
+{
+	QList<quint32> buckets;
+	for (quint32 i = 0; i < index.getBucketCount(); ++i)
+		buckets << i;
+
+	// Pre-sized, jobs write disjoint slots.
+	QVector<ScanJob::slot_type> results(buckets.size());
+	QtConcurrent::blockingMap(buckets,
+			ScanJob(index, m_layers, m_disks, m_chunkSize, results.data()));
+
+	Stats stats(m_layers.size(), m_disks.size());
+	Q_FOREACH(const ScanJob::slot_type &r, results)
+	{
+		if (!r->isOk())
+			return r.get();
+		stats += r->get();
+	}
+	return stats;
+}
+
+pt::ptree Analyzer::report(const Stats &stats) const
+{
+	quint64 zero = 0;
+	pt::ptree images;
+	for (int i = 0; i < m_layers.size(); ++i)
+	{
+		const Layer &layer = m_layers[i];
+		pt::ptree image;
+		image.put("path", QSTR2UTF8(layer.m_image.getPath()));
+		image.put("cluster_size", layer.m_image.getClusterSize());
+		image.put("disks", layer.m_users.size());
+		image.put("stored", layer.m_dataChunks * m_chunkSize);
+		image.put("zero", layer.m_zeroChunks * m_chunkSize);
+		image.put("duplicate", stats.m_layerDuplicate[i] * m_chunkSize);
+		images.push_back(std::make_pair("", image));
+		zero += layer.m_zeroChunks;
+	}
+
+	pt::ptree disks;
+	for (int i = 0; i < m_disks.size(); ++i)
+	{
+		const Disk &d = m_disks[i];
+		pt::ptree disk, chain;
+		disk.put("path", QSTR2UTF8(d.m_path));
+		Q_FOREACH(int l, d.m_chain)
+		{
+			pt::ptree layer;
+			layer.put("", QSTR2UTF8(m_layers[l].m_image.getPath()));
+			chain.push_back(std::make_pair("", layer));
+		}
+		disk.add_child("chain", chain);
+		disk.put("duplicate_outside", stats.m_diskOutside[i] * m_chunkSize);
+		disks.push_back(std::make_pair("", disk));
+	}
+
+	QList<int> order;
+	for (int i = 0; i < m_layers.size(); ++i)
+	{
+		if (stats.m_baseSavings[i] != 0)
+			order << i;
+	}
+	std::stable_sort(order.begin(), order.end(), SavingsGreater(stats.m_baseSavings));
+	pt::ptree candidates;
+	Q_FOREACH(int l, order.mid(0, BASE_CANDIDATES))
+	{
+		pt::ptree candidate;
+		candidate.put("path", QSTR2UTF8(m_layers[l].m_image.getPath()));
+		candidate.put("savings", stats.m_baseSavings[l] * m_chunkSize);
+		candidates.push_back(std::make_pair("", candidate));
+	}
+
+	pt::ptree total;
+	total.put("stored", stats.m_chunks * m_chunkSize);
+	total.put("unique", stats.m_unique * m_chunkSize);
+	total.put("duplicate", stats.m_redundant * m_chunkSize);
+	total.put("zero", zero * m_chunkSize);
+
+	pt::ptree root;
+	root.put("chunk_size", m_chunkSize);
+	root.add_child("total", total);
+	root.add_child("images", images);
+	root.add_child("disks", disks);
+	root.add_child("base_candidates", candidates);
+	return root;
+}
+
+Expected<pt::ptree> Analyzer::analyze()
+{
+	// Hash index buffers and bucket sorting take the rest.
+	Qcow2::Image::setL2CacheLimit(m_memoryLimit / 4);
+	Expected<void> res = discover();
+	if (!res.isOk())
+		return res;
+	if (m_layers.isEmpty())
+		return Expected<pt::ptree>::fromMessage("No images to analyze");
+
+	Expected<boost::shared_ptr<Index> > index = hash();
+	if (!index.isOk())
+		return index;
+
+	Expected<Stats> stats = scan(*index.get());
+	if (!stats.isOk())
+		return stats;
+	return report(stats.get());
+}
+
+} // namespace Dedup
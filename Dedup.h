@@ -0,0 +1,208 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Dedup.h
+///
+/// Duplicate cluster analysis across images and backing chains.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QMutex>
+#include <QTemporaryFile>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "Expected.h"
+#include "Qcow2.h"
+
+namespace Dedup
+{
+
+////////////////////////////////////////////////////////////
+// Record
+
+/* Hashed chunk of guest data stored in some layer. */
+struct Record
+{
+	bool operator<(const Record &rhs) const
+	{
+		if (m_hashHi != rhs.m_hashHi)
+			return m_hashHi < rhs.m_hashHi;
+		if (m_hashLo != rhs.m_hashLo)
+			return m_hashLo < rhs.m_hashLo;
+		if (m_chunk != rhs.m_chunk)
+			return m_chunk < rhs.m_chunk;
+		return m_layer < rhs.m_layer;
+	}
+
+	bool isSameContent(const Record &rhs) const
+	{
+		return m_hashHi == rhs.m_hashHi && m_hashLo == rhs.m_hashLo;
+	}
+
+	quint64 m_hashHi;
+	quint64 m_hashLo;
+	// Guest offset in chunks.
+	quint64 m_chunk;
+	quint32 m_layer;
+	quint32 m_reserved;
+};
+
+////////////////////////////////////////////////////////////
+// Layer
+
+/* Single image file, possibly shared by several chains. */
+struct Layer
+{
+	/* Disk that sees this layer and the layers above it in the disk chain. */
+	struct User
+	{
+		int m_disk;
+		QVector<int> m_upper;
+	};
+
+	Layer(const Qcow2::Image &image):
+		m_image(image), m_dataChunks(0), m_zeroChunks(0)
+	{
+	}
+
+	bool isAllocated(quint64 offset) const;
+
+	Qcow2::Image m_image;
+	// One bit per cluster, set for data and zero clusters.
+	QVector<quint64> m_allocated;
+	QList<User> m_users;
+	quint64 m_dataChunks;
+	quint64 m_zeroChunks;
+};
+
+////////////////////////////////////////////////////////////
+// Disk
+
+struct Disk
+{
+	QString m_path;
+	// Layer indexes from oldest to newest.
+	QVector<int> m_chain;
+	// Per layer flag: layer belongs to the chain.
+	QVector<char> m_contains;
+};
+
+////////////////////////////////////////////////////////////
+// Index
+
+/* Hash-partitioned record storage spilled to temporary files.
+ * Each bucket is small enough to be sorted in memory. */
+struct Index
+{
+	static Expected<boost::shared_ptr<Index> > create(quint32 buckets, quint64 bufferSize);
+
+	/* Thread-safe, buckets are locked separately. */
+	Expected<void> add(const QVector<Record> &records);
+	Expected<void> flush();
+
+	quint32 getBucketCount() const
+	{
+		return m_buckets.size();
+	}
+
+	Expected<QVector<Record> > readBucket(quint32 bucket) const;
+
+private:
+	Index(quint32 bucketRecords):
+		m_bucketRecords(bucketRecords)
+	{
+	}
+
+	Expected<void> flush(quint32 bucket);
+
+	struct Bucket
+	{
+		boost::shared_ptr<QMutex> m_mutex;
+		boost::shared_ptr<QTemporaryFile> m_file;
+		QVector<Record> m_buffer;
+	};
+
+	quint32 m_bucketRecords;
+	QVector<Bucket> m_buckets;
+};
+
+////////////////////////////////////////////////////////////
+// Stats
+
+/* Per bucket results, summed up afterwards. */
+struct Stats
+{
+	Stats(int layers, int disks);
+
+	Stats& operator+=(const Stats &rhs);
+
+	quint64 m_chunks;
+	quint64 m_unique;
+	// Chunks that could be dropped keeping one copy of each content.
+	quint64 m_redundant;
+	// Chunks whose content is stored more than once.
+	QVector<quint64> m_layerDuplicate;
+	// Chunks stored in disk chain whose content is also stored outside of it.
+	QVector<quint64> m_diskOutside;
+	// Chunks that overlays would not store if layer was their base.
+	QVector<quint64> m_baseSavings;
+};
+
+////////////////////////////////////////////////////////////
+// Analyzer
+
+struct Analyzer
+{
+	Analyzer(const QStringList &disks, quint64 memoryLimit):
+		m_diskPaths(disks), m_memoryLimit(memoryLimit)
+	{
+	}
+
+	/* Returns report suitable for JSON output. */
+	Expected<boost::property_tree::ptree> analyze();
+
+private:
+	Expected<void> discover();
+	Expected<boost::shared_ptr<Index> > hash();
+	Expected<Stats> scan(const Index &index) const;
+	boost::property_tree::ptree report(const Stats &stats) const;
+
+	QStringList m_diskPaths;
+	quint64 m_memoryLimit;
+	quint64 m_chunkSize;
+	QList<Layer> m_layers;
+	QList<Disk> m_disks;
+};
+
+} // namespace Dedup
+
+#endif // DEDUP_H
@@ -38,6 +38,7 @@ enum {
 	ERR_UNSUPPORTED_FS = 3,
 	ERR_PLOOP_NOT_MOUNTED = 4,
 	ERR_NO_PARTITION_TABLE = 5,
+	ERR_UNSUPPORTED_IMAGE = 6,
 };
 
 #endif // ERRORS_H
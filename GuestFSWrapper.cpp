@@ -29,16 +29,23 @@
 ///
 ///////////////////////////////////////////////////////////////////////////////
 #include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
 #include <errno.h>
 
+#include <QMutex>
+#include <QMutexLocker>
+
 #include "GuestFSWrapper.h"
 #include "StringTable.h"
 #include "Errors.h"
+#include "Probe.h"
 
 namespace
 {
 
 const char GUESTFS_DEVICE[] = "/dev/sda";
+// Label of the image drive, needed to remove it from running appliance.
+const char DRIVE_LABEL[] = "disk";
 
 enum {MAX_MEMORY_SIZE = 8192};
 enum {MAX_BOOTLOADER_SECTS = 4096};
@@ -47,6 +54,7 @@ enum {GPT_END_SECTS = 64};
 enum {ALIGNMENT_SECTS = 128};
 enum {MAX_MBR_PRIMARY = 4};
 enum {MIN_SWAP_SIZE = 40 * 1024}; // mkswap asks for 40KiB = 10 pages.
+enum {MAX_SWAP_HEADER_SIZE = 65536}; // largest page size
 enum {LVM_METADATA_SIZE = 14336}; // In sectors, taken from previous version.
 
 quint64 ceilTo(quint64 bytes, quint64 div)
@@ -120,6 +128,10 @@ GuestFS::fs_type parseFilesystem(const QString &fs)
 	return GuestFS::fs_type(GuestFS::Unknown());
 }
 
+// Active mount sessions of all handles.
+QMutex g_sessionMutex;
+QMap<guestfs_h *, GuestFS::MountSession *> g_sessions;
+
 } // namespace
 
 namespace GuestFS
@@ -268,8 +280,8 @@ template<> Expected<int> Resize::execute<Xfs>() const
 
 template<> Expected<int> Resize::execute<Swap>() const
 {
-	Logger::info(QString("swap resize (ignore)"));
-	return 0;
+	Logger::info(QString("swap reset %1 %2").arg(m_name).arg(m_newSize));
+	return (bool)m_gfsAction ? m_gfsAction->get<Swap>(m_g, m_name).resize(m_newSize) : 0;
 }
 
 template<class T> Expected<int> Resize::execute() const
@@ -278,6 +290,43 @@ template<class T> Expected<int> Resize::execute() const
 				QString(IDS_ERR_FS_UNSUPPORTED), ERR_UNSUPPORTED_FS);
 }
 
+////////////////////////////////////////////////////////////
+// Pack
+
+/* Ext and NTFS resize moves data itself. Btrfs resize only drops empty
+ * chunks, partially used ones hold the minimum size until balanced. */
+struct Pack: boost::static_visitor<Expected<bool> >
+{
+	Pack(guestfs_h *g, const QString &name, const boost::optional<Action> &gfsAction):
+		m_g(g), m_name(name), m_gfsAction(gfsAction)
+	{
+	}
+
+	template <class T>
+	Expected<bool> operator() (const T &fs) const
+	{
+		Q_UNUSED(fs);
+		return false;
+	}
+
+private:
+	guestfs_h *m_g;
+	QString m_name;
+	boost::optional<Action> m_gfsAction;
+};
+
+template<> Expected<bool> Pack::operator() (const Btrfs &fs) const
+{
+	Q_UNUSED(fs);
+	Logger::info(QString("btrfs balance start %1").arg(m_name));
+	if (!m_gfsAction)
+		return true;
+	int ret = m_gfsAction->get<Btrfs>(m_g, m_name).balance();
+	if (ret)
+		return Expected<bool>::fromMessage("Btrfs balance failed", ret);
+	return true;
+}
+
 ////////////////////////////////////////////////////////////
 // LVDelta
 
@@ -467,6 +516,10 @@ Expected<void> Unit::shrinkContent(quint64 dec) const
 
 Expected<void> Unit::resizeContent(quint64 newSize) const
 {
+	// Btrfs is mounted for both steps, mount it once, writable unless dry run.
+	boost::shared_ptr<MountSession> session;
+	if (getFilesystem<Btrfs>() != NULL)
+		session.reset(new MountSession(m_g, m_gfsAction.is_initialized()));
 	Expected<quint64> minSize = getMinSize();
 	if (!minSize.isOk())
 		return minSize;
@@ -479,6 +532,11 @@ Expected<void> Unit::resizeContent(quint64 newSize) const
 	return boost::apply_visitor(Visitor::Resize(m_g, m_name, newSize, m_gfsAction), m_filesystem);
 }
 
+Expected<bool> Unit::packContent() const
+{
+	return boost::apply_visitor(Visitor::Pack(m_g, m_name, m_gfsAction), m_filesystem);
+}
+
 Expected<bool> Unit::isFilesystemSupported() const
 {
 	return getFilesystem<Unknown>() == NULL;
@@ -735,6 +793,41 @@ Expected<List::fsMap_type> List::getFilesystems() const
 	return result;
 }
 
+////////////////////////////////////////////////////////////
+// Probed
+
+Expected<QList<Probed> > probe(const Probe::Disk &disk)
+{
+	Expected<Probe::Table> table = Probe::readTable(disk);
+	if (!table.isOk())
+		return table;
+	if (table.get().m_partitions.isEmpty())
+		return Expected<void>::fromMessage("No partitions found", ERR_NO_PARTITIONS);
+
+	QMap<int, Probed> result;
+	Q_FOREACH(const Probe::Partition &partition, table.get().m_partitions)
+	{
+		Expected<QString> type = Probe::readFsType(disk, partition.m_start);
+		if (!type.isOk())
+			return type;
+		QString name = QString("%1%2").arg(GUESTFS_DEVICE).arg(partition.m_number);
+		if (type.get() == "LVM2_member")
+		{
+			return Expected<void>::fromMessage(QString("%1: LVM physical volume").arg(name),
+					ERR_UNSUPPORTED_FS);
+		}
+
+		Stats stats;
+		stats.start = partition.m_start;
+		stats.end = partition.getEnd() - 1;
+		stats.size = partition.m_size;
+		Logger::info(QString("%1: %2").arg(name).arg(type.get().isEmpty() ? "unknown" : type.get()));
+		result.insert(partition.m_number, Probed(name, stats, parseFilesystem(type.get())));
+	}
+	// Ordered by number as in appliance.
+	return result.values();
+}
+
 } // namespace Partition
 
 ////////////////////////////////////////////////////////////
@@ -792,25 +885,32 @@ Expected<quint64> Ntfs::getMinSize() const
 
 int Btrfs::resize(quint64 newSize) const
 {
-	int ret;
-   	if ((ret = guestfs_mount(m_g, QSTR2UTF8(m_partition), "/")))
-		return ret;
-	ret = guestfs_btrfs_filesystem_resize(
-				m_g, "/",
+	Mount mount(m_g, m_partition, true);
+	if (!mount.getPath().isOk())
+		return mount.getPath().getCode();
+	return guestfs_btrfs_filesystem_resize(
+				m_g, QSTR2UTF8(mount.getPath().get()),
 				GUESTFS_BTRFS_FILESYSTEM_RESIZE_SIZE, newSize,
 				-1);
-	guestfs_umount(m_g, "/");
-	return ret;
 }
 
-Expected<quint64> Btrfs::getMinSize() const
+int Btrfs::balance() const
 {
-	int result;
-	if ((result = guestfs_mount_ro(m_g, QSTR2UTF8(m_partition), "/")))
-		return Expected<quint64>::fromMessage(IDS_ERR_CANNOT_MOUNT, result);
+	Mount mount(m_g, m_partition, true);
+	if (!mount.getPath().isOk())
+		return mount.getPath().getCode();
+	return guestfs_btrfs_balance(m_g, QSTR2UTF8(mount.getPath().get()));
+}
 
-	qint64 ret = guestfs_vfs_minimum_size(m_g, QSTR2UTF8(m_partition));
-	guestfs_umount(m_g, "/");
+Expected<quint64> Btrfs::getMinSize() const
+{
+	qint64 ret;
+	{
+		Mount mount(m_g, m_partition);
+		if (!mount.getPath().isOk())
+			return Expected<quint64>::fromMessage(IDS_ERR_CANNOT_MOUNT, mount.getPath().getCode());
+		ret = guestfs_vfs_minimum_size(m_g, QSTR2UTF8(m_partition));
+	}
 
 	if (ret < 0)
 		return Expected<quint64>::fromMessage(IDS_ERR_CANNOT_GET_MIN_SIZE, ret);
@@ -822,21 +922,21 @@ Expected<quint64> Btrfs::getMinSize() const
 
 int Xfs::resize() const
 {
-	int ret;
-   	if ((ret = guestfs_mount(m_g, QSTR2UTF8(m_partition), "/")))
-		return ret;
-	ret = guestfs_xfs_growfs(m_g, "/",-1);
-	guestfs_umount(m_g, "/");
-	return ret;
+	Mount mount(m_g, m_partition, true);
+	if (!mount.getPath().isOk())
+		return mount.getPath().getCode();
+	return guestfs_xfs_growfs(m_g, QSTR2UTF8(mount.getPath().get()), -1);
 }
 
 Expected<quint64> Xfs::getMinSize() const
 {
-	int ret;
-   	if ((ret = guestfs_mount_ro(m_g, QSTR2UTF8(m_partition), "/")))
-		return Expected<quint64>::fromMessage(IDS_ERR_CANNOT_MOUNT);
-	qint64 bytes = guestfs_vfs_minimum_size(m_g, QSTR2UTF8(m_partition));
-	guestfs_umount(m_g, "/");
+	qint64 bytes;
+	{
+		Mount mount(m_g, m_partition);
+		if (!mount.getPath().isOk())
+			return Expected<quint64>::fromMessage(IDS_ERR_CANNOT_MOUNT);
+		bytes = guestfs_vfs_minimum_size(m_g, QSTR2UTF8(m_partition));
+	}
 	if (bytes < 0)
 		return Expected<quint64>::fromMessage(IDS_ERR_CANNOT_GET_MIN_SIZE, bytes);
 	return bytes;;
@@ -845,6 +945,31 @@ Expected<quint64> Xfs::getMinSize() const
 ////////////////////////////////////////////////////////////
 // Swap
 
+int Swap::resize(quint64 newSize) const
+{
+	size_t size = 0;
+	char *buf = guestfs_pread_device(m_g, QSTR2UTF8(m_partition), MAX_SWAP_HEADER_SIZE, 0, &size);
+	if (buf == NULL)
+		return -1;
+	QByteArray header = Probe::resizeSwapHeader(QByteArray(buf, size), newSize);
+	free(buf);
+	if (header.isEmpty())
+	{
+		// Hibernation image must survive.
+		Logger::info(QString("%1: not an active swap area, left intact").arg(m_partition));
+		return 0;
+	}
+
+	// Discarded clusters are neither copied nor kept by compaction.
+	// Zeroing would allocate every cluster, so data stays then.
+	if (guestfs_blkdiscard(m_g, QSTR2UTF8(m_partition)))
+		Logger::info(QString("%1: discard failed, swap contents are kept").arg(m_partition));
+	if (guestfs_pwrite_device(m_g, QSTR2UTF8(m_partition),
+			header.constData(), header.size(), 0) != header.size())
+		return -1;
+	return 0;
+}
+
 quint64 Swap::getMinSize()
 {
 	return MIN_SWAP_SIZE;
@@ -1178,6 +1303,103 @@ Expected<quint64> Controller::getTotalFree() const
 
 } // namespace VG
 
+////////////////////////////////////////////////////////////
+// MountSession
+
+MountSession::MountSession(guestfs_h *g, bool writable):
+	m_g(g), m_writable(writable), m_active(false), m_next(0)
+{
+	QMutexLocker lock(&g_sessionMutex);
+	if (g_sessions.contains(g))
+		return;
+	g_sessions.insert(g, this);
+	m_active = true;
+}
+
+MountSession::~MountSession()
+{
+	if (!m_active)
+		return;
+	Q_FOREACH(const Entry &entry, m_mounts.values())
+	{
+		if (guestfs_umount(m_g, QSTR2UTF8(entry.m_path)) == 0)
+			guestfs_rmmountpoint(m_g, QSTR2UTF8(entry.m_path));
+	}
+	QMutexLocker lock(&g_sessionMutex);
+	g_sessions.remove(m_g);
+}
+
+MountSession* MountSession::find(guestfs_h *g)
+{
+	QMutexLocker lock(&g_sessionMutex);
+	return g_sessions.value(g, NULL);
+}
+
+Expected<QString> MountSession::mount(const QString &device, bool writable)
+{
+	writable = writable || m_writable;
+	QString path;
+	QMap<QString, Entry>::iterator it = m_mounts.find(device);
+	if (it != m_mounts.end())
+	{
+		if (it.value().m_writable || !writable)
+			return it.value().m_path;
+		// Read-only mount is not enough anymore.
+		path = it.value().m_path;
+		m_mounts.erase(it);
+		if (guestfs_umount(m_g, QSTR2UTF8(path)))
+			return Expected<QString>::fromMessage(QString("Unable to unmount %1").arg(device));
+	}
+	else
+	{
+		path = QString("/prl-%1").arg(m_next++);
+		// Possible only while nothing is mounted at "/".
+		if (guestfs_mkmountpoint(m_g, QSTR2UTF8(path)))
+			return Expected<QString>::fromMessage(QString("Unable to create mountpoint %1").arg(path));
+	}
+
+	Logger::info(QString("Mounting %1 at %2").arg(device).arg(path));
+	int ret = writable ?
+		guestfs_mount(m_g, QSTR2UTF8(device), QSTR2UTF8(path)) :
+		guestfs_mount_ro(m_g, QSTR2UTF8(device), QSTR2UTF8(path));
+	if (ret)
+	{
+		guestfs_rmmountpoint(m_g, QSTR2UTF8(path));
+		return Expected<QString>::fromMessage(IDS_ERR_CANNOT_MOUNT, ret);
+	}
+	Entry entry = {path, writable};
+	m_mounts.insert(device, entry);
+	return path;
+}
+
+////////////////////////////////////////////////////////////
+// Mount
+
+Mount::Mount(guestfs_h *g, const QString &device, bool writable):
+	m_g(g), m_path(QString("/")), m_own(false)
+{
+	MountSession *session = MountSession::find(g);
+	if (session)
+	{
+		m_path = session->mount(device, writable);
+		return;
+	}
+
+	int ret = writable ?
+		guestfs_mount(g, QSTR2UTF8(device), "/") :
+		guestfs_mount_ro(g, QSTR2UTF8(device), "/");
+	if (ret)
+		m_path = Expected<QString>::fromMessage(IDS_ERR_CANNOT_MOUNT, ret);
+	else
+		m_own = true;
+}
+
+Mount::~Mount()
+{
+	if (m_own)
+		guestfs_umount(m_g, "/");
+}
+
 ////////////////////////////////////////////////////////////
 // Helper
 
@@ -1208,13 +1430,16 @@ Expected<QString> Helper::getPartitionTable() const
 
 Expected<struct statvfs> Helper::getFilesystemStats(const QString &name) const
 {
-	int ret;
-	if ((ret = guestfs_mount_ro(m_g, QSTR2UTF8(name), "/")))
-		return Expected<struct statvfs>::fromMessage(IDS_ERR_CANNOT_MOUNT, ret);
-
-	struct guestfs_statvfs *g_stat = guestfs_statvfs(m_g, "/");
-
-	guestfs_umount(m_g, "/");
+	struct guestfs_statvfs *g_stat;
+	{
+		Mount mount(m_g, name);
+		if (!mount.getPath().isOk())
+		{
+			return Expected<struct statvfs>::fromMessage(IDS_ERR_CANNOT_MOUNT,
+					mount.getPath().getCode());
+		}
+		g_stat = guestfs_statvfs(m_g, QSTR2UTF8(mount.getPath().get()));
+	}
 
 	struct statvfs stat;
 	if (g_stat)
@@ -1267,7 +1492,9 @@ Wrapper::create(const QString& filename, const boost::optional<Action> &gfsActio
 	boost::shared_ptr<guestfs_h> g;
 	if (!(g = boost::shared_ptr<guestfs_h>(guestfs_create(), HandleDestroyer())))
 		return Expected<Wrapper>::fromMessage("Unable to create guestfs handle");
-	if (guestfs_add_drive(g.get(), QSTR2UTF8(filename)))
+	// Discard lets fstrim deallocate image clusters.
+	if (guestfs_add_drive_opts(g.get(), QSTR2UTF8(filename),
+			GUESTFS_ADD_DRIVE_OPTS_DISCARD, "besteffort", -1))
 		return Expected<Wrapper>::fromMessage("Unable to add drive");
 	if (guestfs_set_memsize(g.get(), MAX_MEMORY_SIZE))
 		return Expected<Wrapper>::fromMessage("Unable to set max memory");
@@ -1283,7 +1510,9 @@ Wrapper::createReadOnly(const QString& filename, const boost::optional<Action> &
 	boost::shared_ptr<guestfs_h> g;
 	if (!(g = boost::shared_ptr<guestfs_h>(guestfs_create(), HandleDestroyer())))
 		return Expected<Wrapper>::fromMessage("Unable to create guestfs handle");
-	if (guestfs_add_drive_ro(g.get(), QSTR2UTF8(filename)))
+	if (guestfs_add_drive_opts(g.get(), QSTR2UTF8(filename),
+			GUESTFS_ADD_DRIVE_OPTS_READONLY, 1,
+			GUESTFS_ADD_DRIVE_OPTS_LABEL, DRIVE_LABEL, -1))
 		return Expected<Wrapper>::fromMessage("Unable to add drive");
 	if (guestfs_set_memsize(g.get(), MAX_MEMORY_SIZE))
 		return Expected<Wrapper>::fromMessage("Unable to set max memory");
@@ -1293,6 +1522,49 @@ Wrapper::createReadOnly(const QString& filename, const boost::optional<Action> &
 	return Wrapper(g, gfsAction, true);
 }
 
+Expected<Wrapper> Wrapper::promote(const QString &filename) const
+{
+	if (!m_readOnly)
+		return *this;
+
+	guestfs_h *g = m_g.get();
+	char *backend = guestfs_get_backend(g);
+	if (!backend)
+		return Expected<Wrapper>::fromMessage("Unable to get guestfs backend");
+	// Only libvirt backend supports hotplug.
+	bool hotplug = QString(backend).startsWith("libvirt");
+	free(backend);
+	if (!hotplug)
+		return Expected<Wrapper>::fromMessage("Drive hotplug is not supported");
+
+	Logger::info(QString("Reopening %1 for writing").arg(filename));
+	// Drive in use can not be removed.
+	if (guestfs_umount_all(g) || guestfs_vg_activate_all(g, 0))
+		return Expected<Wrapper>::fromMessage("Unable to release read-only drive");
+	if (guestfs_remove_drive(g, DRIVE_LABEL))
+		return Expected<Wrapper>::fromMessage("Unable to remove read-only drive");
+	if (guestfs_add_drive_opts(g, QSTR2UTF8(filename),
+			GUESTFS_ADD_DRIVE_OPTS_LABEL, DRIVE_LABEL,
+			GUESTFS_ADD_DRIVE_OPTS_DISCARD, "besteffort", -1))
+		return Expected<Wrapper>::fromMessage("Unable to hot-add drive");
+
+	// Freed slot is reused, so the device name is the same.
+	char **devices = guestfs_list_devices(g);
+	if (!devices)
+		return Expected<Wrapper>::fromMessage("Unable to list devices");
+	bool same = devices[0] != NULL && QString(devices[0]) == GUESTFS_DEVICE;
+	for (char **cur = devices; *cur != NULL; ++cur)
+		free(*cur);
+	free(devices);
+	if (!same)
+		return Expected<Wrapper>::fromMessage("Hot-added drive got another name");
+	// Logical volumes were deactivated to release the old drive.
+	if (guestfs_vg_activate_all(g, 1))
+		return Expected<Wrapper>::fromMessage("Unable to activate VGs");
+
+	return Wrapper(m_g, m_gfsAction, false);
+}
+
 Expected<Partition::Unit> Wrapper::getContainer() const
 {
 	Expected<QList<Partition::Unit> > parts = m_partList->get();
@@ -1504,6 +1776,36 @@ Expected<void> Wrapper::sync() const
 	return Expected<void>();
 }
 
+Expected<void> Wrapper::trim(const QString &device,
+                             const QList<QPair<quint64, quint64> > &ranges) const
+{
+	Logger::info(QString("fstrim %1: %2 ranges").arg(device).arg(ranges.size()));
+	if (!m_gfsAction)
+		return Expected<void>();
+
+	if (guestfs_mount(m_g.get(), QSTR2UTF8(device), "/"))
+		return Expected<void>::fromMessage(QString("Unable to mount %1").arg(device));
+
+	Expected<void> res;
+	if (ranges.isEmpty() && guestfs_fstrim(m_g.get(), "/", -1))
+		res = Expected<void>::fromMessage(QString("Unable to trim %1").arg(device));
+	typedef QPair<quint64, quint64> range_type;
+	Q_FOREACH(const range_type &range, ranges)
+	{
+		if (guestfs_fstrim(m_g.get(), "/",
+				GUESTFS_FSTRIM_OFFSET, (int64_t)range.first,
+				GUESTFS_FSTRIM_LENGTH, (int64_t)range.second, -1))
+		{
+			res = Expected<void>::fromMessage(QString("Unable to trim %1").arg(device));
+			break;
+		}
+	}
+
+	if (guestfs_umount(m_g.get(), "/") && res.isOk())
+		return Expected<void>::fromMessage(QString("Unable to unmount %1").arg(device));
+	return res;
+}
+
 ////////////////////////////////////////////////////////////
 // Map
 
@@ -1516,9 +1818,21 @@ Expected<Wrapper> Map::getWritable(const QString &path)
 
 	if (it != m_gfsMap.end() && it.value().isReadOnly())
 	{
+		// Saves appliance launch.
+		Expected<Wrapper> promoted = it.value().promote(path);
 		// call destructor to avoid concurrency
 		m_gfsMap.erase(it);
 		it = m_gfsMap.end();
+		if (promoted.isOk())
+			it = m_gfsMap.insert(path, promoted.get());
+		else
+			Logger::info(promoted.getMessage());
+	}
+	if (m_pending.contains(path))
+	{
+		Async::Future<Wrapper> pending = m_pending.take(path);
+		pending.cancel();
+		pending.wait();
 	}
 
 	if (it == m_gfsMap.end())
@@ -1537,6 +1851,13 @@ Expected<Wrapper> Map::getWritable(const QString &path)
 	return it.value();
 }
 
+void Map::close(const QString &path)
+{
+	m_gfsMap.remove(path);
+	if (m_pending.contains(path))
+		m_pending.take(path).cancel();
+}
+
 Expected<Wrapper> Map::getReadonly(const QString &path)
 {
 	if (m_token && m_token->isCancellationRequested())
@@ -1544,6 +1865,15 @@ Expected<Wrapper> Map::getReadonly(const QString &path)
 
 	QMap<QString, Wrapper>::iterator it = m_gfsMap.find(path);
 
+	if (it == m_gfsMap.end() && m_pending.contains(path))
+	{
+		Expected<Wrapper> gfs = m_pending.take(path).take();
+		if (gfs.isOk())
+			it = m_gfsMap.insert(path, gfs.get());
+		else
+			Logger::info(gfs.getMessage());
+	}
+
 	if (it == m_gfsMap.end())
 	{
 		// create ro
@@ -1560,4 +1890,12 @@ Expected<Wrapper> Map::getReadonly(const QString &path)
 	return it.value();
 }
 
+void Map::launchReadonly(const QString &path)
+{
+	if (m_gfsMap.contains(path) || m_pending.contains(path))
+		return;
+	m_pending.insert(path, Async::Future<Wrapper>::run(
+			boost::bind(&Wrapper::createReadOnly, path, m_gfsAction)));
+}
+
 } // namespace GuestFS
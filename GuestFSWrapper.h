@@ -48,6 +48,8 @@
 #include "Expected.h"
 #include "Abort.h"
 #include "Lvm.h"
+#include "Async.h"
+#include "Probe.h"
 
 namespace GuestFS
 {
@@ -78,6 +80,69 @@ private:
 
 } // namespace VG
 
+////////////////////////////////////////////////////////////
+// MountSession
+
+/* While a session of the handle is alive, filesystems mounted through Mount
+ * stay mounted, each at its own mountpoint, and are unmounted when the
+ * session ends. Nothing else may be mounted on the handle meanwhile, and
+ * partitions may not be changed. Nested sessions do nothing. */
+struct MountSession
+{
+	/* Read-only mounts are done read-write on handles going to modify
+	 * the filesystem anyway. */
+	MountSession(guestfs_h *g, bool writable = false);
+	~MountSession();
+
+	/* Mountpoint of 'device', mounted if needed. */
+	Expected<QString> mount(const QString &device, bool writable);
+
+	/* Active session of the handle, if any. Thread-safe. */
+	static MountSession* find(guestfs_h *g);
+
+private:
+	MountSession(const MountSession&);
+	MountSession& operator=(const MountSession&);
+
+	struct Entry
+	{
+		QString m_path;
+		bool m_writable;
+	};
+
+	guestfs_h *m_g;
+	bool m_writable;
+	bool m_active;
+	int m_next;
+	QMap<QString, Entry> m_mounts;
+};
+
+////////////////////////////////////////////////////////////
+// Mount
+
+/* Filesystem mounted until the object is destroyed, or until the end of the
+ * active session of the handle. */
+struct Mount
+{
+	Mount(guestfs_h *g, const QString &device, bool writable = false);
+	~Mount();
+
+	/* Mountpoint or error with the code of guestfs call. */
+	const Expected<QString>& getPath() const
+	{
+		return m_path;
+	}
+
+private:
+	Mount(const Mount&);
+	Mount& operator=(const Mount&);
+
+	guestfs_h *m_g;
+	Expected<QString> m_path;
+	// Mounted by us rather than by session.
+	bool m_own;
+};
+
 ////////////////////////////////////////////////////////////
 // Helper
 
@@ -184,6 +249,8 @@ struct Btrfs
 
 	int resize(quint64 newSize) const;
 	Expected<quint64> getMinSize() const;
+	/* Rewrites chunks packing them, empty ones are freed. */
+	int balance() const;
 
 private:
 	guestfs_h *m_g;
@@ -218,7 +285,22 @@ private:
 
 struct Swap
 {
+	Swap(): m_g(NULL)
+	{
+	}
+
+	Swap(guestfs_h *g, const QString &partition):
+		m_g(g), m_partition(partition)
+	{
+	}
+
+	/* Drops contents, header with UUID and label is kept. */
+	int resize(quint64 newSize) const;
 	static quint64 getMinSize();
+
+private:
+	guestfs_h *m_g;
+	QString m_partition;
 };
 
 ////////////////////////////////////////////////////////////
@@ -451,6 +533,11 @@ struct Unit
 	/* Disk-modifying */
 	Expected<void> resizeContent(quint64 newSize) const;
 
+	/* Disk-modifying.
+	 * Moves data towards the start where resize would not do it, so that
+	 * minimum size drops. False if filesystem has nothing to move. */
+	Expected<bool> packContent() const;
+
 	Expected<bool> isFilesystemSupported() const;
 
 	Expected<struct statvfs> getFilesystemStats() const;
@@ -505,6 +592,28 @@ private:
 	mutable boost::optional<fsMap_type> m_content;
 };
 
+////////////////////////////////////////////////////////////
+// Probed
+
+/* Partition classified without appliance. */
+struct Probed
+{
+	Probed(const QString &name, const Stats &stats, const fs_type &filesystem):
+		m_name(name), m_stats(stats), m_filesystem(filesystem)
+	{
+	}
+
+	QString m_name;
+	Stats m_stats;
+	fs_type m_filesystem;
+};
+
+/* Native counterpart of List::getFilesystems() for partitioned disks,
+ * names match the appliance ones. Fails with ERR_NO_PARTITIONS if there
+ * are none and with ERR_UNSUPPORTED_FS if there are LVM physical volumes:
+ * logical volumes are only seen by appliance. */
+Expected<QList<Probed> > probe(const Probe::Disk &disk);
+
 } // namespace Partition
 
 ////////////////////////////////////////////////////////////
@@ -520,11 +629,22 @@ struct Wrapper
 			const QString &filename,
 			const boost::optional<Action> &gfsAction = boost::optional<Action>());
 
+	/* Keeps filesystems mounted until the session is destroyed. */
+	boost::shared_ptr<MountSession> startMountSession() const
+	{
+		return boost::shared_ptr<MountSession>(new MountSession(m_g.get()));
+	}
+
 	bool isReadOnly() const
 	{
 		return m_readOnly;
 	}
 
+	/* Replaces read-only drive of running appliance with writable 'filename'.
+	 * Other copies share the appliance. Needs libvirt backend. If hotplug
+	 * fails half way, the handle is unusable. */
+	Expected<Wrapper> promote(const QString &filename) const;
+
 	Expected<Partition::Unit> getLastPartition() const
 	{
 		return m_partList->getLast();
@@ -592,6 +712,13 @@ struct Wrapper
 
 	Expected<void> sync() const;
 
+	/* Disk-modifying.
+	 * Mount filesystem and discard its free space within given ranges.
+	 * Ranges are (offset, length) pairs relative to the device start,
+	 * ntfs-3g supports only the whole filesystem, i.e. empty 'ranges'. */
+	Expected<void> trim(const QString &device,
+	                    const QList<QPair<quint64, quint64> > &ranges) const;
+
 private:
 	struct HandleDestroyer
 	{
@@ -637,10 +764,16 @@ struct Map
 
 	Expected<Wrapper> getWritable(const QString &path);
 	Expected<Wrapper> getReadonly(const QString &path);
+	/* Starts read-only appliance in background, getReadonly picks it up.
+	 * Appliance is closed if nobody asks for it. */
+	void launchReadonly(const QString &path);
+	/* Appliance of 'path' is shut down when its last copy is gone. */
+	void close(const QString &path);
 
 
 private:
 	QMap<QString, GuestFS::Wrapper> m_gfsMap;
+	QMap<QString, Async::Future<GuestFS::Wrapper> > m_pending;
 	Abort::token_type m_token;
 	boost::optional<Action> m_gfsAction;
 };
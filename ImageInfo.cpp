@@ -32,15 +32,25 @@
 #include <QDir>
 
 #include <boost/optional.hpp>
+#include <boost/bind.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
 #include "ImageInfo.h"
 #include "Util.h"
 #include "StringTable.h"
+#include "Cache.h"
+#include "Async.h"
 
 namespace pt = boost::property_tree;
 using namespace Image;
 
+namespace
+{
+
+const char CACHE_SECTION_CHAIN[] = "chain";
+
+} // namespace
+
 ////////////////////////////////////////////////////////////
 // Info
 
@@ -65,6 +75,14 @@ QString Chain::toString() const
 	return images.join("\n\n");
 }
 
+QStringList Chain::getPaths() const
+{
+	QStringList paths;
+	Q_FOREACH(const Info &info, m_list)
+		paths << info.getFilename();
+	return paths;
+}
+
 quint64 Chain::getActualSizeSum() const
 {
 	quint64 sum = 0;
@@ -157,25 +175,50 @@ Expected<Chain> Parser::parse(const QByteArray &data)
 
 Expected<Chain> Unit::getChain() const
 {
-	QStringList args;
-	args << "info" << "--backing-chain" << "--output=json" << m_diskPath;
+	Cache::Entry cache = Cache::Entry::load(m_diskPath);
+	boost::optional<pt::ptree> cached = cache.get(CACHE_SECTION_CHAIN);
 	QByteArray out;
-	if (run_prg(QEMU_IMG, args, &out))
-		return Expected<Chain>::fromMessage("Snapshot chain is unavailable");
+	if (cached)
+		out = QByteArray(cached->get<std::string>("output", "").c_str());
+	else
+	{
+		// Backing files are known only afterwards, they are stamped on save.
+		Expected<void> res = cache.bind(QStringList(m_diskPath));
+		if (!res.isOk())
+			Logger::info(res.getMessage());
+		QStringList args;
+		args << "info" << "--backing-chain" << "--output=json" << m_diskPath;
+		if (run_prg(QEMU_IMG, args, &out))
+			return Expected<Chain>::fromMessage("Snapshot chain is unavailable");
+	}
 
 	QString dirPath = QFileInfo(m_diskPath).absolutePath();
 	Expected<Chain> chain = Parser(dirPath).parse(out);
-	if (chain.isOk())
-		Logger::info(chain.get().toString() + "\n");
+	if (!chain.isOk())
+		return chain;
+	Logger::info(chain.get().toString() + "\n");
+	if (!cached)
+	{
+		pt::ptree data;
+		data.put("output", std::string(out.constData(), out.size()));
+		cache.put(CACHE_SECTION_CHAIN, data);
+		Expected<void> res = cache.save(chain.get().getPaths());
+		if (!res.isOk())
+			Logger::info(res.getMessage());
+	}
 	return chain;
 }
 
 Expected<Chain> Unit::getChainNoSnapshots() const
 {
-	Expected<void> res = checkSnapshots();
+	// Two independent qemu-img runs.
+	Async::Future<void> snapshots = Async::Future<void>::run(
+			boost::bind(&Unit::checkSnapshots, this));
+	Expected<Chain> chain = getChain();
+	Expected<void> res = snapshots.get();
 	if (!res.isOk())
 		return res;
-	return getChain();
+	return chain;
 }
 
 Expected<QStringList> Unit::getSnapshots() const
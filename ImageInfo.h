@@ -125,6 +125,8 @@ struct Chain
 	}
 
 	QString toString() const;
+	/* Image files from oldest to newest. */
+	QStringList getPaths() const;
 
 	quint64 getActualSizeSum() const;
 	quint64 getVirtualSizeMax() const;
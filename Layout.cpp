@@ -0,0 +1,222 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Layout.cpp
+///
+/// Partition layout planning for resize.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+#include <limits>
+
+#include "Layout.h"
+
+using namespace Layout;
+
+namespace
+{
+
+const quint64 NO_FIT = std::numeric_limits<quint64>::max();
+
+quint64 ceilTo(quint64 value, quint64 div)
+{
+	return (value + div - 1) / div * div;
+}
+
+bool isBefore(const Partition &lhs, const Partition &rhs)
+{
+	return lhs.m_start < rhs.m_start;
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////
+// Plan
+
+bool Plan::isMoving() const
+{
+	Q_FOREACH(const Target &target, m_targets)
+	{
+		if (target.isMoved())
+			return true;
+	}
+	return false;
+}
+
+quint64 Plan::getMovedBytes() const
+{
+	quint64 bytes = 0;
+	Q_FOREACH(const Target &target, m_targets)
+	{
+		if (target.isMoved())
+			bytes += qMin(target.m_size, target.m_source.m_size);
+	}
+	return bytes;
+}
+
+////////////////////////////////////////////////////////////
+// Planner
+
+Planner::Planner(const QList<Partition> &partitions, const Geometry &geometry):
+	m_partitions(partitions), m_geometry(geometry)
+{
+	std::stable_sort(m_partitions.begin(), m_partitions.end(), isBefore);
+}
+
+quint64 Planner::getStep(int index) const
+{
+	quint64 step = m_partitions[index].m_step;
+	return step ? ceilTo(step, m_geometry.m_alignment) : m_geometry.m_alignment;
+}
+
+quint64 Planner::getFloor(int index) const
+{
+	const Partition &partition = m_partitions[index];
+	return qMin(partition.m_size, ceilTo(partition.m_minSize, getStep(index)));
+}
+
+quint64 Planner::pack(int first, const QList<quint64> &sizes, QList<quint64> *starts) const
+{
+	if (starts)
+	{
+		starts->clear();
+		for (int i = 0; i <= first; ++i)
+			*starts << m_partitions[i].m_start;
+	}
+
+	quint64 end = m_partitions[first].m_start + sizes[first];
+	for (int i = first + 1; i < m_partitions.size(); ++i)
+	{
+		const Partition &partition = m_partitions[i];
+		quint64 start = ceilTo(end, m_geometry.m_alignment);
+		// Unaligned partition that need not move is left alone.
+		if (end <= partition.m_start && start > partition.m_start)
+			start = partition.m_start;
+		if (!partition.m_movable)
+		{
+			if (end > partition.m_start)
+				return NO_FIT;
+			start = partition.m_start;
+		}
+		if (starts)
+			*starts << start;
+		end = start + sizes[i];
+	}
+	return end;
+}
+
+bool Planner::fits(int first, const QList<quint64> &sizes) const
+{
+	return pack(first, sizes) <= m_geometry.m_end;
+}
+
+quint64 Planner::fitSize(int first, int index, QList<quint64> sizes) const
+{
+	quint64 size = m_partitions[index].m_size;
+	sizes[index] = size;
+	if (fits(first, sizes))
+		return size;
+
+	// Sizes below the original one are floor + N * step.
+	quint64 floor = getFloor(index);
+	quint64 step = getStep(index);
+	quint64 lo = 0, hi = (size - floor - 1) / step;
+	while (lo < hi)
+	{
+		quint64 mid = lo + (hi - lo + 1) / 2;
+		sizes[index] = floor + mid * step;
+		if (fits(first, sizes))
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return floor + lo * step;
+}
+
+bool Planner::isFeasible(int first) const
+{
+	QList<quint64> sizes;
+	for (int i = 0; i < m_partitions.size(); ++i)
+		sizes << (i < first ? m_partitions[i].m_size : getFloor(i));
+	return fits(first, sizes);
+}
+
+Plan Planner::build(int first, const QList<quint64> &sizes) const
+{
+	QList<quint64> starts;
+	pack(first, sizes, &starts);
+
+	Plan plan;
+	QList<int> left, right, grown;
+	for (int i = 0; i < m_partitions.size(); ++i)
+	{
+		Target target(m_partitions[i]);
+		target.m_start = starts[i];
+		target.m_size = sizes[i];
+		plan.m_targets << target;
+
+		if (target.m_size < target.m_source.m_size)
+			plan.m_steps << Step(Step::SHRINK, i);
+		else if (target.m_size > target.m_source.m_size)
+			grown << i;
+		if (target.m_start < target.m_source.m_start)
+			left << i;
+		else if (target.m_start > target.m_source.m_start)
+			right.prepend(i);
+	}
+
+	// Moving left frees space for the next partition, moving right for the previous one.
+	Q_FOREACH(int i, left + right)
+		plan.m_steps << Step(Step::MOVE, i);
+	Q_FOREACH(int i, grown)
+		plan.m_steps << Step(Step::GROW, i);
+	return plan;
+}
+
+Expected<Plan> Planner::plan() const
+{
+	if (m_partitions.isEmpty())
+		return Plan();
+
+	// Each partition left in place saves moving it, so keep as many as possible.
+	int first = m_partitions.size() - 1;
+	while (first >= 0 && !isFeasible(first))
+		--first;
+	if (first < 0)
+	{
+		return Expected<Plan>::fromMessage(
+				QString("Partitions do not fit into %1 bytes").arg(m_geometry.m_end));
+	}
+
+	QList<quint64> sizes;
+	for (int i = 0; i < m_partitions.size(); ++i)
+		sizes << (i < first ? m_partitions[i].m_size : getFloor(i));
+	// Moved partitions keep as much of their size as possible,
+	// the partition left in place takes the rest of the shrink.
+	for (int i = first + 1; i < m_partitions.size(); ++i)
+		sizes[i] = fitSize(first, i, sizes);
+	sizes[first] = fitSize(first, first, sizes);
+	return build(first, sizes);
+}
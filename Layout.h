@@ -0,0 +1,174 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Layout.h
+///
+/// Partition layout planning for resize.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <QString>
+#include <QList>
+
+#include "Expected.h"
+
+namespace Layout
+{
+
+////////////////////////////////////////////////////////////
+// Partition
+
+/* Partition as it is now and how far it may change. Offsets are in bytes. */
+struct Partition
+{
+	Partition(const QString &name, quint64 start, quint64 size):
+		m_name(name), m_start(start), m_size(size), m_minSize(size),
+		m_step(0), m_movable(true)
+	{
+	}
+
+	quint64 getEnd() const
+	{
+		return m_start + m_size;
+	}
+
+	QString m_name;
+	quint64 m_start;
+	quint64 m_size;
+	// Content can not be shrunk below this.
+	quint64 m_minSize;
+	// Changed size is a multiple of this (e.g. LVM extent), 0 if any.
+	quint64 m_step;
+	// False if the partition must stay at m_start.
+	bool m_movable;
+};
+
+////////////////////////////////////////////////////////////
+// Geometry
+
+struct Geometry
+{
+	Geometry(quint64 end, quint64 alignment):
+		m_end(end), m_alignment(alignment)
+	{
+	}
+
+	// Partitions must end before this offset.
+	quint64 m_end;
+	// Moved partitions start and resized partitions end on this boundary.
+	quint64 m_alignment;
+};
+
+////////////////////////////////////////////////////////////
+// Target
+
+struct Target
+{
+	explicit Target(const Partition &source):
+		m_source(source), m_start(source.m_start), m_size(source.m_size)
+	{
+	}
+
+	bool isMoved() const
+	{
+		return m_start != m_source.m_start;
+	}
+
+	bool isResized() const
+	{
+		return m_size != m_source.m_size;
+	}
+
+	Partition m_source;
+	quint64 m_start;
+	quint64 m_size;
+};
+
+////////////////////////////////////////////////////////////
+// Step
+
+struct Step
+{
+	enum Action {SHRINK, MOVE, GROW};
+
+	Step(Action action, int target):
+		m_action(action), m_target(target)
+	{
+	}
+
+	Action m_action;
+	// Index in Plan::m_targets.
+	int m_target;
+};
+
+////////////////////////////////////////////////////////////
+// Plan
+
+/* Steps are ordered so that no step overwrites data of a later one:
+ * content is shrunk in place first, then moved, then grown. */
+struct Plan
+{
+	bool isMoving() const;
+	/* Data copied by MOVE steps. */
+	quint64 getMovedBytes() const;
+
+	QList<Target> m_targets;
+	QList<Step> m_steps;
+};
+
+////////////////////////////////////////////////////////////
+// Planner
+
+/* Fits partitions below Geometry::m_end moving as few bytes as possible.
+ * Partitions keep their order. Leading partitions stay in place and the
+ * last of them is shrunk, partitions after it are packed behind it. */
+struct Planner
+{
+	Planner(const QList<Partition> &partitions, const Geometry &geometry);
+
+	Expected<Plan> plan() const;
+
+private:
+	quint64 getStep(int index) const;
+	quint64 getFloor(int index) const;
+	/* End of the last partition if 'first' stays in place and the rest
+	 * is packed behind it. */
+	quint64 pack(int first, const QList<quint64> &sizes,
+	             QList<quint64> *starts = NULL) const;
+	bool fits(int first, const QList<quint64> &sizes) const;
+	/* Largest allowed size of 'index' keeping the layout fit. */
+	quint64 fitSize(int first, int index, QList<quint64> sizes) const;
+	bool isFeasible(int first) const;
+	Plan build(int first, const QList<quint64> &sizes) const;
+
+	QList<Partition> m_partitions;
+	Geometry m_geometry;
+};
+
+} // namespace Layout
+
+#endif // LAYOUT_H
@@ -31,18 +31,154 @@
 #include <QTemporaryFile>
 #include <QSet>
 #include <QFileInfo>
+#include <QtEndian>
 #include <boost/optional.hpp>
 
 #include "Lvm.h"
 #include "Util.h"
+#include "Errors.h"
 
 using namespace Lvm;
 
 namespace
 {
 	const char PARSER[] = "/usr/share/prl-disk-tool/lvm_parser.py";
+
+	enum {SECTOR_SIZE = 512};
+
+	// Label is in one of the first sectors, followed by PV header.
+	enum
+	{
+		LABEL_SCAN_SECTORS = 4,
+		LABEL_HEADER_OFFSET = 20,
+		LABEL_TYPE = 24,
+		PV_ID_SIZE = 32,
+		PV_AREAS = 40,
+		PV_AREA_SIZE = 16,
+	};
+
+	const char LABEL_ID[] = "LABELONE";
+	const char LABEL_TYPE_LVM2[] = "LVM2 001";
+
+	// Metadata area is a ring buffer behind its header.
+	enum
+	{
+		MDA_MAGIC = 4,
+		MDA_SIZE = 32,
+		MDA_TEXT_OFFSET = 40,
+		MDA_TEXT_SIZE = 48,
+		MDA_TEXT_FLAGS = 60,
+		MDA_HEADER_SIZE = 512,
+		MDA_TEXT_IGNORED = 1,
+	};
+
+	const char MDA_MAGIC_TEXT[] = " LVM2 x[5A%r0N*>";
+
+	template <class T>
+	T getLE(const QByteArray &data, int offset)
+	{
+		return qFromLittleEndian<T>((const uchar *)data.constData() + offset);
+	}
+
+	Expected<QByteArray> readBytes(const Probe::Disk &disk, quint64 offset, quint64 size)
+	{
+		if (offset + size > disk.getSize())
+			return Expected<QByteArray>::fromMessage(QString("LVM read at %1 beyond the disk end").arg(offset));
+		QByteArray data(size, 0);
+		Expected<void> res = disk.read(offset, data.data(), size);
+		if (!res.isOk())
+			return res;
+		return data;
+	}
+
+	Expected<QString> readMetadata(const Probe::Disk &disk, quint64 area, quint64 areaSize)
+	{
+		Expected<QByteArray> header = readBytes(disk, area, MDA_HEADER_SIZE);
+		if (!header.isOk())
+			return header;
+		const QByteArray &h = header.get();
+		if (h.mid(MDA_MAGIC, sizeof(MDA_MAGIC_TEXT) - 1) != QByteArray(MDA_MAGIC_TEXT))
+			return Expected<QString>::fromMessage(QString("Invalid LVM metadata area at %1").arg(area));
+
+		quint64 size = getLE<quint64>(h, MDA_SIZE);
+		quint64 offset = getLE<quint64>(h, MDA_TEXT_OFFSET);
+		quint64 textSize = getLE<quint64>(h, MDA_TEXT_SIZE);
+		if (offset == 0 || (getLE<quint32>(h, MDA_TEXT_FLAGS) & MDA_TEXT_IGNORED))
+			return QString();
+		if (size > areaSize || offset < MDA_HEADER_SIZE || offset >= size ||
+			textSize > size - MDA_HEADER_SIZE)
+			return Expected<QString>::fromMessage(QString("Invalid LVM metadata location at %1").arg(area));
+
+		// Text wraps around the end of the area.
+		quint64 first = qMin(textSize, size - offset);
+		Expected<QByteArray> text = readBytes(disk, area + offset, first);
+		if (!text.isOk())
+			return text;
+		QByteArray result = text.get();
+		if (first < textSize)
+		{
+			Expected<QByteArray> rest = readBytes(disk, area + MDA_HEADER_SIZE, textSize - first);
+			if (!rest.isOk())
+				return rest;
+			result += rest.get();
+		}
+		int end = result.indexOf('\0');
+		return QString::fromUtf8(end < 0 ? result : result.left(end));
+	}
 } // namespace
 
+////////////////////////////////////////////////////////////
+// Label
+
+Expected<Label> Label::read(const Probe::Disk &disk, quint64 offset)
+{
+	Expected<QByteArray> sectors = readBytes(disk, offset, LABEL_SCAN_SECTORS * SECTOR_SIZE);
+	if (!sectors.isOk())
+		return sectors;
+	for (int i = 0; i < LABEL_SCAN_SECTORS; ++i)
+	{
+		QByteArray sector = sectors.get().mid(i * SECTOR_SIZE, SECTOR_SIZE);
+		if (!sector.startsWith(LABEL_ID) ||
+			sector.mid(LABEL_TYPE, sizeof(LABEL_TYPE_LVM2) - 1) != QByteArray(LABEL_TYPE_LVM2))
+			continue;
+		quint32 header = getLE<quint32>(sector, LABEL_HEADER_OFFSET);
+		if (header + PV_AREAS > SECTOR_SIZE)
+			return Expected<Label>::fromMessage(QString("Invalid LVM label at %1").arg(offset));
+		QString id = QString::fromLatin1(sector.mid(header, PV_ID_SIZE));
+
+		// Data areas, then metadata areas, both lists end with zero offset.
+		bool data = true;
+		for (int pos = header + PV_AREAS; pos + PV_AREA_SIZE <= SECTOR_SIZE; pos += PV_AREA_SIZE)
+		{
+			quint64 area = getLE<quint64>(sector, pos);
+			if (area == 0 && data)
+			{
+				data = false;
+				continue;
+			}
+			if (area == 0)
+				break;
+			if (data)
+				continue;
+			Expected<QString> metadata = readMetadata(disk, offset + area,
+					getLE<quint64>(sector, pos + 8));
+			if (!metadata.isOk())
+				return metadata;
+			return Label(id, metadata.get());
+		}
+		return Label(id, QString());
+	}
+	return Expected<Label>::fromMessage(QString("No LVM label at %1").arg(offset), ERR_UNSUPPORTED_FS);
+}
+
+QString Label::getGroupName() const
+{
+	QRegExp groupRE("([a-zA-Z0-9._+-]+)\\s*\\{");
+	if (groupRE.indexIn(m_metadata) == -1)
+		return QString();
+	return groupRE.cap(1);
+}
+
 ////////////////////////////////////////////////////////////
 // Physical
 
@@ -86,6 +222,41 @@ Physical Config::getPhysical(const QString &partition) const
 	return Physical(m_group, matched);
 }
 
+Expected<QList<QPair<quint64, quint64> > > Config::getFreeExtents(const Volume &volume) const
+{
+	typedef QPair<quint64, quint64> range_type;
+	if (!m_complete)
+		return Expected<QList<range_type> >::fromMessage("LVM config is not parsed completely");
+	Q_FOREACH(const Volume &other, m_volumes)
+	{
+		if (other.getId() != volume.getId() && other.getDevice() == volume.getDevice())
+		{
+			return Expected<QList<range_type> >::fromMessage(QString("Ambiguous LVM device '%1'")
+					.arg(volume.getDevice()));
+		}
+	}
+
+	QList<range_type> used;
+	Q_FOREACH(const Segment &segment, m_segments)
+	{
+		if (segment.getPhysical() == volume.getDevice())
+			used << range_type(segment.getStartInExtents(), segment.getEndInExtents() + 1);
+	}
+	qSort(used);
+
+	QList<range_type> result;
+	quint64 next = 0;
+	Q_FOREACH(const range_type &range, used)
+	{
+		if (range.first > next)
+			result << range_type(next, range.first - next);
+		next = qMax(next, range.second);
+	}
+	if (next < volume.getSizeInExtents())
+		result << range_type(next, volume.getSizeInExtents() - next);
+	return result;
+}
+
 QStringList Config::getPhysicals() const
 {
 	QSet<QString> result;
@@ -100,15 +271,25 @@ Expected<Config> Config::parseOutput(const QByteArray &out)
 	// Thus using spaces as separators is safe.
 	//               |    vg_name       |ExtSizeInSec|  attrs |
 	QRegExp groupRE("^([a-zA-Z0-9._+-]+)\\s+(\\d+)\\s+(.*)\\s*$");
-	//                 |  lv_name         |segmentId|    linear   |lastInLogical|pv_name(partition)|startOffset|endOffset|    attrs    |
-	QRegExp segmentRE("^([a-zA-Z0-9._+-]+):(\\d+)\\s+(linear|stripped)\\s+(last)?\\s*(/dev/sd[a-z]\\d+)\\[(\\d+)\\.\\.(\\d+)\\]\\s+(.*)\\s*$");
+	//                 |  lv_name         |segmentId|    linear   |lastInLogical|pv_name|startOffset|endOffset|    attrs    |
+	QRegExp segmentRE("^([a-zA-Z0-9._+-]+):(\\d+)\\s+(linear|stripped)\\s+(last)?\\s*(\\S+)\\[(\\d+)\\.\\.(\\d+)\\]\\s+(.*)\\s*$");
+	//            |pv_name|   id         |  pe_start |  pe_count |
+	QRegExp volumeRE("^PV\\s+(\\S+)\\s+([a-zA-Z0-9]+)\\s+(\\d+)\\s+(\\d+)\\s*$");
 
 	QStringList lines = QString(out).split('\n', QString::SkipEmptyParts);
 	QList<Segment> segments;
+	QList<Volume> volumes;
 	boost::optional<Group> group;
+	bool complete = true;
 	Q_FOREACH(const QString &line, lines)
 	{
-		if (segmentRE.indexIn(line) != -1)
+		if (volumeRE.indexIn(line) != -1)
+		{
+			Logger::info(QString("Lvm parser: %1").arg(line));
+			volumes << Volume(volumeRE.cap(1), volumeRE.cap(2),
+							  volumeRE.cap(3).toULongLong(), volumeRE.cap(4).toULongLong());
+		}
+		else if (segmentRE.indexIn(line) != -1)
 		{
 			Logger::info(QString("Lvm parser: %1").arg(line));
 			Logical logical(segmentRE.cap(1), segmentRE.cap(8));
@@ -129,11 +310,12 @@ Expected<Config> Config::parseOutput(const QByteArray &out)
 		else
 		{
 			Logger::error(QString("Unable to parse line from %1:\n'%2'").arg(PARSER, line));
+			complete = false;
 		}
 	}
 
 	if (!group)
 		return Expected<Config>::fromMessage("No LVM group found");
 
-	return Config(*group, segments);
+	return Config(*group, segments, volumes, complete);
 }
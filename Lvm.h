@@ -32,8 +32,10 @@
 #define LVM_H
 
 #include <QList>
+#include <QPair>
 
 #include "Expected.h"
+#include "Probe.h"
 
 
 namespace Lvm
@@ -202,6 +204,80 @@ private:
 	QList<Segment> m_segments;
 };
 
+////////////////////////////////////////////////////////////
+// Volume
+
+/* Physical volume as described by group metadata. */
+struct Volume
+{
+	Volume(const QString &device, const QString &id, quint64 start, quint64 count):
+		m_device(device), m_id(id), m_start(start), m_count(count)
+	{
+	}
+
+	/* Device name hint, as segments refer to the volume. */
+	const QString& getDevice() const
+	{
+		return m_device;
+	}
+
+	/* UUID without dashes, as in volume label. */
+	const QString& getId() const
+	{
+		return m_id;
+	}
+
+	/* Offset of the first extent on the volume. */
+	quint64 getStartInSectors() const
+	{
+		return m_start;
+	}
+
+	quint64 getSizeInExtents() const
+	{
+		return m_count;
+	}
+
+private:
+	QString m_device;
+	QString m_id;
+	quint64 m_start;
+	quint64 m_count;
+};
+
+////////////////////////////////////////////////////////////
+// Label
+
+/* Physical volume header read directly from the disk. */
+struct Label
+{
+	/* Fails with ERR_UNSUPPORTED_FS if there is no LVM2 label at 'offset'. */
+	static Expected<Label> read(const Probe::Disk &disk, quint64 offset);
+
+	const QString& getId() const
+	{
+		return m_id;
+	}
+
+	/* Text of the first metadata area, empty if the volume has none. */
+	const QString& getMetadata() const
+	{
+		return m_metadata;
+	}
+
+	/* Name of the group described by metadata. */
+	QString getGroupName() const;
+
+private:
+	Label(const QString &id, const QString &metadata):
+		m_id(id), m_metadata(metadata)
+	{
+	}
+
+	QString m_id;
+	QString m_metadata;
+};
+
 ////////////////////////////////////////////////////////////
 // Config
 
@@ -218,9 +294,20 @@ struct Config
 	Physical getPhysical(const QString &partition) const;
 	QStringList getPhysicals() const;
 
+	const QList<Volume>& getVolumes() const
+	{
+		return m_volumes;
+	}
+
+	/* Extents of the volume not used by any segment, (start, count) pairs.
+	 * Fails if parser output was not understood completely: unknown
+	 * segments must not be reported as free. */
+	Expected<QList<QPair<quint64, quint64> > > getFreeExtents(const Volume &volume) const;
+
 private:
-	Config(const Group &group, const QList<Segment> &segments):
-		m_group(group), m_segments(segments)
+	Config(const Group &group, const QList<Segment> &segments,
+		   const QList<Volume> &volumes, bool complete):
+		m_group(group), m_segments(segments), m_volumes(volumes), m_complete(complete)
 	{
 	}
 
@@ -228,6 +315,8 @@ private:
 
 	Group m_group;
 	QList<Segment> m_segments;
+	QList<Volume> m_volumes;
+	bool m_complete;
 };
 
 } // namespace Lvm
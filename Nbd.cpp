@@ -0,0 +1,227 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Nbd.cpp
+///
+/// Read-only access to images through qemu-nbd.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#ifdef HAVE_LIBNBD
+#include <libnbd.h>
+#endif
+
+#include <QFile>
+#include <QList>
+#include <QVector>
+
+#include "Nbd.h"
+#include "Util.h"
+#include "Errors.h"
+
+using namespace Nbd;
+
+namespace
+{
+
+const char QEMU_NBD[] = "/usr/bin/qemu-nbd";
+
+// Maximum payload most NBD servers accept in one request.
+enum {NBD_MAX_REQUEST = 32 * 1024 * 1024};
+
+#ifdef HAVE_LIBNBD
+QString getError()
+{
+	const char *msg = nbd_get_error();
+	return msg ? QString(msg) : QString("unknown error");
+}
+#endif
+
+} // namespace
+
+////////////////////////////////////////////////////////////
+// Export
+
+Expected<boost::shared_ptr<Export> > Export::open(const QString &path, bool writable)
+{
+#ifdef HAVE_LIBNBD
+	struct nbd_handle *handle = nbd_create();
+	if (!handle)
+		return Expected<boost::shared_ptr<Export> >::fromMessage(getError());
+
+	QList<QByteArray> args;
+	args << QEMU_NBD << QString("--format=%1").arg(DISK_FORMAT).toUtf8();
+	// Zeroed and trimmed clusters are released rather than written.
+	if (writable)
+		args << "--discard=unmap";
+	else
+		args << "--read-only";
+	args << path.toUtf8();
+	QVector<char *> argv;
+	for (int i = 0; i < args.size(); ++i)
+		argv << args[i].data();
+	argv << NULL;
+	if (nbd_connect_systemd_socket_activation(handle, argv.data()))
+	{
+		QString msg = QString("Unable to export %1 over NBD: %2").arg(path).arg(getError());
+		nbd_close(handle);
+		return Expected<boost::shared_ptr<Export> >::fromMessage(msg);
+	}
+	int64_t size = nbd_get_size(handle);
+	if (size < 0)
+	{
+		QString msg = QString("Unable to get size of %1: %2").arg(path).arg(getError());
+		nbd_close(handle);
+		return Expected<boost::shared_ptr<Export> >::fromMessage(msg);
+	}
+	Logger::info(QString("Exported %1 over NBD").arg(path));
+	return boost::shared_ptr<Export>(new Export(handle, size));
+#else
+	Q_UNUSED(writable);
+	return Expected<boost::shared_ptr<Export> >::fromMessage(
+			QString("Unable to open %1: built without NBD support").arg(path),
+			ERR_UNSUPPORTED_IMAGE);
+#endif
+}
+
+bool Export::isAvailable()
+{
+#ifdef HAVE_LIBNBD
+	return QFile::exists(QEMU_NBD);
+#else
+	return false;
+#endif
+}
+
+Export::~Export()
+{
+#ifdef HAVE_LIBNBD
+	// Also terminates qemu-nbd.
+	nbd_shutdown(m_handle, 0);
+	nbd_close(m_handle);
+#endif
+}
+
+Expected<void> Export::read(quint64 offset, char *buf, quint64 size) const
+{
+#ifdef HAVE_LIBNBD
+	while (size > 0)
+	{
+		quint64 count = qMin(size, (quint64)NBD_MAX_REQUEST);
+		if (nbd_pread(m_handle, buf, count, offset, 0))
+		{
+			return Expected<void>::fromMessage(QString("NBD read at %1 failed: %2")
+					.arg(offset).arg(getError()));
+		}
+		offset += count;
+		buf += count;
+		size -= count;
+	}
+	return Expected<void>();
+#else
+	Q_UNUSED(offset);
+	Q_UNUSED(buf);
+	Q_UNUSED(size);
+	return Expected<void>::fromMessage("Built without NBD support", ERR_UNSUPPORTED_IMAGE);
+#endif
+}
+
+Expected<void> Export::write(quint64 offset, const char *buf, quint64 size)
+{
+#ifdef HAVE_LIBNBD
+	while (size > 0)
+	{
+		quint64 count = qMin(size, (quint64)NBD_MAX_REQUEST);
+		if (nbd_pwrite(m_handle, buf, count, offset, 0))
+		{
+			return Expected<void>::fromMessage(QString("NBD write at %1 failed: %2")
+					.arg(offset).arg(getError()));
+		}
+		offset += count;
+		buf += count;
+		size -= count;
+	}
+	return Expected<void>();
+#else
+	Q_UNUSED(offset);
+	Q_UNUSED(buf);
+	Q_UNUSED(size);
+	return Expected<void>::fromMessage("Built without NBD support", ERR_UNSUPPORTED_IMAGE);
+#endif
+}
+
+Expected<void> Export::zero(quint64 offset, quint64 size)
+{
+#ifdef HAVE_LIBNBD
+	while (size > 0)
+	{
+		quint64 count = qMin(size, (quint64)NBD_MAX_REQUEST);
+		if (nbd_zero(m_handle, count, offset, LIBNBD_CMD_FLAG_MAY_TRIM))
+		{
+			return Expected<void>::fromMessage(QString("NBD zero at %1 failed: %2")
+					.arg(offset).arg(getError()));
+		}
+		offset += count;
+		size -= count;
+	}
+	return Expected<void>();
+#else
+	Q_UNUSED(offset);
+	Q_UNUSED(size);
+	return Expected<void>::fromMessage("Built without NBD support", ERR_UNSUPPORTED_IMAGE);
+#endif
+}
+
+Expected<void> Export::trim(quint64 offset, quint64 size)
+{
+#ifdef HAVE_LIBNBD
+	while (size > 0)
+	{
+		quint64 count = qMin(size, (quint64)NBD_MAX_REQUEST);
+		if (nbd_trim(m_handle, count, offset, 0))
+		{
+			return Expected<void>::fromMessage(QString("NBD trim at %1 failed: %2")
+					.arg(offset).arg(getError()));
+		}
+		offset += count;
+		size -= count;
+	}
+	return Expected<void>();
+#else
+	Q_UNUSED(offset);
+	Q_UNUSED(size);
+	return Expected<void>::fromMessage("Built without NBD support", ERR_UNSUPPORTED_IMAGE);
+#endif
+}
+
+Expected<void> Export::flush()
+{
+#ifdef HAVE_LIBNBD
+	if (nbd_flush(m_handle, 0))
+		return Expected<void>::fromMessage(QString("NBD flush failed: %1").arg(getError()));
+	return Expected<void>();
+#else
+	return Expected<void>::fromMessage("Built without NBD support", ERR_UNSUPPORTED_IMAGE);
+#endif
+}
@@ -0,0 +1,86 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Nbd.h
+///
+/// Read-only access to images through qemu-nbd.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#ifndef NBD_H
+#define NBD_H
+
+#include <QString>
+
+#include <boost/shared_ptr.hpp>
+
+#include "Expected.h"
+#include "Probe.h"
+
+struct nbd_handle;
+
+namespace Nbd
+{
+
+////////////////////////////////////////////////////////////
+// Export
+
+/* Image served by private qemu-nbd instance, which is started with socket
+ * activation and stops when the export is destroyed. */
+struct Export: Probe::Disk
+{
+	/* Fails with ERR_UNSUPPORTED_IMAGE if built without libnbd. */
+	static Expected<boost::shared_ptr<Export> > open(const QString &path, bool writable = false);
+	/* Whether open() can succeed at all. */
+	static bool isAvailable();
+
+	~Export();
+
+	quint64 getSize() const
+	{
+		return m_size;
+	}
+
+	/* Thread-safe. */
+	Expected<void> read(quint64 offset, char *buf, quint64 size) const;
+	Expected<void> write(quint64 offset, const char *buf, quint64 size);
+	/* Zeroed clusters are not allocated. */
+	Expected<void> zero(quint64 offset, quint64 size);
+	/* Contents become undefined, clusters are released. */
+	Expected<void> trim(quint64 offset, quint64 size);
+	Expected<void> flush();
+
+private:
+	Export(struct nbd_handle *handle, quint64 size):
+		m_handle(handle), m_size(size)
+	{
+	}
+
+	struct nbd_handle *m_handle;
+	quint64 m_size;
+};
+
+} // namespace Nbd
+
+#endif // NBD_H
@@ -0,0 +1,203 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file PartTable.cpp
+///
+/// Editing partition tables directly on the image.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#include <zlib.h>
+
+#include <QByteArray>
+#include <QtEndian>
+
+#include "PartTable.h"
+#include "Errors.h"
+#include "Util.h"
+
+namespace
+{
+
+enum {SECTOR_SIZE = 512};
+
+enum
+{
+	MBR_ENTRIES_OFFSET = 446,
+	MBR_TYPE_OFFSET = 4,
+	MBR_SIZE_OFFSET = 12,
+	MBR_TYPE_GPT = 0xEE,
+};
+
+enum
+{
+	GPT_HEADER_SIZE = 12,
+	GPT_HEADER_CRC = 16,
+	GPT_MY_LBA = 24,
+	GPT_ALTERNATE_LBA = 32,
+	GPT_LAST_USABLE_LBA = 48,
+	GPT_ENTRIES_LBA = 72,
+	GPT_ENTRY_COUNT = 80,
+	GPT_ENTRY_SIZE = 84,
+	GPT_ENTRIES_CRC = 88,
+	GPT_MIN_HEADER_SIZE = 92,
+	GPT_ENTRY_LAST_LBA = 40,
+	GPT_MAX_ENTRIES = 1024,
+	GPT_MAX_ENTRY_SIZE = 4096,
+};
+
+const char GPT_SIGNATURE[] = "EFI PART";
+
+template <class T>
+T get(const QByteArray &data, int offset)
+{
+	return qFromLittleEndian<T>((const uchar *)data.constData() + offset);
+}
+
+template <class T>
+void set(QByteArray &data, int offset, T value)
+{
+	qToLittleEndian<T>(value, (uchar *)data.data() + offset);
+}
+
+quint32 crc(const QByteArray &data, int size)
+{
+	return crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data.constData(), size);
+}
+
+void updateHeaderCrc(QByteArray &header)
+{
+	quint32 size = get<quint32>(header, GPT_HEADER_SIZE);
+	set<quint32>(header, GPT_HEADER_CRC, 0);
+	set<quint32>(header, GPT_HEADER_CRC, crc(header, size));
+}
+
+Expected<QByteArray> read(const Probe::Disk &disk, quint64 offset, quint64 size)
+{
+	QByteArray data(size, 0);
+	Expected<void> res = disk.read(offset, data.data(), size);
+	if (!res.isOk())
+		return res;
+	return data;
+}
+
+Expected<void> write(Probe::Disk &disk, quint64 offset, const QByteArray &data)
+{
+	return disk.write(offset, data.constData(), data.size());
+}
+
+Expected<void> invalid(const QString &msg)
+{
+	return Expected<void>::fromMessage(msg, ERR_UNSUPPORTED_PARTITION);
+}
+
+} // namespace
+
+namespace PartTable
+{
+
+Expected<void> expandGpt(Probe::Disk &disk)
+{
+	Expected<QByteArray> headerRes = read(disk, SECTOR_SIZE, SECTOR_SIZE);
+	if (!headerRes.isOk())
+		return headerRes;
+	QByteArray primary = headerRes.get();
+	if (!primary.startsWith(GPT_SIGNATURE))
+		return invalid("No GPT header");
+
+	quint32 headerSize = get<quint32>(primary, GPT_HEADER_SIZE);
+	if (headerSize < GPT_MIN_HEADER_SIZE || headerSize > SECTOR_SIZE)
+		return invalid("Invalid GPT header size");
+	QByteArray check(primary);
+	updateHeaderCrc(check);
+	if (check != primary || get<quint64>(primary, GPT_MY_LBA) != 1)
+		return invalid("Invalid GPT header");
+
+	quint32 count = get<quint32>(primary, GPT_ENTRY_COUNT);
+	quint32 entrySize = get<quint32>(primary, GPT_ENTRY_SIZE);
+	if (count > GPT_MAX_ENTRIES || entrySize > GPT_MAX_ENTRY_SIZE ||
+		entrySize < GPT_ENTRY_LAST_LBA + sizeof(quint64))
+		return invalid("Invalid GPT entries");
+	quint64 entriesSize = (quint64)count * entrySize;
+	quint64 entriesSectors = (entriesSize + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	Expected<QByteArray> entries = read(disk,
+			get<quint64>(primary, GPT_ENTRIES_LBA) * SECTOR_SIZE, entriesSectors * SECTOR_SIZE);
+	if (!entries.isOk())
+		return entries;
+	if (crc(entries.get(), entriesSize) != get<quint32>(primary, GPT_ENTRIES_CRC))
+		return invalid("Invalid GPT entries checksum");
+
+	quint64 lastLba = disk.getSize() / SECTOR_SIZE - 1;
+	quint64 alternate = get<quint64>(primary, GPT_ALTERNATE_LBA);
+	if (alternate == lastLba)
+		return Expected<void>();
+
+	quint64 backupEntriesLba = lastLba - entriesSectors;
+	quint64 lastUsable = backupEntriesLba - 1;
+	// Disk may also have been truncated.
+	for (quint32 i = 0; i < count; ++i)
+	{
+		if (get<quint64>(entries.get(), i * entrySize + GPT_ENTRY_LAST_LBA) > lastUsable)
+			return invalid(QString("GPT partition %1 does not fit into disk").arg(i + 1));
+	}
+	Logger::info(QString("Moving GPT backup header from %1 to %2").arg(alternate).arg(lastLba));
+
+	QByteArray backup(primary);
+	set<quint64>(backup, GPT_MY_LBA, lastLba);
+	set<quint64>(backup, GPT_ALTERNATE_LBA, 1);
+	set<quint64>(backup, GPT_ENTRIES_LBA, backupEntriesLba);
+	set<quint64>(backup, GPT_LAST_USABLE_LBA, lastUsable);
+	updateHeaderCrc(backup);
+
+	set<quint64>(primary, GPT_ALTERNATE_LBA, lastLba);
+	set<quint64>(primary, GPT_LAST_USABLE_LBA, lastUsable);
+	updateHeaderCrc(primary);
+
+	Expected<void> res;
+	if (!(res = write(disk, backupEntriesLba * SECTOR_SIZE, entries.get())).isOk())
+		return res;
+	if (!(res = write(disk, lastLba * SECTOR_SIZE, backup)).isOk())
+		return res;
+	if (!(res = disk.flush()).isOk())
+		return res;
+	if (!(res = write(disk, SECTOR_SIZE, primary)).isOk())
+		return res;
+	if (!(res = disk.flush()).isOk())
+		return res;
+
+	// Protective MBR covers the whole disk, up to the 32-bit limit.
+	Expected<QByteArray> mbr = read(disk, 0, SECTOR_SIZE);
+	if (!mbr.isOk())
+		return mbr;
+	QByteArray sector = mbr.get();
+	if ((quint8)sector[MBR_ENTRIES_OFFSET + MBR_TYPE_OFFSET] != MBR_TYPE_GPT)
+		return Expected<void>();
+	set<quint32>(sector, MBR_ENTRIES_OFFSET + MBR_SIZE_OFFSET,
+			(quint32)qMin<quint64>(lastLba, 0xFFFFFFFF));
+	if (!(res = write(disk, 0, sector)).isOk())
+		return res;
+	return disk.flush();
+}
+
+} // namespace PartTable
@@ -0,0 +1,48 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file PartTable.h
+///
+/// Editing partition tables directly on the image.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#ifndef PARTTABLE_H
+#define PARTTABLE_H
+
+#include "Expected.h"
+#include "Probe.h"
+
+namespace PartTable
+{
+
+/* Moves backup GPT header and entries to the end of the resized disk, like
+ * sgdisk -e. Backup is written and flushed before the primary header
+ * points to it, so either old or new backup is valid at any moment.
+ * Fails with ERR_UNSUPPORTED_PARTITION if the table is not a sane GPT. */
+Expected<void> expandGpt(Probe::Disk &disk);
+
+} // namespace PartTable
+
+#endif // PARTTABLE_H
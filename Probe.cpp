@@ -0,0 +1,598 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Probe.cpp
+///
+/// Reading partition tables and filesystem superblocks without appliance.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#include <limits.h>
+
+#include <QtEndian>
+
+#include "Probe.h"
+#include "Qcow2.h"
+#include "Nbd.h"
+#include "Errors.h"
+#include "Util.h"
+
+using namespace Probe;
+
+namespace
+{
+
+enum {SECTOR_SIZE = 512};
+
+enum
+{
+	MBR_ENTRIES_OFFSET = 446,
+	MBR_ENTRY_SIZE = 16,
+	MBR_ENTRIES = 4,
+	MBR_SIGNATURE_OFFSET = 510,
+	MBR_SIGNATURE = 0xAA55,
+};
+
+enum
+{
+	MBR_TYPE_EXTENDED_CHS = 0x05,
+	MBR_TYPE_EXTENDED_LBA = 0x0F,
+	MBR_TYPE_EXTENDED_LINUX = 0x85,
+	MBR_TYPE_GPT = 0xEE,
+};
+
+enum
+{
+	GPT_ENTRIES_LBA_OFFSET = 72,
+	GPT_ENTRY_COUNT_OFFSET = 80,
+	GPT_ENTRY_SIZE_OFFSET = 84,
+	GPT_FIRST_LBA_OFFSET = 32,
+	GPT_LAST_LBA_OFFSET = 40,
+	GPT_MAX_ENTRIES = 1024,
+};
+
+const char GPT_SIGNATURE[] = "EFI PART";
+
+// Logical partitions chain may be cyclic in broken tables.
+enum {MAX_LOGICAL = 128};
+
+enum {ZERO_BUFFER_SIZE = 1024 * 1024};
+
+enum
+{
+	MBR_STATUS_INACTIVE = 0x00,
+	MBR_STATUS_ACTIVE = 0x80,
+};
+
+enum
+{
+	EXT_SUPERBLOCK_OFFSET = 1024,
+	EXT_WTIME = 0x30,
+	EXT_MNT_COUNT = 0x34,
+	EXT_MAGIC_OFFSET = 0x38,
+	EXT_MAGIC = 0xEF53,
+	EXT_FEATURE_COMPAT = 0x5C,
+	EXT_FEATURE_INCOMPAT = 0x60,
+	EXT_FEATURE_RO_COMPAT = 0x64,
+	EXT_UUID = 0x68,
+	EXT_KBYTES_WRITTEN = 0x178,
+	EXT_SUPERBLOCK_SIZE = 1024,
+};
+
+enum
+{
+	XFS_UUID = 32,
+	XFS_VERSIONNUM = 100,
+	XFS_ICOUNT = 128,
+	XFS_IFREE = 136,
+	XFS_FDBLOCKS = 144,
+	XFS_LSN = 240,
+	XFS_SUPERBLOCK_SIZE = 512,
+	XFS_VERSION_MASK = 0x000F,
+	XFS_VERSION_5 = 5,
+};
+
+// Features decide between ext2, ext3 and ext4 as in blkid.
+enum
+{
+	EXT_COMPAT_HAS_JOURNAL = 0x0004,
+	EXT_INCOMPAT_JOURNAL_DEV = 0x0008,
+	EXT2_INCOMPAT_SUPPORTED = 0x0012,
+	EXT3_INCOMPAT_SUPPORTED = 0x0016,
+	EXT3_RO_COMPAT_SUPPORTED = 0x0007,
+};
+
+const char XFS_MAGIC[] = "XFSB";
+
+enum
+{
+	BTRFS_SUPERBLOCK_OFFSET = 0x10000,
+	BTRFS_FSID = 0x20,
+	BTRFS_MAGIC_OFFSET = 0x40,
+	BTRFS_GENERATION = 0x48,
+	BTRFS_SUPERBLOCK_SIZE = 4096,
+};
+
+const char BTRFS_MAGIC[] = "_BHRfS_M";
+
+enum
+{
+	SWAP_VERSION = 1024,
+	SWAP_LAST_PAGE = 1028,
+	SWAP_NR_BADPAGES = 1032,
+	SWAP_BADPAGES = 1536,
+	SWAP_MIN_PAGE_SIZE = 4096,
+	SWAP_MAX_PAGE_SIZE = 65536,
+};
+
+// Hibernation images have other signatures and are not recognized.
+const char SWAP_MAGIC[] = "SWAPSPACE2";
+
+enum
+{
+	BOOT_OEM_ID = 3,
+	BOOT_BYTES_PER_SECTOR = 0x0B,
+	BOOT_SECTORS_PER_CLUSTER = 0x0D,
+	BOOT_FAT_COUNT = 0x10,
+	BOOT_FAT_TYPE = 0x36,
+	BOOT_FAT32_TYPE = 0x52,
+	BOOT_SIGNATURE_OFFSET = 510,
+	BOOT_SIGNATURE = 0xAA55,
+};
+
+const char NTFS_OEM_ID[] = "NTFS    ";
+
+enum
+{
+	LVM_LABEL_SECTORS = 4,
+	LVM_TYPE_OFFSET = 24,
+};
+
+const char LVM_LABEL_ID[] = "LABELONE";
+const char LVM_TYPE[] = "LVM2 001";
+
+// Covers all signatures checked, btrfs superblock is the farthest.
+enum {FS_PROBE_SIZE = BTRFS_SUPERBLOCK_OFFSET + BTRFS_SUPERBLOCK_SIZE};
+
+////////////////////////////////////////////////////////////
+// ChainDisk
+
+struct ChainDisk: Disk
+{
+	explicit ChainDisk(const Qcow2::Chain &chain):
+		m_chain(chain)
+	{
+	}
+
+	quint64 getSize() const
+	{
+		return m_chain.getSize();
+	}
+
+	Expected<void> read(quint64 offset, char *buf, quint64 size) const
+	{
+		return m_chain.read(offset, buf, size);
+	}
+
+private:
+	Qcow2::Chain m_chain;
+};
+
+template <class T>
+T getLE(const QByteArray &data, int offset)
+{
+	return qFromLittleEndian<T>((const uchar *)data.constData() + offset);
+}
+
+template <class T>
+T getBE(const QByteArray &data, int offset)
+{
+	return qFromBigEndian<T>((const uchar *)data.constData() + offset);
+}
+
+template <class T>
+T getSwap(const QByteArray &data, int offset, bool le)
+{
+	return le ? getLE<T>(data, offset) : getBE<T>(data, offset);
+}
+
+template <class T>
+void putSwap(QByteArray &data, int offset, T value, bool le)
+{
+	if (le)
+		qToLittleEndian<T>(value, (uchar *)data.data() + offset);
+	else
+		qToBigEndian<T>(value, (uchar *)data.data() + offset);
+}
+
+Expected<QByteArray> read(const Disk &disk, quint64 offset, quint64 size)
+{
+	if (offset + size > disk.getSize())
+		return QByteArray();
+	QByteArray data(size, 0);
+	Expected<void> res = disk.read(offset, data.data(), size);
+	if (!res.isOk())
+		return res;
+	return data;
+}
+
+bool isPowerOf2(quint32 value)
+{
+	return value != 0 && (value & (value - 1)) == 0;
+}
+
+QString getExtType(const QByteArray &superblock)
+{
+	quint32 compat = getLE<quint32>(superblock, EXT_FEATURE_COMPAT);
+	quint32 incompat = getLE<quint32>(superblock, EXT_FEATURE_INCOMPAT);
+	quint32 roCompat = getLE<quint32>(superblock, EXT_FEATURE_RO_COMPAT);
+	// External journal, not mountable.
+	if (incompat & EXT_INCOMPAT_JOURNAL_DEV)
+		return "jbd";
+	if (roCompat & ~EXT3_RO_COMPAT_SUPPORTED)
+		return "ext4";
+	if (compat & EXT_COMPAT_HAS_JOURNAL)
+		return (incompat & ~EXT3_INCOMPAT_SUPPORTED) ? "ext4" : "ext3";
+	return (incompat & ~EXT2_INCOMPAT_SUPPORTED) ? "ext4" : "ext2";
+}
+
+bool isFat(const QByteArray &boot)
+{
+	if (getLE<quint16>(boot, BOOT_SIGNATURE_OFFSET) != BOOT_SIGNATURE)
+		return false;
+	if (!boot.mid(BOOT_FAT_TYPE, 3).startsWith("FAT") &&
+		!boot.mid(BOOT_FAT_TYPE, 5).startsWith("MSDOS") &&
+		!boot.mid(BOOT_FAT32_TYPE, 5).startsWith("FAT32") &&
+		!boot.mid(BOOT_FAT32_TYPE, 5).startsWith("MSWIN"))
+		return false;
+	// Labels alone are also found in boot sectors of other filesystems.
+	quint16 sectorSize = getLE<quint16>(boot, BOOT_BYTES_PER_SECTOR);
+	quint8 fats = boot[BOOT_FAT_COUNT];
+	return isPowerOf2(sectorSize) && sectorSize >= SECTOR_SIZE && sectorSize <= 4096 &&
+		   isPowerOf2((quint8)boot[BOOT_SECTORS_PER_CLUSTER]) && (fats == 1 || fats == 2);
+}
+
+bool isLvm(const QByteArray &data)
+{
+	for (int i = 0; i < LVM_LABEL_SECTORS; ++i)
+	{
+		QByteArray sector = data.mid(i * SECTOR_SIZE, SECTOR_SIZE);
+		if (sector.startsWith(LVM_LABEL_ID) &&
+			sector.mid(LVM_TYPE_OFFSET, sizeof(LVM_TYPE) - 1) == QByteArray(LVM_TYPE))
+			return true;
+	}
+	return false;
+}
+
+Expected<QList<Partition> > readGpt(const Disk &disk, QByteArray *table)
+{
+	Expected<QByteArray> header = read(disk, SECTOR_SIZE, SECTOR_SIZE);
+	if (!header.isOk())
+		return header;
+	if (!header.get().startsWith(GPT_SIGNATURE))
+		return Expected<QList<Partition> >::fromMessage("Invalid GPT header", ERR_UNSUPPORTED_PARTITION);
+
+	quint64 entriesLba = getLE<quint64>(header.get(), GPT_ENTRIES_LBA_OFFSET);
+	quint32 count = getLE<quint32>(header.get(), GPT_ENTRY_COUNT_OFFSET);
+	quint32 entrySize = getLE<quint32>(header.get(), GPT_ENTRY_SIZE_OFFSET);
+	if (count > GPT_MAX_ENTRIES || entrySize < GPT_LAST_LBA_OFFSET + sizeof(quint64))
+		return Expected<QList<Partition> >::fromMessage("Invalid GPT header", ERR_UNSUPPORTED_PARTITION);
+
+	Expected<QByteArray> entries = read(disk, entriesLba * SECTOR_SIZE, (quint64)count * entrySize);
+	if (!entries.isOk())
+		return entries;
+	if (table)
+	{
+		*table += header.get();
+		*table += entries.get();
+	}
+
+	QList<Partition> partitions;
+	for (quint32 i = 0; i < count && (i + 1) * entrySize <= (quint32)entries.get().size(); ++i)
+	{
+		quint64 first = getLE<quint64>(entries.get(), i * entrySize + GPT_FIRST_LBA_OFFSET);
+		quint64 last = getLE<quint64>(entries.get(), i * entrySize + GPT_LAST_LBA_OFFSET);
+		if (first == 0 || last < first)
+			continue;
+		partitions << Partition(i + 1, first * SECTOR_SIZE, (last - first + 1) * SECTOR_SIZE);
+	}
+	return partitions;
+}
+
+bool isExtended(quint8 type)
+{
+	return type == MBR_TYPE_EXTENDED_CHS || type == MBR_TYPE_EXTENDED_LBA ||
+		   type == MBR_TYPE_EXTENDED_LINUX;
+}
+
+Expected<QByteArray> readMbr(const Disk &disk, quint64 offset)
+{
+	Expected<QByteArray> mbr = read(disk, offset, SECTOR_SIZE);
+	if (!mbr.isOk())
+		return mbr;
+	if (mbr.get().size() != SECTOR_SIZE ||
+		getLE<quint16>(mbr.get(), MBR_SIGNATURE_OFFSET) != MBR_SIGNATURE)
+		return Expected<QByteArray>::fromMessage("No MBR signature", ERR_NO_PARTITION_TABLE);
+	return mbr;
+}
+
+Expected<QList<Partition> > readLogical(const Disk &disk, quint64 extended,
+		QByteArray *table)
+{
+	QList<Partition> partitions;
+	quint64 ebr = extended;
+	for (int n = 0; n < MAX_LOGICAL; ++n)
+	{
+		Expected<QByteArray> sector = readMbr(disk, ebr);
+		if (!sector.isOk())
+		{
+			return Expected<QList<Partition> >::fromMessage(QString("Invalid EBR at %1")
+					.arg(ebr), ERR_UNSUPPORTED_PARTITION);
+		}
+		if (table)
+			*table += sector.get();
+
+		// First entry is the logical partition, second links to the next EBR.
+		const QByteArray &s = sector.get();
+		int entry = MBR_ENTRIES_OFFSET;
+		quint32 start = getLE<quint32>(s, entry + 8);
+		quint32 size = getLE<quint32>(s, entry + 12);
+		if (s[entry + 4] != 0 && size != 0)
+		{
+			partitions << Partition(MBR_ENTRIES + 1 + partitions.size(),
+					ebr + (quint64)start * SECTOR_SIZE, (quint64)size * SECTOR_SIZE);
+		}
+
+		entry += MBR_ENTRY_SIZE;
+		quint32 next = getLE<quint32>(s, entry + 8);
+		if (!isExtended(s[entry + 4]) || next == 0)
+			return partitions;
+		ebr = extended + (quint64)next * SECTOR_SIZE;
+	}
+	return Expected<QList<Partition> >::fromMessage("Too many logical partitions",
+			ERR_UNSUPPORTED_PARTITION);
+}
+
+} // namespace
+
+namespace Probe
+{
+
+////////////////////////////////////////////////////////////
+// Disk
+
+Expected<void> Disk::write(quint64 offset, const char *buf, quint64 size)
+{
+	Q_UNUSED(buf);
+	Q_UNUSED(size);
+	return Expected<void>::fromMessage(QString("Write at %1 to read-only disk").arg(offset));
+}
+
+Expected<void> Disk::zero(quint64 offset, quint64 size)
+{
+	QByteArray buf(qMin(size, (quint64)ZERO_BUFFER_SIZE), 0);
+	while (size > 0)
+	{
+		quint64 count = qMin(size, (quint64)buf.size());
+		Expected<void> res = write(offset, buf.constData(), count);
+		if (!res.isOk())
+			return res;
+		offset += count;
+		size -= count;
+	}
+	return Expected<void>();
+}
+
+Expected<void> Disk::flush()
+{
+	return Expected<void>::fromMessage("Flush of read-only disk");
+}
+
+////////////////////////////////////////////////////////////
+// Functions
+
+Expected<boost::shared_ptr<Disk> > openDisk(const QStringList &paths)
+{
+	Expected<Qcow2::Chain> chain = Qcow2::Chain::open(paths);
+	if (chain.isOk())
+		return boost::shared_ptr<Disk>(new ChainDisk(chain.get()));
+	Logger::info(QString("Native reader failed, trying NBD: %1").arg(chain.getMessage()));
+
+	// qemu-nbd follows the backing chain itself.
+	Expected<boost::shared_ptr<Nbd::Export> > nbd = Nbd::Export::open(paths.last());
+	if (!nbd.isOk())
+		return nbd;
+	return boost::shared_ptr<Disk>(nbd.get());
+}
+
+Expected<Table> readTable(const Disk &disk)
+{
+	Expected<QByteArray> mbr = readMbr(disk, 0);
+	if (!mbr.isOk())
+		return mbr;
+
+	Table table;
+	table.m_type = "msdos";
+	table.m_raw = mbr.get();
+	for (int i = 0; i < MBR_ENTRIES; ++i)
+	{
+		int entry = MBR_ENTRIES_OFFSET + i * MBR_ENTRY_SIZE;
+		quint8 status = mbr.get()[entry];
+		quint8 type = mbr.get()[entry + 4];
+		quint64 start = (quint64)getLE<quint32>(mbr.get(), entry + 8) * SECTOR_SIZE;
+		quint64 size = (quint64)getLE<quint32>(mbr.get(), entry + 12) * SECTOR_SIZE;
+		if (type == 0 || size == 0)
+			continue;
+		// Boot sector of whole-disk filesystem also has MBR signature.
+		if ((status != MBR_STATUS_INACTIVE && status != MBR_STATUS_ACTIVE) ||
+			(type != MBR_TYPE_GPT && start + size > disk.getSize()))
+		{
+			return Expected<Table>::fromMessage(QString("Invalid MBR entry %1").arg(i),
+					ERR_UNSUPPORTED_PARTITION);
+		}
+		if (type == MBR_TYPE_GPT)
+		{
+			Expected<QList<Partition> > gpt = readGpt(disk, &table.m_raw);
+			if (!gpt.isOk())
+				return gpt;
+			table.m_type = "gpt";
+			table.m_partitions = gpt.get();
+			return table;
+		}
+		if (isExtended(type))
+		{
+			Expected<QList<Partition> > logical = readLogical(disk, start, &table.m_raw);
+			if (!logical.isOk())
+				return logical;
+			table.m_partitions += logical.get();
+			continue;
+		}
+		table.m_partitions << Partition(i + 1, start, size);
+	}
+	return table;
+}
+
+Expected<QString> readFsStamp(const Disk &disk, quint64 offset)
+{
+	Expected<QByteArray> ext = read(disk, offset + EXT_SUPERBLOCK_OFFSET, EXT_SUPERBLOCK_SIZE);
+	if (!ext.isOk())
+		return ext;
+	const QByteArray &e = ext.get();
+	if (e.size() == EXT_SUPERBLOCK_SIZE && getLE<quint16>(e, EXT_MAGIC_OFFSET) == EXT_MAGIC)
+	{
+		// Write time and lifetime writes change on every rw mount.
+		return QString("ext:%1:%2:%3:%4")
+			.arg(QString(e.mid(EXT_UUID, 16).toHex()))
+			.arg(getLE<quint32>(e, EXT_WTIME))
+			.arg(getLE<quint16>(e, EXT_MNT_COUNT))
+			.arg(getLE<quint64>(e, EXT_KBYTES_WRITTEN));
+	}
+
+	Expected<QByteArray> xfs = read(disk, offset, XFS_SUPERBLOCK_SIZE);
+	if (!xfs.isOk())
+		return xfs;
+	const QByteArray &x = xfs.get();
+	if (x.startsWith(XFS_MAGIC))
+	{
+		// Counters miss overwrites inside files. Only v5 superblock carries
+		// the LSN of its last write, which advances on every rw mount.
+		if ((getBE<quint16>(x, XFS_VERSIONNUM) & XFS_VERSION_MASK) < XFS_VERSION_5)
+			return QString();
+		return QString("xfs:%1:%2:%3:%4:%5")
+			.arg(QString(x.mid(XFS_UUID, 16).toHex()))
+			.arg(getBE<quint64>(x, XFS_LSN))
+			.arg(getBE<quint64>(x, XFS_ICOUNT))
+			.arg(getBE<quint64>(x, XFS_IFREE))
+			.arg(getBE<quint64>(x, XFS_FDBLOCKS));
+	}
+
+	Expected<QByteArray> btrfs = read(disk, offset + BTRFS_SUPERBLOCK_OFFSET, BTRFS_SUPERBLOCK_SIZE);
+	if (!btrfs.isOk())
+		return btrfs;
+	const QByteArray &b = btrfs.get();
+	if (b.size() == BTRFS_SUPERBLOCK_SIZE && b.mid(BTRFS_MAGIC_OFFSET, 8) == QByteArray(BTRFS_MAGIC))
+	{
+		return QString("btrfs:%1:%2")
+			.arg(QString(b.mid(BTRFS_FSID, 16).toHex()))
+			.arg(getLE<quint64>(b, BTRFS_GENERATION));
+	}
+
+	return QString();
+}
+
+Expected<QString> readFsType(const Disk &disk, quint64 offset)
+{
+	if (offset + SECTOR_SIZE > disk.getSize())
+		return QString();
+	Expected<QByteArray> data = read(disk, offset,
+			qMin((quint64)FS_PROBE_SIZE, disk.getSize() - offset));
+	if (!data.isOk())
+		return data;
+	const QByteArray &d = data.get();
+
+	// Volume labels and swap headers are written over older filesystems
+	// without wiping their superblocks.
+	if (isLvm(d))
+		return QString("LVM2_member");
+	if (getSwapPageSize(d) != 0)
+		return QString("swap");
+	if (d.size() >= EXT_SUPERBLOCK_OFFSET + EXT_SUPERBLOCK_SIZE)
+	{
+		QByteArray ext = d.mid(EXT_SUPERBLOCK_OFFSET, EXT_SUPERBLOCK_SIZE);
+		if (getLE<quint16>(ext, EXT_MAGIC_OFFSET) == EXT_MAGIC)
+			return getExtType(ext);
+	}
+	if (d.startsWith(XFS_MAGIC))
+		return QString("xfs");
+	if (d.size() == FS_PROBE_SIZE &&
+		d.mid(BTRFS_SUPERBLOCK_OFFSET + BTRFS_MAGIC_OFFSET, 8) == QByteArray(BTRFS_MAGIC))
+		return QString("btrfs");
+	if (d.mid(BOOT_OEM_ID, sizeof(NTFS_OEM_ID) - 1) == QByteArray(NTFS_OEM_ID))
+		return QString("ntfs");
+	if (isFat(d))
+		return QString("vfat");
+	return QString();
+}
+
+quint64 getSwapPageSize(const QByteArray &data)
+{
+	int magicSize = sizeof(SWAP_MAGIC) - 1;
+	for (int page = SWAP_MIN_PAGE_SIZE; page <= SWAP_MAX_PAGE_SIZE; page *= 2)
+	{
+		if (data.size() < page || data.mid(page - magicSize, magicSize) != QByteArray(SWAP_MAGIC))
+			continue;
+		// Byte order of the guest.
+		if (getLE<quint32>(data, SWAP_VERSION) == 1 || getBE<quint32>(data, SWAP_VERSION) == 1)
+			return page;
+	}
+	return 0;
+}
+
+QByteArray resizeSwapHeader(const QByteArray &data, quint64 size)
+{
+	quint64 page = getSwapPageSize(data);
+	if (page == 0 || size < 2 * page)
+		return QByteArray();
+
+	QByteArray header = data.left(page);
+	bool le = getLE<quint32>(header, SWAP_VERSION) == 1;
+	quint32 lastPage = qMin(size / page - 1, (quint64)UINT_MAX);
+	putSwap<quint32>(header, SWAP_LAST_PAGE, lastPage, le);
+
+	// Swap is not enabled with bad pages beyond the end.
+	quint32 maxBad = (page - SWAP_BADPAGES - (sizeof(SWAP_MAGIC) - 1)) / 4;
+	quint32 count = qMin(getSwap<quint32>(header, SWAP_NR_BADPAGES, le), maxBad), kept = 0;
+	for (quint32 i = 0; i < count; ++i)
+	{
+		quint32 bad = getSwap<quint32>(header, SWAP_BADPAGES + 4 * i, le);
+		if (bad <= lastPage)
+			putSwap<quint32>(header, SWAP_BADPAGES + 4 * kept++, bad, le);
+	}
+	for (quint32 i = kept; i < count; ++i)
+		putSwap<quint32>(header, SWAP_BADPAGES + 4 * i, 0, le);
+	putSwap<quint32>(header, SWAP_NR_BADPAGES, kept, le);
+	return header;
+}
+
+} // namespace Probe
@@ -0,0 +1,128 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Probe.h
+///
+/// Reading partition tables and filesystem superblocks without appliance.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+#include <boost/shared_ptr.hpp>
+
+#include "Expected.h"
+
+namespace Probe
+{
+
+////////////////////////////////////////////////////////////
+// Disk
+
+/* Guest view of an image. */
+struct Disk
+{
+	virtual ~Disk()
+	{
+	}
+
+	virtual quint64 getSize() const = 0;
+	virtual Expected<void> read(quint64 offset, char *buf, quint64 size) const = 0;
+
+	/* Fail on read-only disks. */
+	virtual Expected<void> write(quint64 offset, const char *buf, quint64 size);
+	/* Writes zero buffers unless the disk can do better. */
+	virtual Expected<void> zero(quint64 offset, quint64 size);
+	virtual Expected<void> flush();
+};
+
+/* 'paths' is the backing chain from base to top. Images are read natively,
+ * ones the native reader does not support are exported over NBD. */
+Expected<boost::shared_ptr<Disk> > openDisk(const QStringList &paths);
+
+////////////////////////////////////////////////////////////
+// Partition
+
+/* Offsets are in bytes. */
+struct Partition
+{
+	Partition(int number, quint64 start, quint64 size):
+		m_number(number), m_start(start), m_size(size)
+	{
+	}
+
+	quint64 getEnd() const
+	{
+		return m_start + m_size;
+	}
+
+	// As in device names, logical partitions start from 5.
+	int m_number;
+	quint64 m_start;
+	quint64 m_size;
+};
+
+////////////////////////////////////////////////////////////
+// Table
+
+struct Table
+{
+	// "msdos" or "gpt", as reported by libguestfs.
+	QString m_type;
+	// Primary and logical partitions.
+	QList<Partition> m_partitions;
+	// Sectors the table was read from.
+	QByteArray m_raw;
+};
+
+/* Fails with ERR_NO_PARTITION_TABLE if there is no MBR signature and with
+ * ERR_UNSUPPORTED_PARTITION if the table looks broken. */
+Expected<Table> readTable(const Disk &disk);
+
+/* Identity and change marker of filesystem at 'offset'.
+ * Empty string if filesystem is not recognized or has no marker. */
+Expected<QString> readFsStamp(const Disk &disk, quint64 offset);
+
+/* Type of filesystem or volume at 'offset' named as by libguestfs, e.g.
+ * "ext4", "vfat", "swap" or "LVM2_member". Signatures are checked like
+ * blkid does. Empty string if nothing is recognized. */
+Expected<QString> readFsType(const Disk &disk, quint64 offset);
+
+/* Page size of swap area whose header starts 'data', 0 if it is not an
+ * active swap area (e.g. holds hibernation image). */
+quint64 getSwapPageSize(const QByteArray &data);
+
+/* Header of the swap area for 'size' bytes, UUID and label are kept.
+ * Empty if 'data' is not an active swap header or 'size' is too small. */
+QByteArray resizeSwapHeader(const QByteArray &data, quint64 size);
+
+} // namespace Probe
+
+#endif // PROBE_H
@@ -56,6 +56,10 @@ extern const char OPT_INFO[] = "info";
 extern const char OPT_UNITS[] = "units";
 extern const char OPT_HUMAN_READABLE[] = "";
 extern const char OPT_EXTERNAL[] = "external";
+extern const char OPT_MEMORY_LIMIT[] = "memory-limit";
+extern const char OPT_INCREMENTAL[] = "incremental";
+extern const char OPT_COMPRESS[] = "compress";
+extern const char OPT_REPAIR[] = "repair";
 
 
 OptionParser::OptionParser()
@@ -59,6 +59,10 @@ extern const char OPT_INFO[];
 extern const char OPT_UNITS[];
 extern const char OPT_HUMAN_READABLE[];
 extern const char OPT_EXTERNAL[];
+extern const char OPT_MEMORY_LIMIT[];
+extern const char OPT_INCREMENTAL[];
+extern const char OPT_COMPRESS[];
+extern const char OPT_REPAIR[];
 
 
 ////////////////////////////////////////////////////////////
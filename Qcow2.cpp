@@ -0,0 +1,2232 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Qcow2.cpp
+///
+/// Native read access to qcow2 image metadata and clusters.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <QtEndian>
+#include <QMap>
+#include <QSet>
+#include <QCache>
+#include <QPair>
+#include <QtConcurrentMap>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "Qcow2.h"
+#include "AsyncIO.h"
+#include "Util.h"
+#include "Errors.h"
+
+using namespace Qcow2;
+
+namespace
+{
+
+const quint32 QCOW2_MAGIC = 0x514649fb; // 'Q', 'F', 'I', 0xfb
+
+enum {HEADER_V2_LENGTH = 72};
+enum {HEADER_V3_LENGTH = 104};
+// With compression type field.
+enum {HEADER_V3_COMPRESSION_LENGTH = 112};
+enum {MIN_CLUSTER_BITS = 9};
+enum {MAX_CLUSTER_BITS = 21};
+enum {COMPRESSED_SECTOR_SIZE = 512};
+
+// Incompatible feature bits.
+const quint64 INCOMPAT_DIRTY = 1ULL << 0;
+const quint64 INCOMPAT_CORRUPT = 1ULL << 1;
+const quint64 INCOMPAT_DATA_FILE = 1ULL << 2;
+const quint64 INCOMPAT_COMPRESSION = 1ULL << 3;
+const quint64 INCOMPAT_EXTL2 = 1ULL << 4;
+const quint64 INCOMPAT_KNOWN = INCOMPAT_DIRTY | INCOMPAT_CORRUPT |
+	INCOMPAT_DATA_FILE | INCOMPAT_COMPRESSION | INCOMPAT_EXTL2;
+
+// Table entry bits.
+const quint64 OFLAG_COPIED = 1ULL << 63;
+const quint64 OFLAG_COMPRESSED = 1ULL << 62;
+const quint64 OFLAG_ZERO = 1ULL << 0;
+const quint64 L1E_OFFSET_MASK = 0x00fffffffffffe00ULL;
+const quint64 L2E_OFFSET_MASK = 0x00fffffffffffe00ULL;
+const quint64 REFT_OFFSET_MASK = 0xfffffffffffffe00ULL;
+
+// Snapshot table entry without extra data, id and name.
+enum {SNAPSHOT_ENTRY_SIZE = 40};
+
+enum {CHECK_BATCH = 1024}; // L2 tables per thread pool round
+enum {CHECK_MESSAGES = 20};
+enum {CHECK_BLOCK = 256}; // refcounts compared per branch-free round
+
+
+enum {REFCOUNT_ORDER = 4}; // 16-bit refcounts written by Writer
+enum {WRITE_BUFFER_SIZE = 4 * 1024 * 1024};
+enum {COPY_BATCH_SIZE = 4 * 1024 * 1024};
+// Clusters read ahead for compression workers.
+enum {COMPRESS_BATCH_SIZE = 64 * 1024 * 1024};
+// Guest data read ahead by chain copy workers.
+enum {CHAIN_BATCH_SIZE = 64 * 1024 * 1024};
+enum {COPY_QUEUE_DEPTH = 32};
+// L2 tables read ahead by table walkers.
+enum {L2_PREFETCH = 16};
+enum {L2_CACHE_LIMIT = 64 * 1024 * 1024};
+enum {ZSTD_LEVEL = 3};
+
+// Header extensions.
+const quint32 EXT_END = 0;
+const quint32 EXT_BACKING_FORMAT = 0xe2792aca;
+const quint32 EXT_BITMAPS = 0x23852875;
+const quint32 EXT_FEATURE_TABLE = 0x6803f857;
+enum {EXT_HEADER_SIZE = 8};
+enum {EXT_BITMAPS_SIZE = 24};
+
+const quint64 AUTOCLEAR_BITMAPS = 1ULL << 0;
+
+// Bitmap directory entry.
+enum {BITMAP_ENTRY_SIZE = 24};
+enum {BITMAP_TYPE_DIRTY = 1};
+const quint32 BITMAP_IN_USE = 1U << 0;
+const quint32 BITMAP_AUTO = 1U << 1;
+// Bitmap table entry with no data cluster: all bits are set.
+const quint64 BME_ALL_ONES = 1ULL << 0;
+const quint64 BME_OFFSET_MASK = 0x00fffffffffffe00ULL;
+
+quint16 be16(const QByteArray &data, int offset)
+{
+	return qFromBigEndian<quint16>(
+			reinterpret_cast<const uchar *>(data.constData()) + offset);
+}
+
+quint64 align8(quint64 value)
+{
+	return (value + 7) & ~7ULL;
+}
+
+/* Appends range to the sorted list merging adjacent ones. */
+void appendExtent(extentList_type &list, quint64 offset, quint64 size)
+{
+	if (!list.isEmpty() && list.last().getEnd() == offset)
+		list.last().m_size += size;
+	else
+		list << Extent(offset, size);
+}
+
+quint32 be32(const QByteArray &data, int offset)
+{
+	return qFromBigEndian<quint32>(
+			reinterpret_cast<const uchar *>(data.constData()) + offset);
+}
+
+quint64 be64(const QByteArray &data, int offset)
+{
+	return qFromBigEndian<quint64>(
+			reinterpret_cast<const uchar *>(data.constData()) + offset);
+}
+
+Expected<void> unsupported(const QString &what)
+{
+	return Expected<void>::fromMessage(
+			QString("Unsupported qcow2 image: %1").arg(what), ERR_UNSUPPORTED_IMAGE);
+}
+
+Expected<void> cancelled()
+{
+	return Expected<void>::fromMessage("Operation was cancelled");
+}
+
+bool isCancelled(const Abort::token_type &token)
+{
+	return token && token->isCancellationRequested();
+}
+
+////////////////////////////////////////////////////////////
+// Refcounts
+
+/* 16-bit refcounts, modified blocks are kept in memory until flush(). */
+struct Refcounts
+{
+	Refcounts(const boost::shared_ptr<File> &file, const Header &header):
+		m_file(file), m_header(header)
+	{
+	}
+
+	Expected<void> load();
+	Expected<quint16> get(quint64 offset);
+	Expected<void> set(quint64 offset, quint16 value);
+	/* For every cluster covering [offset, offset + size). */
+	Expected<void> decrement(quint64 offset, quint64 size, quint32 count = 1);
+	/* Refcounts of the first 'clusters' clusters, 0 if there is no block. */
+	Expected<QVector<quint16> > readAll(quint64 clusters);
+	Expected<void> flush() const;
+
+	/* Refcount block offsets, 0 if there is no block. */
+	const QVector<quint64>& getTable() const
+	{
+		return m_table;
+	}
+
+private:
+	Expected<quint16 *> getEntry(quint64 offset);
+
+	boost::shared_ptr<File> m_file;
+	Header m_header;
+	QVector<quint64> m_table;
+	QMap<quint64, QVector<quint16> > m_blocks;
+	QSet<quint64> m_dirty;
+};
+
+Expected<void> Refcounts::load()
+{
+	quint64 entries = m_header.m_refcountTableClusters * m_header.getL2Entries();
+	m_table = QVector<quint64>(entries);
+	Expected<void> res = m_file->read(m_header.m_refcountTableOffset,
+			reinterpret_cast<char *>(m_table.data()), entries * sizeof(quint64));
+	if (!res.isOk())
+		return res;
+	for (int i = 0; i < m_table.size(); ++i)
+		m_table[i] = qFromBigEndian<quint64>(m_table[i]) & REFT_OFFSET_MASK;
+	return Expected<void>();
+}
+
+Expected<quint16 *> Refcounts::getEntry(quint64 offset)
+{
+	quint64 cluster = offset / m_header.getClusterSize();
+	quint64 perBlock = m_header.getClusterSize() / sizeof(quint16);
+	quint64 index = cluster / perBlock;
+	if (index >= (quint64)m_table.size() || m_table[index] == 0)
+	{
+		return Expected<quint16 *>::fromMessage(QString("%1: no refcount for offset %2")
+				.arg(m_file->getPath()).arg(offset));
+	}
+
+	QMap<quint64, QVector<quint16> >::iterator it = m_blocks.find(index);
+	if (it == m_blocks.end())
+	{
+		QVector<quint16> block(perBlock);
+		Expected<void> res = m_file->read(m_table[index],
+				reinterpret_cast<char *>(block.data()), perBlock * sizeof(quint16));
+		if (!res.isOk())
+			return res;
+		for (int i = 0; i < block.size(); ++i)
+			block[i] = qFromBigEndian<quint16>(block[i]);
+		it = m_blocks.insert(index, block);
+	}
+	return &it.value()[cluster % perBlock];
+}
+
+Expected<quint16> Refcounts::get(quint64 offset)
+{
+	Expected<quint16 *> entry = getEntry(offset);
+	if (!entry.isOk())
+		return entry;
+	return *entry.get();
+}
+
+Expected<void> Refcounts::set(quint64 offset, quint16 value)
+{
+	Expected<quint16 *> entry = getEntry(offset);
+	if (!entry.isOk())
+		return entry;
+	*entry.get() = value;
+	m_dirty.insert(offset / m_header.getClusterSize() / (m_header.getClusterSize() / sizeof(quint16)));
+	return Expected<void>();
+}
+
+Expected<QVector<quint16> > Refcounts::readAll(quint64 clusters)
+{
+	QVector<quint16> all(clusters, 0);
+	quint64 clusterSize = m_header.getClusterSize();
+	quint64 perBlock = clusterSize / sizeof(quint16);
+	for (quint64 i = 0; i < (quint64)m_table.size() && i * perBlock < clusters; ++i)
+	{
+		if (m_table[i] == 0)
+			continue;
+		Expected<quint16 *> first = getEntry(i * perBlock * clusterSize);
+		if (!first.isOk())
+			return first;
+		quint64 count = qMin(perBlock, clusters - i * perBlock);
+		memcpy(all.data() + i * perBlock, first.get(), count * sizeof(quint16));
+	}
+	return all;
+}
+
+Expected<void> Refcounts::decrement(quint64 offset, quint64 size, quint32 count)
+{
+	quint64 clusterSize = m_header.getClusterSize();
+	quint64 perBlock = clusterSize / sizeof(quint16);
+	for (quint64 c = offset / clusterSize; c <= (offset + size - 1) / clusterSize; ++c)
+	{
+		Expected<quint16 *> entry = getEntry(c * clusterSize);
+		if (!entry.isOk())
+			return entry;
+		if (*entry.get() < count)
+		{
+			return Expected<void>::fromMessage(QString("%1: refcount underflow at offset %2")
+					.arg(m_file->getPath()).arg(c * clusterSize));
+		}
+		*entry.get() -= count;
+		m_dirty.insert(c / perBlock);
+	}
+	return Expected<void>();
+}
+
+Expected<void> Refcounts::flush() const
+{
+	Q_FOREACH(quint64 index, m_dirty)
+	{
+		QVector<quint16> block = m_blocks.value(index);
+		for (int i = 0; i < block.size(); ++i)
+			block[i] = qToBigEndian<quint16>(block[i]);
+		Expected<void> res = m_file->write(m_table[index],
+				reinterpret_cast<const char *>(block.constData()),
+				block.size() * sizeof(quint16));
+		if (!res.isOk())
+			return res;
+	}
+	return Expected<void>();
+}
+
+////////////////////////////////////////////////////////////
+// Usage
+
+/* References to host clusters found by walking metadata. */
+struct Usage
+{
+	Usage(quint64 clusterSize, quint64 fileSize):
+		m_clusterSize(clusterSize),
+		m_refs((fileSize + clusterSize - 1) / clusterSize, 0),
+		m_corruptions(0)
+	{
+	}
+
+	void add(quint64 offset, quint64 size, quint32 count, const char *what)
+	{
+		if (size == 0)
+			return;
+		quint64 last = (offset + size - 1) / m_clusterSize;
+		if (last >= (quint64)m_refs.size())
+		{
+			report(QString("%1 at offset %2 is beyond the end of file").arg(what).arg(offset));
+			return;
+		}
+		quint32 *refs = m_refs.data();
+		for (quint64 i = offset / m_clusterSize; i <= last; ++i)
+			refs[i] += count;
+	}
+
+	void report(const QString &message)
+	{
+		++m_corruptions;
+		if (m_messages.size() < CHECK_MESSAGES)
+			m_messages << message;
+	}
+
+	quint64 m_clusterSize;
+	QVector<quint32> m_refs;
+	quint64 m_corruptions;
+	QStringList m_messages;
+};
+
+typedef QPair<quint64, quint64> hostRange_type;
+
+/* Host ranges referenced by L2 table. */
+struct L2Job
+{
+	typedef void result_type;
+	// Expected has no default constructor, QtConcurrent results need one.
+	typedef boost::optional<Expected<QVector<hostRange_type> > > slot_type;
+
+	L2Job(const Image &image, const QList<quint64> &offsets, slot_type *results):
+		m_image(&image), m_offsets(&offsets), m_results(results)
+	{
+	}
+
+	void operator()(int index) const
+	{
+		m_results[index] = execute(m_offsets->at(index));
+	}
+
+private:
+	Expected<QVector<hostRange_type> > execute(quint64 offset) const
+	{
+		Expected<QVector<quint64> > l2 = m_image->readL2(offset);
+		if (!l2.isOk())
+			return l2;
+		QVector<hostRange_type> ranges;
+		Q_FOREACH(quint64 entry, l2.get())
+		{
+			Cluster c = m_image->decode(entry);
+			// Zero clusters may be preallocated.
+			if (c.m_offset == 0)
+				continue;
+			ranges << hostRange_type(c.m_offset, c.m_type == Cluster::COMPRESSED ?
+					c.m_size : m_image->getClusterSize());
+		}
+		return ranges;
+	}
+
+	const Image *m_image;
+	const QList<quint64> *m_offsets;
+	slot_type *m_results;
+};
+
+/* Allocated guest ranges of one image. */
+struct AllocationJob
+{
+	typedef void result_type;
+	// Expected has no default constructor, QtConcurrent results need one.
+	typedef boost::optional<Expected<extentList_type> > slot_type;
+
+	AllocationJob(const QList<Image> &layers, slot_type *results):
+		m_layers(&layers), m_results(results)
+	{
+	}
+
+	void operator()(int index) const
+	{
+		m_results[index] = execute(m_layers->at(index));
+	}
+
+private:
+	Expected<extentList_type> execute(const Image &image) const
+	{
+		Expected<QVector<quint64> > l1 = image.readL1();
+		if (!l1.isOk())
+			return l1;
+		quint64 clusterSize = image.getClusterSize();
+		quint64 l2Entries = image.getHeader().getL2Entries();
+		extentList_type extents;
+		for (int i = 0; i < l1.get().size(); ++i)
+		{
+			if (i % L2_PREFETCH == 0)
+				image.prefetchL2(l1.get(), i);
+			quint64 l2Offset = Image::getL2Offset(l1.get()[i]);
+			if (l2Offset == 0)
+				continue;
+			Expected<QVector<quint64> > l2 = image.readL2(l2Offset);
+			if (!l2.isOk())
+				return l2;
+			for (int j = 0; j < l2.get().size(); ++j)
+			{
+				if (image.decode(l2.get()[j]).m_type == Cluster::UNALLOCATED)
+					continue;
+				quint64 offset = ((quint64)i * l2Entries + j) * clusterSize;
+				if (!extents.isEmpty() && extents.last().getEnd() == offset)
+					extents.last().m_size += clusterSize;
+				else
+					extents << Extent(offset, clusterSize);
+			}
+		}
+		return extents;
+	}
+
+	const QList<Image> *m_layers;
+	slot_type *m_results;
+};
+
+/* First extent that ends after 'offset'. */
+int findExtent(const extentList_type &extents, quint64 offset)
+{
+	int lo = 0, hi = extents.size();
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (extents[mid].getEnd() <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+bool isExtentLess(const Extent &lhs, const Extent &rhs)
+{
+	return lhs.m_offset < rhs.m_offset;
+}
+
+/* Raw deflate stream with 4K window, as written by qemu. */
+bool inflateCluster(const QByteArray &src, char *buf, quint64 size)
+{
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, -12) != Z_OK)
+		return false;
+
+	strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src.constData()));
+	strm.avail_in = src.size();
+	strm.next_out = reinterpret_cast<Bytef *>(buf);
+	strm.avail_out = size;
+	int ret = inflate(&strm, Z_FINISH);
+	bool full = (strm.avail_out == 0);
+	inflateEnd(&strm);
+	// Input is padded to sectors, so Z_BUF_ERROR with full output is fine.
+	return full && (ret == Z_STREAM_END || ret == Z_BUF_ERROR);
+}
+
+/* Empty result if data does not fit into 'size' - 1 bytes. */
+QByteArray deflateCluster(const QByteArray &src)
+{
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12, 9,
+				Z_DEFAULT_STRATEGY) != Z_OK)
+		return QByteArray();
+
+	QByteArray dst(src.size() - 1, 0);
+	strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src.constData()));
+	strm.avail_in = src.size();
+	strm.next_out = reinterpret_cast<Bytef *>(dst.data());
+	strm.avail_out = dst.size();
+	int ret = deflate(&strm, Z_FINISH);
+	dst.resize(dst.size() - strm.avail_out);
+	deflateEnd(&strm);
+	return ret == Z_STREAM_END ? dst : QByteArray();
+}
+
+#ifdef HAVE_ZSTD
+/* Stream decompression: input is padded to sectors and may hold garbage
+ * after the frame. */
+bool decompressZstd(const QByteArray &src, char *buf, quint64 size)
+{
+	ZSTD_DCtx *ctx = ZSTD_createDCtx();
+	if (ctx == NULL)
+		return false;
+
+	ZSTD_inBuffer in = {src.constData(), (size_t)src.size(), 0};
+	ZSTD_outBuffer out = {buf, size, 0};
+	bool ok = true;
+	while (out.pos < out.size)
+	{
+		size_t inPos = in.pos, outPos = out.pos;
+		size_t ret = ZSTD_decompressStream(ctx, &out, &in);
+		// Error or no progress.
+		if (ZSTD_isError(ret) || (in.pos == inPos && out.pos == outPos))
+		{
+			ok = false;
+			break;
+		}
+	}
+	ZSTD_freeDCtx(ctx);
+	return ok;
+}
+#endif
+
+/* Empty if data does not compress. */
+QByteArray compressZstd(const QByteArray &src)
+{
+#ifdef HAVE_ZSTD
+	QByteArray dst(src.size() - 1, 0);
+	size_t ret = ZSTD_compress(dst.data(), dst.size(), src.constData(), src.size(), ZSTD_LEVEL);
+	if (ZSTD_isError(ret))
+		return QByteArray();
+	dst.resize(ret);
+	return dst;
+#else
+	Q_UNUSED(src);
+	return QByteArray();
+#endif
+}
+
+/* Guest cluster on its way to the new image. */
+struct Chunk
+{
+	quint64 m_cluster;
+	QByteArray m_data;
+	// Empty if data does not compress.
+	QByteArray m_compressed;
+	bool m_zero;
+};
+
+struct CompressJob
+{
+	typedef void result_type;
+
+	explicit CompressJob(CompressionType type):
+		m_type(type)
+	{
+	}
+
+	void operator()(Chunk &chunk) const
+	{
+		chunk.m_zero = (chunk.m_data.count('\0') == chunk.m_data.size());
+		if (chunk.m_zero)
+			return;
+		chunk.m_compressed = (m_type == COMPRESSION_ZSTD) ?
+			compressZstd(chunk.m_data) : deflateCluster(chunk.m_data);
+	}
+
+private:
+	CompressionType m_type;
+};
+
+/* Compresses chunks in parallel, writes them in guest order. */
+Expected<void> writeChunks(Writer &writer, QVector<Chunk> &chunks, CompressionType type)
+{
+	QtConcurrent::blockingMap(chunks, CompressJob(type));
+	Q_FOREACH(const Chunk &chunk, chunks)
+	{
+		Expected<void> res;
+		if (chunk.m_zero)
+			writer.writeZero(chunk.m_cluster);
+		else if (chunk.m_compressed.isEmpty())
+			res = writer.writeData(chunk.m_cluster, chunk.m_data.constData(), 1);
+		else
+		{
+			res = writer.writeCompressed(chunk.m_cluster, chunk.m_compressed.constData(),
+					chunk.m_compressed.size());
+		}
+		if (!res.isOk())
+			return res;
+	}
+	chunks.clear();
+	return Expected<void>();
+}
+
+/* L2 tables shared by all images, least recently used are evicted. */
+struct L2Cache
+{
+	// File id and table offset.
+	typedef QPair<quint64, quint64> key_type;
+
+	L2Cache():
+		// Cost is in KB to fit int.
+		m_cache(L2_CACHE_LIMIT / 1024)
+	{
+	}
+
+	bool find(const key_type &key, QVector<quint64> &table)
+	{
+		QMutexLocker l(&m_mutex);
+		QVector<quint64> *cached = m_cache.object(key);
+		if (cached == NULL)
+			return false;
+		table = *cached;
+		return true;
+	}
+
+	void insert(const key_type &key, const QVector<quint64> &table)
+	{
+		QMutexLocker l(&m_mutex);
+		m_cache.insert(key, new QVector<quint64>(table),
+				qMax<int>(table.size() * sizeof(quint64) / 1024, 1));
+	}
+
+	void remove(const key_type &key)
+	{
+		QMutexLocker l(&m_mutex);
+		m_cache.remove(key);
+	}
+
+	void setLimit(quint64 bytes)
+	{
+		QMutexLocker l(&m_mutex);
+		m_cache.setMaxCost(qMin<quint64>(bytes / 1024, INT_MAX));
+	}
+
+private:
+	QMutex m_mutex;
+	QCache<key_type, QVector<quint64> > m_cache;
+};
+
+L2Cache& getL2Cache()
+{
+	static L2Cache cache;
+	return cache;
+}
+
+QAtomicInt g_fileIds;
+
+/* Guest clusters of one layer that are adjacent on host. */
+struct Run
+{
+	quint64 m_cluster;
+	quint64 m_count;
+	// First host cluster.
+	Cluster m_host;
+	const Image *m_image;
+	// Data file, may be opened with O_DIRECT.
+	boost::shared_ptr<File> m_file;
+	// Compressed data is copied as is.
+	bool m_raw;
+	char *m_data;
+};
+
+/* Reads data of runs into the buffer with one queue, writes it in guest order. */
+Expected<void> writeRuns(Writer &writer, QList<Run> &runs,
+		AsyncIO::Queue &queue, const AsyncIO::Buffer &buffer)
+{
+	quint64 clusterSize = writer.getClusterSize();
+	QList<AsyncIO::Request> requests;
+	char *data = buffer.getData();
+	for (int i = 0; i < runs.size(); ++i)
+	{
+		Run &run = runs[i];
+		run.m_data = data;
+		data += run.m_count * clusterSize;
+		if (run.m_host.m_type == Cluster::NORMAL)
+		{
+			requests << AsyncIO::Request(AsyncIO::Request::READ, run.m_file->getFd(),
+					run.m_host.m_offset, run.m_data, run.m_count * clusterSize);
+		}
+	}
+	Expected<void> res = queue.run(requests);
+	if (!res.isOk())
+		return res;
+
+	Q_FOREACH(const Run &run, runs)
+	{
+		if (run.m_raw)
+		{
+			Expected<QByteArray> compressed = run.m_image->readCompressed(run.m_host);
+			if (!compressed.isOk())
+				return compressed;
+			res = writer.writeCompressed(run.m_cluster, compressed.get().constData(),
+					compressed.get().size());
+		}
+		else
+		{
+			if (run.m_host.m_type == Cluster::COMPRESSED &&
+				!(res = run.m_image->readCluster(run.m_host, run.m_data)).isOk())
+				return res;
+			res = writer.writeData(run.m_cluster, run.m_data, run.m_count);
+		}
+		if (!res.isOk())
+			return res;
+	}
+	runs.clear();
+	return Expected<void>();
+}
+
+} // namespace
+
+bool Qcow2::isCompressionSupported(quint32 type)
+{
+#ifdef HAVE_ZSTD
+	return type == COMPRESSION_ZLIB || type == COMPRESSION_ZSTD;
+#else
+	return type == COMPRESSION_ZLIB;
+#endif
+}
+
+////////////////////////////////////////////////////////////
+// File
+
+Expected<boost::shared_ptr<File> > File::open(const QString &path, bool writable, bool direct)
+{
+	int flags = (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+	int fd = ::open(QSTR2UTF8(path), flags | (direct ? O_DIRECT : 0));
+	// Some filesystems (e.g. tmpfs) do not support O_DIRECT.
+	if (fd < 0 && direct && errno == EINVAL)
+		fd = ::open(QSTR2UTF8(path), flags);
+	if (fd < 0)
+	{
+		return Expected<boost::shared_ptr<File> >::fromMessage(
+				QString("Unable to open %1: %2").arg(path).arg(strerror(errno)));
+	}
+	return boost::shared_ptr<File>(new File(path, fd));
+}
+
+Expected<boost::shared_ptr<File> > File::create(const QString &path)
+{
+	int fd = ::open(QSTR2UTF8(path), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+	{
+		return Expected<boost::shared_ptr<File> >::fromMessage(
+				QString("Unable to create %1: %2").arg(path).arg(strerror(errno)));
+	}
+	return boost::shared_ptr<File>(new File(path, fd));
+}
+
+File::File(const QString &path, int fd):
+	m_path(path), m_fd(fd), m_id(g_fileIds.fetchAndAddOrdered(1)),
+	m_map(NULL), m_mapSize(0), m_mapFailed(false)
+{
+}
+
+File::~File()
+{
+	if (m_map)
+		munmap(const_cast<char *>(m_map), m_mapSize);
+	::close(m_fd);
+}
+
+const char* File::map() const
+{
+	QMutexLocker l(&m_mapMutex);
+	if (m_map || m_mapFailed)
+		return m_map;
+
+	Expected<quint64> size = getSize();
+	void *map = MAP_FAILED;
+	if (size.isOk() && size.get() > 0)
+		map = mmap(NULL, size.get(), PROT_READ, MAP_SHARED, m_fd, 0);
+	if (map == MAP_FAILED)
+	{
+		m_mapFailed = true;
+		return NULL;
+	}
+	m_map = static_cast<const char *>(map);
+	m_mapSize = size.get();
+	return m_map;
+}
+
+Expected<void> File::readMapped(quint64 offset, char *buf, quint64 size) const
+{
+	const char *data = map();
+	// File could grow after it was mapped.
+	if (data == NULL || offset + size > m_mapSize)
+		return read(offset, buf, size);
+	memcpy(buf, data + offset, size);
+	// Data is kept by the bounded L2 cache, pages would grow RSS with
+	// the image. They stay in page cache, concurrent readers refault.
+	long page = sysconf(_SC_PAGESIZE);
+	quint64 start = offset / page * page;
+	madvise(const_cast<char *>(data + start), offset + size - start, MADV_DONTNEED);
+	return Expected<void>();
+}
+
+void File::prefetch(quint64 offset, quint64 size) const
+{
+	const char *data = map();
+	if (data == NULL || offset + size > m_mapSize)
+	{
+		posix_fadvise(m_fd, offset, size, POSIX_FADV_WILLNEED);
+		return;
+	}
+	long page = sysconf(_SC_PAGESIZE);
+	quint64 start = offset / page * page;
+	madvise(const_cast<char *>(data + start), offset + size - start, MADV_WILLNEED);
+}
+
+Expected<void> File::read(quint64 offset, char *buf, quint64 size) const
+{
+	while (size > 0)
+	{
+		ssize_t ret = pread(m_fd, buf, size, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+		{
+			return Expected<void>::fromMessage(QString("Unable to read %1: %2")
+					.arg(m_path).arg(strerror(errno)));
+		}
+		if (ret == 0)
+		{
+			return Expected<void>::fromMessage(QString("Unexpected end of file %1 at %2")
+					.arg(m_path).arg(offset));
+		}
+		buf += ret;
+		offset += ret;
+		size -= ret;
+	}
+	return Expected<void>();
+}
+
+Expected<void> File::write(quint64 offset, const char *buf, quint64 size) const
+{
+	while (size > 0)
+	{
+		ssize_t ret = pwrite(m_fd, buf, size, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+		{
+			return Expected<void>::fromMessage(QString("Unable to write %1: %2")
+					.arg(m_path).arg(strerror(errno)));
+		}
+		buf += ret;
+		offset += ret;
+		size -= ret;
+	}
+	return Expected<void>();
+}
+
+Expected<void> File::sync() const
+{
+	if (fsync(m_fd))
+	{
+		return Expected<void>::fromMessage(QString("Unable to sync %1: %2")
+				.arg(m_path).arg(strerror(errno)));
+	}
+	return Expected<void>();
+}
+
+Expected<quint64> File::getSize() const
+{
+	struct stat st;
+	if (fstat(m_fd, &st))
+	{
+		return Expected<quint64>::fromMessage(QString("Unable to stat %1: %2")
+				.arg(m_path).arg(strerror(errno)));
+	}
+	return st.st_size;
+}
+
+////////////////////////////////////////////////////////////
+// Header
+
+Expected<Header> Header::parse(const QByteArray &data)
+{
+	if (data.size() < HEADER_V2_LENGTH || be32(data, 0) != QCOW2_MAGIC)
+		return Expected<Header>::fromMessage("Not a qcow2 image", ERR_UNSUPPORTED_IMAGE);
+
+	Header h;
+	h.m_version = be32(data, 4);
+	h.m_backingFileOffset = be64(data, 8);
+	h.m_backingFileSize = be32(data, 16);
+	h.m_clusterBits = be32(data, 20);
+	h.m_size = be64(data, 24);
+	h.m_cryptMethod = be32(data, 32);
+	h.m_l1Size = be32(data, 36);
+	h.m_l1TableOffset = be64(data, 40);
+	h.m_refcountTableOffset = be64(data, 48);
+	h.m_refcountTableClusters = be32(data, 56);
+	h.m_nbSnapshots = be32(data, 60);
+	h.m_snapshotsOffset = be64(data, 64);
+	h.m_incompatible = 0;
+	h.m_compatible = 0;
+	h.m_autoclear = 0;
+	h.m_refcountOrder = 4;
+	h.m_headerLength = HEADER_V2_LENGTH;
+	h.m_compressionType = COMPRESSION_ZLIB;
+
+	if (h.m_version == 3)
+	{
+		if (data.size() < HEADER_V3_LENGTH)
+			return Expected<Header>::fromMessage("Truncated qcow2 header");
+		h.m_incompatible = be64(data, 72);
+		h.m_compatible = be64(data, 80);
+		h.m_autoclear = be64(data, 88);
+		h.m_refcountOrder = be32(data, 96);
+		h.m_headerLength = be32(data, 100);
+		if (h.m_headerLength > HEADER_V3_LENGTH && data.size() > HEADER_V3_LENGTH)
+			h.m_compressionType = data[HEADER_V3_LENGTH];
+	}
+	else if (h.m_version != 2)
+		return unsupported(QString("version %1").arg(h.m_version));
+
+	if (h.m_clusterBits < MIN_CLUSTER_BITS || h.m_clusterBits > MAX_CLUSTER_BITS)
+		return unsupported(QString("cluster bits %1").arg(h.m_clusterBits));
+	if (h.m_cryptMethod != 0)
+		return unsupported("encryption");
+	if (h.m_incompatible & ~INCOMPAT_KNOWN)
+		return unsupported(QString("incompatible features 0x%1").arg(h.m_incompatible, 0, 16));
+	if (h.m_incompatible & INCOMPAT_CORRUPT)
+		return unsupported("image is marked corrupt");
+	if (h.m_incompatible & INCOMPAT_DATA_FILE)
+		return unsupported("external data file");
+	if (h.m_incompatible & INCOMPAT_EXTL2)
+		return unsupported("extended L2 entries");
+	if (h.m_refcountOrder > 6)
+		return unsupported(QString("refcount order %1").arg(h.m_refcountOrder));
+	return h;
+}
+
+////////////////////////////////////////////////////////////
+// Extent
+
+Extent Extent::intersect(quint64 offset, quint64 size) const
+{
+	quint64 start = qMax(m_offset, offset);
+	quint64 end = qMin(getEnd(), offset + size);
+	if (start >= end)
+		return Extent(start, 0);
+	return Extent(start, end - start);
+}
+
+////////////////////////////////////////////////////////////
+// Bitmap
+
+bool Bitmap::isInUse() const
+{
+	return m_flags & BITMAP_IN_USE;
+}
+
+bool Bitmap::isEnabled() const
+{
+	return m_flags & BITMAP_AUTO;
+}
+
+////////////////////////////////////////////////////////////
+// Image
+
+Expected<Image> Image::open(const QString &path, bool writable)
+{
+	Expected<boost::shared_ptr<File> > file = File::open(path, writable);
+	if (!file.isOk())
+		return file;
+
+	QByteArray data(HEADER_V3_LENGTH + 1, 0);
+	Expected<quint64> size = file.get()->getSize();
+	if (!size.isOk())
+		return size;
+	if (size.get() < (quint64)data.size())
+		data.resize(size.get());
+
+	Expected<void> res = file.get()->read(0, data.data(), data.size());
+	if (!res.isOk())
+		return res;
+
+	Expected<Header> header = Header::parse(data);
+	if (!header.isOk())
+		return Expected<Image>::fromMessage(QString("%1: %2")
+				.arg(path, header.getMessage()), header.getCode());
+	return Image(file.get(), header.get());
+}
+
+Expected<QVector<quint64> > Image::readTable(quint64 offset, quint64 entries) const
+{
+	QVector<quint64> table(entries);
+	Expected<void> res = m_file->readMapped(offset, reinterpret_cast<char *>(table.data()),
+			entries * sizeof(quint64));
+	if (!res.isOk())
+		return res;
+	for (int i = 0; i < table.size(); ++i)
+		table[i] = qFromBigEndian<quint64>(table[i]);
+	return table;
+}
+
+Expected<void> Image::writeTable(quint64 offset, const QVector<quint64> &table) const
+{
+	getL2Cache().remove(qMakePair(m_file->getId(), offset));
+	QVector<quint64> data(table.size());
+	for (int i = 0; i < table.size(); ++i)
+		data[i] = qToBigEndian<quint64>(table[i]);
+	return m_file->write(offset, reinterpret_cast<const char *>(data.constData()),
+			data.size() * sizeof(quint64));
+}
+
+Expected<QVector<quint64> > Image::readL1() const
+{
+	return readTable(m_header.m_l1TableOffset, m_header.m_l1Size);
+}
+
+Expected<QVector<quint64> > Image::readL2(quint64 offset) const
+{
+	L2Cache::key_type key(m_file->getId(), offset);
+	QVector<quint64> table;
+	if (getL2Cache().find(key, table))
+		return table;
+	Expected<QVector<quint64> > res = readTable(offset, m_header.getL2Entries());
+	if (res.isOk())
+		getL2Cache().insert(key, res.get());
+	return res;
+}
+
+void Image::prefetchL2(const QVector<quint64> &l1, int index) const
+{
+	for (int i = index; i < qMin(index + L2_PREFETCH, l1.size()); ++i)
+	{
+		quint64 offset = getL2Offset(l1[i]);
+		if (offset != 0)
+			m_file->prefetch(offset, getClusterSize());
+	}
+}
+
+void Image::setL2CacheLimit(quint64 bytes)
+{
+	getL2Cache().setLimit(bytes);
+}
+
+quint64 Image::getL2Offset(quint64 l1Entry)
+{
+	return l1Entry & L1E_OFFSET_MASK;
+}
+
+Cluster Image::decode(quint64 l2Entry) const
+{
+	if (l2Entry & OFLAG_COMPRESSED)
+	{
+		quint32 shift = 62 - (m_header.m_clusterBits - 8);
+		quint64 sizeMask = (1ULL << (m_header.m_clusterBits - 8)) - 1;
+		quint64 offset = l2Entry & ((1ULL << shift) - 1);
+		quint64 sectors = ((l2Entry >> shift) & sizeMask) + 1;
+		return Cluster(Cluster::COMPRESSED, offset,
+				sectors * COMPRESSED_SECTOR_SIZE - (offset % COMPRESSED_SECTOR_SIZE));
+	}
+
+	quint64 offset = l2Entry & L2E_OFFSET_MASK;
+	if (m_header.m_version >= 3 && (l2Entry & OFLAG_ZERO))
+		return Cluster(Cluster::ZERO, offset, 0);
+	if (offset == 0)
+		return Cluster();
+	return Cluster(Cluster::NORMAL, offset, getClusterSize());
+}
+
+Expected<void> Image::readCluster(const Cluster &cluster, char *buf) const
+{
+	switch (cluster.m_type)
+	{
+	case Cluster::NORMAL:
+		return m_file->read(cluster.m_offset, buf, getClusterSize());
+	case Cluster::COMPRESSED:
+	{
+		Expected<QByteArray> src = readCompressed(cluster);
+		if (!src.isOk())
+			return src;
+		return decompress(src.get(), buf);
+	}
+	default:
+		memset(buf, 0, getClusterSize());
+		return Expected<void>();
+	}
+}
+
+Expected<QByteArray> Image::readCompressed(const Cluster &cluster) const
+{
+	QByteArray src(cluster.m_size, 0);
+	// Compressed data may end right before EOF with a shorter tail.
+	Expected<quint64> size = m_file->getSize();
+	if (!size.isOk())
+		return size;
+	if (cluster.m_offset + cluster.m_size > size.get())
+		src.resize(size.get() - cluster.m_offset);
+	Expected<void> res = m_file->read(cluster.m_offset, src.data(), src.size());
+	if (!res.isOk())
+		return res;
+	return src;
+}
+
+Expected<void> Image::decompress(const QByteArray &src, char *buf) const
+{
+	bool ok;
+	switch (m_header.m_compressionType)
+	{
+	case COMPRESSION_ZLIB:
+		ok = inflateCluster(src, buf, getClusterSize());
+		break;
+	case COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+		ok = decompressZstd(src, buf, getClusterSize());
+		break;
+#else
+		return unsupported("zstd support is not built");
+#endif
+	default:
+		return unsupported(QString("compression type %1").arg(m_header.m_compressionType));
+	}
+	if (!ok)
+	{
+		return Expected<void>::fromMessage(QString("%1: corrupted compressed cluster")
+				.arg(getPath()));
+	}
+	return Expected<void>();
+}
+
+Expected<QByteArray> Image::readHeaderCluster() const
+{
+	Expected<quint64> fileSize = m_file->getSize();
+	if (!fileSize.isOk())
+		return fileSize;
+	QByteArray header(qMin(getClusterSize(), fileSize.get()), 0);
+	Expected<void> res = m_file->read(0, header.data(), header.size());
+	if (!res.isOk())
+		return res;
+	return header;
+}
+
+Expected<QMap<quint32, QByteArray> > Image::readExtensions() const
+{
+	Expected<QByteArray> res = readHeaderCluster();
+	if (!res.isOk())
+		return res;
+	const QByteArray &header = res.get();
+
+	QMap<quint32, QByteArray> extensions;
+	for (quint64 pos = m_header.m_headerLength; pos + EXT_HEADER_SIZE <= (quint64)header.size(); )
+	{
+		quint32 type = be32(header, pos);
+		quint32 length = be32(header, pos + 4);
+		if (type == EXT_END)
+			break;
+		pos += EXT_HEADER_SIZE;
+		if (pos + length > (quint64)header.size())
+			return Expected<QMap<quint32, QByteArray> >::fromMessage("Corrupted qcow2 header extension");
+		extensions.insert(type, header.mid(pos, length));
+		pos += align8(length);
+	}
+	return extensions;
+}
+
+Expected<QString> Image::readBackingFile() const
+{
+	if (!m_header.hasBacking())
+		return QString();
+	QByteArray name(m_header.m_backingFileSize, 0);
+	Expected<void> res = m_file->read(m_header.m_backingFileOffset, name.data(), name.size());
+	if (!res.isOk())
+		return res;
+	return QString::fromUtf8(name.constData(), name.size());
+}
+
+Expected<QString> Image::readBackingFormat() const
+{
+	Expected<QMap<quint32, QByteArray> > extensions = readExtensions();
+	if (!extensions.isOk())
+		return extensions;
+	QByteArray format = extensions.get().value(EXT_BACKING_FORMAT);
+	return QString::fromUtf8(format.constData(), format.size());
+}
+
+Expected<QList<Bitmap> > Image::readBitmaps() const
+{
+	// Bitmaps are valid only if the last writer knew about them.
+	if (m_header.m_version < 3 || !(m_header.m_autoclear & AUTOCLEAR_BITMAPS))
+		return QList<Bitmap>();
+
+	Expected<QMap<quint32, QByteArray> > extensions = readExtensions();
+	if (!extensions.isOk())
+		return extensions;
+	QByteArray ext = extensions.get().value(EXT_BITMAPS);
+	if (ext.size() < EXT_BITMAPS_SIZE)
+		return QList<Bitmap>();
+	quint32 count = be32(ext, 0);
+	quint64 dirSize = be64(ext, 8);
+	quint64 dirOffset = be64(ext, 16);
+	if (count == 0)
+		return QList<Bitmap>();
+
+	QByteArray dir(dirSize, 0);
+	Expected<void> res = m_file->read(dirOffset, dir.data(), dir.size());
+	if (!res.isOk())
+		return res;
+
+	QList<Bitmap> bitmaps;
+	for (quint64 i = 0, pos = 0; i < count; ++i)
+	{
+		if (pos + BITMAP_ENTRY_SIZE > dirSize)
+			return Expected<QList<Bitmap> >::fromMessage("Corrupted qcow2 bitmap directory");
+		Bitmap b;
+		b.m_tableOffset = be64(dir, pos);
+		b.m_tableSize = be32(dir, pos + 8);
+		b.m_flags = be32(dir, pos + 12);
+		b.m_type = dir[(int)pos + 16];
+		b.m_granularityBits = dir[(int)pos + 17];
+		quint16 nameSize = be16(dir, pos + 18);
+		quint32 extraSize = be32(dir, pos + 20);
+		quint64 namePos = pos + BITMAP_ENTRY_SIZE + extraSize;
+		if (namePos + nameSize > dirSize)
+			return Expected<QList<Bitmap> >::fromMessage("Corrupted qcow2 bitmap directory");
+		b.m_name = QString::fromUtf8(dir.constData() + namePos, nameSize);
+		if (b.m_type == BITMAP_TYPE_DIRTY)
+			bitmaps << b;
+		pos = align8(namePos + nameSize);
+	}
+	return bitmaps;
+}
+
+Expected<extentList_type> Image::readDirty(const Bitmap &bitmap) const
+{
+	Expected<QVector<quint64> > table = readTable(bitmap.m_tableOffset, bitmap.m_tableSize);
+	if (!table.isOk())
+		return table;
+
+	quint64 granularity = 1ULL << bitmap.m_granularityBits;
+	// Guest bytes covered by one bitmap data cluster.
+	quint64 coverage = getClusterSize() * 8 * granularity;
+	quint64 size = m_header.m_size;
+	QByteArray buf(getClusterSize(), 0);
+	extentList_type dirty;
+
+	for (int i = 0; i < table.get().size(); ++i)
+	{
+		quint64 entry = table.get()[i];
+		quint64 start = i * coverage;
+		if (start >= size)
+			break;
+		quint64 offset = entry & BME_OFFSET_MASK;
+		if (offset == 0)
+		{
+			if (entry & BME_ALL_ONES)
+				appendExtent(dirty, start, qMin(coverage, size - start));
+			continue;
+		}
+
+		Expected<void> res = m_file->read(offset, buf.data(), buf.size());
+		if (!res.isOk())
+			return res;
+		for (quint64 bit = 0; bit < (quint64)buf.size() * 8; ++bit)
+		{
+			if (bit % 8 == 0 && buf[(int)(bit / 8)] == 0)
+			{
+				bit += 7;
+				continue;
+			}
+			quint64 pos = start + bit * granularity;
+			if (pos >= size)
+				break;
+			if (buf[(int)(bit / 8)] & (1 << (bit % 8)))
+				appendExtent(dirty, pos, qMin(granularity, size - pos));
+		}
+	}
+	return dirty;
+}
+
+Expected<QList<Snapshot> > Image::readSnapshots() const
+{
+	quint64 size;
+	return readSnapshotTable(size);
+}
+
+Expected<QList<Snapshot> > Image::readSnapshotTable(quint64 &size) const
+{
+	QList<Snapshot> snapshots;
+	quint64 pos = m_header.m_snapshotsOffset;
+	for (quint32 i = 0; i < m_header.m_nbSnapshots; ++i)
+	{
+		QByteArray entry(SNAPSHOT_ENTRY_SIZE, 0);
+		Expected<void> res = m_file->read(pos, entry.data(), entry.size());
+		if (!res.isOk())
+			return res;
+		quint16 idSize = be16(entry, 12), nameSize = be16(entry, 14);
+		quint32 extraSize = be32(entry, 36);
+		QByteArray strings(idSize + nameSize, 0);
+		res = m_file->read(pos + SNAPSHOT_ENTRY_SIZE + extraSize, strings.data(), strings.size());
+		if (!res.isOk())
+			return res;
+
+		Snapshot s;
+		s.m_l1TableOffset = be64(entry, 0);
+		s.m_l1Size = be32(entry, 8);
+		s.m_id = QString::fromUtf8(strings.constData(), idSize);
+		s.m_name = QString::fromUtf8(strings.constData() + idSize, nameSize);
+		snapshots << s;
+		pos += align8(SNAPSHOT_ENTRY_SIZE + extraSize + idSize + nameSize);
+	}
+	size = pos - m_header.m_snapshotsOffset;
+	return snapshots;
+}
+
+Expected<void> Image::deleteSnapshots()
+{
+	if (m_header.m_nbSnapshots == 0)
+		return Expected<void>();
+	if (m_header.m_incompatible & INCOMPAT_DIRTY)
+		return unsupported("refcounts are not up to date");
+	if (m_header.m_refcountOrder != REFCOUNT_ORDER)
+		return unsupported(QString("refcount order %1").arg(m_header.m_refcountOrder));
+
+	quint64 tableSize;
+	Expected<QList<Snapshot> > snapshots = readSnapshotTable(tableSize);
+	if (!snapshots.isOk())
+		return snapshots;
+	Refcounts refcounts(m_file, m_header);
+	Expected<void> res = refcounts.load();
+	if (!res.isOk())
+		return res;
+
+	// Snapshot L1 tables and references to L2 tables from all of them.
+	QMap<quint64, quint32> l2Refs;
+	Q_FOREACH(const Snapshot &s, snapshots.get())
+	{
+		if (s.m_l1Size == 0)
+			continue;
+		if (!(res = refcounts.decrement(s.m_l1TableOffset, s.m_l1Size * sizeof(quint64))).isOk())
+			return res;
+		Expected<QVector<quint64> > l1 = readTable(s.m_l1TableOffset, s.m_l1Size);
+		if (!l1.isOk())
+			return l1;
+		Q_FOREACH(quint64 entry, l1.get())
+		{
+			if (getL2Offset(entry) != 0)
+				++l2Refs[getL2Offset(entry)];
+		}
+	}
+
+	// Every L1 reference holds the L2 table and each cluster it points to.
+	// Shared tables are read once.
+	for (QMap<quint64, quint32>::const_iterator it = l2Refs.constBegin();
+		 it != l2Refs.constEnd(); ++it)
+	{
+		if (!(res = refcounts.decrement(it.key(), getClusterSize(), it.value())).isOk())
+			return res;
+		Expected<QVector<quint64> > l2 = readL2(it.key());
+		if (!l2.isOk())
+			return l2;
+		Q_FOREACH(quint64 entry, l2.get())
+		{
+			Cluster c = decode(entry);
+			// Zero clusters may be preallocated.
+			if (c.m_offset == 0)
+				continue;
+			res = refcounts.decrement(c.m_offset,
+					c.m_type == Cluster::COMPRESSED ? c.m_size : getClusterSize(),
+					it.value());
+			if (!res.isOk())
+				return res;
+		}
+	}
+	if (!(res = refcounts.decrement(m_header.m_snapshotsOffset, tableSize)).isOk())
+		return res;
+
+	// Nothing is written so far. Snapshots are dropped from the header first,
+	// so that a crash below leaks clusters instead of corrupting the image.
+	QByteArray fields(12, 0);
+	uchar *out = reinterpret_cast<uchar *>(fields.data());
+	qToBigEndian<quint32>(0, out);
+	qToBigEndian<quint64>(0, out + 4);
+	if (!(res = m_file->write(60, fields.constData(), fields.size())).isOk())
+		return res;
+	if (!(res = m_file->sync()).isOk())
+		return res;
+	m_header.m_nbSnapshots = 0;
+	m_header.m_snapshotsOffset = 0;
+
+	if (!(res = refcounts.flush()).isOk())
+		return res;
+	if (!(res = m_file->sync()).isOk())
+		return res;
+
+	// Clusters are not shared anymore, avoid needless copy on write.
+	Expected<QVector<quint64> > l1 = readL1();
+	if (!l1.isOk())
+		return l1;
+	bool l1Changed = false;
+	for (int i = 0; i < l1.get().size(); ++i)
+	{
+		quint64 l2Offset = getL2Offset(l1.get()[i]);
+		if (l2Offset == 0)
+			continue;
+		Expected<quint16> refcount = refcounts.get(l2Offset);
+		if (!refcount.isOk())
+			return refcount;
+		if (refcount.get() != 1)
+			continue;
+		if (!(l1.get()[i] & OFLAG_COPIED))
+		{
+			l1.get()[i] |= OFLAG_COPIED;
+			l1Changed = true;
+		}
+
+		Expected<QVector<quint64> > l2 = readL2(l2Offset);
+		if (!l2.isOk())
+			return l2;
+		bool l2Changed = false;
+		for (int j = 0; j < l2.get().size(); ++j)
+		{
+			Cluster c = decode(l2.get()[j]);
+			if (c.m_type == Cluster::COMPRESSED || c.m_offset == 0 ||
+				(l2.get()[j] & OFLAG_COPIED))
+				continue;
+			if (!(refcount = refcounts.get(c.m_offset)).isOk())
+				return refcount;
+			if (refcount.get() != 1)
+				continue;
+			l2.get()[j] |= OFLAG_COPIED;
+			l2Changed = true;
+		}
+		if (l2Changed && !(res = writeTable(l2Offset, l2.get())).isOk())
+			return res;
+	}
+	if (l1Changed && !(res = writeTable(m_header.m_l1TableOffset, l1.get())).isOk())
+		return res;
+	return m_file->sync();
+}
+
+Expected<CheckResult> Image::check(bool repair) const
+{
+	if (m_header.m_incompatible & (INCOMPAT_DATA_FILE | INCOMPAT_EXTL2))
+		return unsupported("external data file or extended L2 entries");
+	if (m_header.m_incompatible & INCOMPAT_DIRTY)
+		return unsupported("refcounts are not up to date");
+	if (m_header.m_refcountOrder != REFCOUNT_ORDER)
+		return unsupported(QString("refcount order %1").arg(m_header.m_refcountOrder));
+	Expected<QMap<quint32, QByteArray> > extensions = readExtensions();
+	if (!extensions.isOk())
+		return extensions;
+	// Unknown extensions may reference clusters, leaks are not certain then.
+	Q_FOREACH(quint32 type, extensions.get().keys())
+	{
+		if (repair && type != EXT_BACKING_FORMAT && type != EXT_FEATURE_TABLE &&
+			type != EXT_BITMAPS)
+			return unsupported(QString("header extension 0x%1").arg(type, 0, 16));
+	}
+
+	quint64 clusterSize = getClusterSize();
+	Expected<quint64> fileSize = m_file->getSize();
+	if (!fileSize.isOk())
+		return fileSize;
+	Usage usage(clusterSize, fileSize.get());
+	usage.add(0, clusterSize, 1, "Header");
+
+	Refcounts refcounts(m_file, m_header);
+	Expected<void> res = refcounts.load();
+	if (!res.isOk())
+		return res;
+	usage.add(m_header.m_refcountTableOffset,
+			m_header.m_refcountTableClusters * clusterSize, 1, "Refcount table");
+	Q_FOREACH(quint64 block, refcounts.getTable())
+	{
+		if (block != 0)
+			usage.add(block, clusterSize, 1, "Refcount block");
+	}
+
+	// Active and snapshot L1 tables.
+	quint64 snapshotsSize;
+	Expected<QList<Snapshot> > snapshots = readSnapshotTable(snapshotsSize);
+	if (!snapshots.isOk())
+		return snapshots;
+	usage.add(m_header.m_snapshotsOffset, snapshotsSize, 1, "Snapshot table");
+	QList<QPair<quint64, quint32> > l1Tables;
+	l1Tables << qMakePair(m_header.m_l1TableOffset, m_header.m_l1Size);
+	Q_FOREACH(const Snapshot &s, snapshots.get())
+		l1Tables << qMakePair(s.m_l1TableOffset, s.m_l1Size);
+	// Every L1 reference holds the L2 table and each cluster it points to.
+	QMap<quint64, quint32> l2Refs;
+	for (int i = 0; i < l1Tables.size(); ++i)
+	{
+		usage.add(l1Tables[i].first, l1Tables[i].second * sizeof(quint64), 1, "L1 table");
+		Expected<QVector<quint64> > l1 = readTable(l1Tables[i].first, l1Tables[i].second);
+		if (!l1.isOk())
+			return l1;
+		Q_FOREACH(quint64 entry, l1.get())
+		{
+			if (getL2Offset(entry) != 0)
+				++l2Refs[getL2Offset(entry)];
+		}
+	}
+
+	Expected<QList<Bitmap> > bitmaps = readBitmaps();
+	if (!bitmaps.isOk())
+		return bitmaps;
+	QByteArray ext = extensions.get().value(EXT_BITMAPS);
+	if (!bitmaps.get().isEmpty() && ext.size() >= EXT_BITMAPS_SIZE)
+		usage.add(be64(ext, 16), be64(ext, 8), 1, "Bitmap directory");
+	Q_FOREACH(const Bitmap &bitmap, bitmaps.get())
+	{
+		usage.add(bitmap.m_tableOffset, bitmap.m_tableSize * sizeof(quint64), 1, "Bitmap table");
+		Expected<QVector<quint64> > table = readTable(bitmap.m_tableOffset, bitmap.m_tableSize);
+		if (!table.isOk())
+			return table;
+		Q_FOREACH(quint64 entry, table.get())
+		{
+			if (entry & BME_OFFSET_MASK)
+				usage.add(entry & BME_OFFSET_MASK, clusterSize, 1, "Bitmap data");
+		}
+	}
+
+	// L2 tables are read on the thread pool.
+	QList<quint64> l2Tables = l2Refs.keys();
+	for (int i = 0; i < l2Tables.size(); i += CHECK_BATCH)
+	{
+		QList<quint64> batch = l2Tables.mid(i, CHECK_BATCH);
+		QList<int> indexes;
+		for (int j = 0; j < batch.size(); ++j)
+			indexes << j;
+		// Pre-sized, jobs write disjoint slots.
+		QVector<L2Job::slot_type> ranges(batch.size());
+		QtConcurrent::blockingMap(indexes, L2Job(*this, batch, ranges.data()));
+		for (int j = 0; j < batch.size(); ++j)
+		{
+			if (!ranges[j]->isOk())
+				return ranges[j].get();
+			quint32 count = l2Refs.value(batch[j]);
+			usage.add(batch[j], clusterSize, count, "L2 table");
+			Q_FOREACH(const hostRange_type &range, ranges[j]->get())
+				usage.add(range.first, range.second, count, "Data cluster");
+		}
+	}
+
+	Expected<QVector<quint16> > stored = refcounts.readAll(usage.m_refs.size());
+	if (!stored.isOk())
+		return stored;
+	CheckResult result;
+	const quint16 *refcount = stored.get().constData();
+	const quint32 *refs = usage.m_refs.constData();
+	int total = usage.m_refs.size();
+	for (int block = 0; block < total; block += CHECK_BLOCK)
+	{
+		// Branch-free, so the compiler can vectorize it. Most blocks match.
+		int end = qMin<int>(block + CHECK_BLOCK, total);
+		quint32 diff = 0, used = 0;
+		for (int i = block; i < end; ++i)
+		{
+			diff |= refcount[i] ^ refs[i];
+			used += refs[i] != 0;
+		}
+		result.m_clusters += used;
+		if (diff == 0)
+			continue;
+		for (int i = block; i < end; ++i)
+		{
+			if (refcount[i] == refs[i])
+				continue;
+			if (refcount[i] < refs[i])
+			{
+				usage.report(QString("Cluster at offset %1: refcount %2, references %3")
+						.arg((quint64)i * clusterSize).arg(refcount[i]).arg(refs[i]));
+				continue;
+			}
+			++result.m_leaks;
+			if (repair && !(res = refcounts.set((quint64)i * clusterSize, refs[i])).isOk())
+				return res;
+		}
+	}
+	result.m_corruptions = usage.m_corruptions;
+	result.m_messages = usage.m_messages;
+
+	if (repair && result.m_leaks > 0)
+	{
+		if (!(res = refcounts.flush()).isOk())
+			return res;
+		if (!(res = m_file->sync()).isOk())
+			return res;
+		result.m_repaired = result.m_leaks;
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Allocation
+
+Expected<Allocation> Allocation::build(const QList<Image> &layers)
+{
+	QList<int> indexes;
+	for (int i = 0; i < layers.size(); ++i)
+		indexes << i;
+	// Pre-sized, jobs write disjoint slots.
+	QVector<AllocationJob::slot_type> results(layers.size());
+	QtConcurrent::blockingMap(indexes, AllocationJob(layers, results.data()));
+	Allocation a;
+	Q_FOREACH(const AllocationJob::slot_type &extents, results)
+	{
+		if (!extents->isOk())
+			return extents.get();
+		a.m_layers << extents->get();
+	}
+	return a;
+}
+
+bool Allocation::isAllocated(int layer, quint64 offset) const
+{
+	const extentList_type &extents = m_layers[layer];
+	int i = findExtent(extents, offset);
+	return i < extents.size() && extents[i].m_offset <= offset;
+}
+
+int Allocation::getOwner(quint64 offset) const
+{
+	for (int i = m_layers.size() - 1; i >= 0; --i)
+	{
+		if (isAllocated(i, offset))
+			return i;
+	}
+	return -1;
+}
+
+extentList_type Allocation::unite(int first, int last) const
+{
+	extentList_type all;
+	for (int i = first; i <= last; ++i)
+		all << m_layers[i];
+	std::sort(all.begin(), all.end(), isExtentLess);
+
+	extentList_type merged;
+	Q_FOREACH(const Extent &e, all)
+	{
+		if (!merged.isEmpty() && merged.last().getEnd() >= e.m_offset)
+			merged.last().m_size = qMax(merged.last().getEnd(), e.getEnd()) - merged.last().m_offset;
+		else
+			merged << e;
+	}
+	return merged;
+}
+
+quint64 Allocation::getSize(const extentList_type &extents)
+{
+	quint64 size = 0;
+	Q_FOREACH(const Extent &e, extents)
+		size += e.m_size;
+	return size;
+}
+
+////////////////////////////////////////////////////////////
+// Chain
+
+Expected<Chain> Chain::open(const QStringList &paths)
+{
+	if (paths.isEmpty())
+		return Expected<Chain>::fromMessage("Empty backing chain");
+	Chain chain;
+	Q_FOREACH(const QString &path, paths)
+	{
+		Expected<Image> image = Image::open(path);
+		if (!image.isOk())
+			return image;
+		Expected<QVector<quint64> > l1 = image.get().readL1();
+		if (!l1.isOk())
+			return l1;
+		chain.m_layers << image.get();
+		chain.m_l1 << l1.get();
+	}
+	return chain;
+}
+
+Expected<void> Chain::read(quint64 offset, char *buf, quint64 size) const
+{
+	if (offset + size > getSize())
+		return Expected<void>::fromMessage(QString("Read beyond the end of disk at %1").arg(offset));
+	while (size > 0)
+	{
+		Expected<quint64> done = readCluster(offset, buf, size);
+		if (!done.isOk())
+			return done;
+		offset += done.get();
+		buf += done.get();
+		size -= done.get();
+	}
+	return Expected<void>();
+}
+
+Expected<quint64> Chain::readCluster(quint64 offset, char *buf, quint64 size) const
+{
+	for (int k = m_layers.size() - 1; k >= 0; --k)
+	{
+		const Image &layer = m_layers[k];
+		quint64 clusterSize = layer.getClusterSize();
+		quint64 inCluster = offset % clusterSize;
+		quint64 count = qMin(size, clusterSize - inCluster);
+		// Smaller backing file reads as zeroes beyond its end.
+		if (offset >= layer.getHeader().m_size)
+			break;
+
+		quint64 cluster = offset / clusterSize;
+		quint64 index = cluster / layer.getHeader().getL2Entries();
+		if (index >= (quint64)m_l1[k].size())
+			continue;
+		quint64 l2Offset = Image::getL2Offset(m_l1[k][index]);
+		if (l2Offset == 0)
+			continue;
+		Expected<QVector<quint64> > l2 = layer.readL2(l2Offset);
+		if (!l2.isOk())
+			return l2;
+		Cluster c = layer.decode(l2.get()[cluster % layer.getHeader().getL2Entries()]);
+		if (c.m_type == Cluster::UNALLOCATED)
+			continue;
+
+		Expected<void> res;
+		if (c.m_type == Cluster::ZERO)
+			memset(buf, 0, count);
+		else if (c.m_type == Cluster::NORMAL)
+			res = layer.m_file->read(c.m_offset + inCluster, buf, count);
+		else
+		{
+			QByteArray data(clusterSize, 0);
+			if ((res = layer.readCluster(c, data.data())).isOk())
+				memcpy(buf, data.constData() + inCluster, count);
+		}
+		if (!res.isOk())
+			return res;
+		return count;
+	}
+
+	// Not allocated anywhere, stop at the cluster end of the top layer.
+	quint64 clusterSize = m_layers.last().getClusterSize();
+	quint64 count = qMin(size, clusterSize - offset % clusterSize);
+	memset(buf, 0, count);
+	return count;
+}
+
+////////////////////////////////////////////////////////////
+// Fragmentation
+
+Expected<Fragmentation> Fragmentation::measure(const Image &image)
+{
+	Fragmentation f;
+	f.m_pairs = 0;
+	f.m_breaks = 0;
+	Expected<quint64> size = image.m_file->getSize();
+	if (!size.isOk())
+		return size;
+	f.m_fileSize = size.get();
+
+	Expected<QVector<quint64> > l1 = image.readL1();
+	if (!l1.isOk())
+		return l1;
+	// Host offset of the previous guest cluster, 0 if it has no data.
+	quint64 prev = 0;
+	for (int i = 0; i < l1.get().size(); ++i)
+	{
+		if (i % L2_PREFETCH == 0)
+			image.prefetchL2(l1.get(), i);
+		quint64 l2Offset = Image::getL2Offset(l1.get()[i]);
+		if (l2Offset == 0)
+		{
+			prev = 0;
+			continue;
+		}
+		Expected<QVector<quint64> > l2 = image.readL2(l2Offset);
+		if (!l2.isOk())
+			return l2;
+		Q_FOREACH(quint64 entry, l2.get())
+		{
+			Cluster c = image.decode(entry);
+			if (c.m_type != Cluster::NORMAL)
+			{
+				prev = 0;
+				continue;
+			}
+			if (prev != 0)
+			{
+				++f.m_pairs;
+				if (c.m_offset != prev + image.getClusterSize())
+					++f.m_breaks;
+			}
+			prev = c.m_offset;
+		}
+	}
+	return f;
+}
+
+////////////////////////////////////////////////////////////
+// Writer
+
+Writer::Writer(const boost::shared_ptr<File> &file, const Params &params):
+	m_file(file), m_params(params), m_pos(getClusterSize())
+{
+	quint64 l2Coverage = getClusterSize() * (getClusterSize() / sizeof(quint64));
+	m_l1 = QVector<quint64>((m_params.m_size + l2Coverage - 1) / l2Coverage, 0);
+	// Header cluster.
+	m_refcounts << 1;
+}
+
+Expected<boost::shared_ptr<Writer> > Writer::create(const QString &path, const Params &params)
+{
+	if (params.m_clusterBits < MIN_CLUSTER_BITS || params.m_clusterBits > MAX_CLUSTER_BITS)
+	{
+		return Expected<boost::shared_ptr<Writer> >::fromMessage(
+				QString("Invalid cluster bits %1").arg(params.m_clusterBits));
+	}
+	Expected<boost::shared_ptr<File> > file = File::create(path);
+	if (!file.isOk())
+		return file;
+	return boost::shared_ptr<Writer>(new Writer(file.get(), params));
+}
+
+void Writer::setEntry(quint64 cluster, quint64 entry)
+{
+	quint64 entries = getClusterSize() / sizeof(quint64);
+	QVector<quint64> &l2 = m_l2[cluster / entries];
+	if (l2.isEmpty())
+		l2 = QVector<quint64>(entries, 0);
+	l2[cluster % entries] = entry;
+}
+
+void Writer::ref(quint64 offset, quint64 size)
+{
+	quint64 first = offset / getClusterSize();
+	quint64 last = (offset + size - 1) / getClusterSize();
+	if ((quint64)m_refcounts.size() <= last)
+		m_refcounts.resize(last + 1);
+	for (quint64 i = first; i <= last; ++i)
+		++m_refcounts[i];
+}
+
+Expected<void> Writer::append(const char *data, quint64 size)
+{
+	m_buffer.append(data, size);
+	m_pos += size;
+	if ((quint64)m_buffer.size() < WRITE_BUFFER_SIZE)
+		return Expected<void>();
+	return flush();
+}
+
+Expected<void> Writer::flush()
+{
+	if (m_buffer.isEmpty())
+		return Expected<void>();
+	Expected<void> res = m_file->write(m_pos - m_buffer.size(), m_buffer.constData(), m_buffer.size());
+	m_buffer.clear();
+	return res;
+}
+
+Expected<void> Writer::writeData(quint64 cluster, const char *data, quint64 count)
+{
+	// Normal clusters are aligned, compressed ones may leave a gap.
+	Expected<void> res = align();
+	if (!res.isOk())
+		return res;
+
+	quint64 clusterSize = getClusterSize();
+	for (quint64 i = 0; i < count; ++i)
+	{
+		setEntry(cluster + i, (m_pos + i * clusterSize) | OFLAG_COPIED);
+		ref(m_pos + i * clusterSize, clusterSize);
+	}
+	if (count * clusterSize < WRITE_BUFFER_SIZE)
+		return append(data, count * clusterSize);
+
+	res = flush();
+	if (!res.isOk())
+		return res;
+	res = m_file->write(m_pos, data, count * clusterSize);
+	m_pos += count * clusterSize;
+	return res;
+}
+
+Expected<void> Writer::writeCompressed(quint64 cluster, const char *data, quint64 size)
+{
+	quint32 shift = 62 - (m_params.m_clusterBits - 8);
+	// Number of additional sectors beyond the one containing the offset.
+	quint64 sectors = ((m_pos + size - 1) / COMPRESSED_SECTOR_SIZE) -
+		(m_pos / COMPRESSED_SECTOR_SIZE);
+	setEntry(cluster, OFLAG_COMPRESSED | (sectors << shift) | m_pos);
+	ref(m_pos, size);
+	return append(data, size);
+}
+
+void Writer::writeZero(quint64 cluster)
+{
+	setEntry(cluster, OFLAG_ZERO);
+}
+
+Expected<void> Writer::copy(const Image &image, const Abort::token_type &token)
+{
+	return copy(QList<Image>() << image, image.getHeader().m_size, token);
+}
+
+Expected<void> Writer::compress(const Image &image, const Abort::token_type &token)
+{
+	const Header &header = image.getHeader();
+	if (header.m_clusterBits != m_params.m_clusterBits)
+		return Expected<void>::fromMessage("Cluster size mismatch");
+
+	Expected<QVector<quint64> > l1 = image.readL1();
+	if (!l1.isOk())
+		return l1;
+	quint64 clusterSize = getClusterSize();
+	int batch = qMax<quint64>(COMPRESS_BATCH_SIZE / clusterSize, 1);
+	QVector<Chunk> chunks;
+	for (int i = 0; i < l1.get().size(); ++i)
+	{
+		if (i % L2_PREFETCH == 0)
+			image.prefetchL2(l1.get(), i);
+		quint64 l2Offset = Image::getL2Offset(l1.get()[i]);
+		if (l2Offset == 0)
+			continue;
+		Expected<QVector<quint64> > l2 = image.readL2(l2Offset);
+		if (!l2.isOk())
+			return l2;
+		quint64 base = (quint64)i * header.getL2Entries();
+
+		for (int j = 0; j < l2.get().size(); ++j)
+		{
+			Cluster c = image.decode(l2.get()[j]);
+			if (c.m_type == Cluster::ZERO)
+				writeZero(base + j);
+			if (!c.hasData())
+				continue;
+
+			Chunk chunk;
+			chunk.m_cluster = base + j;
+			chunk.m_data = QByteArray(clusterSize, 0);
+			Expected<void> res = image.readCluster(c, chunk.m_data.data());
+			if (!res.isOk())
+				return res;
+			chunks << chunk;
+			if (chunks.size() < batch)
+				continue;
+
+			if (isCancelled(token))
+				return cancelled();
+			if (!(res = writeChunks(*this, chunks, m_params.m_compression)).isOk())
+				return res;
+		}
+	}
+	return writeChunks(*this, chunks, m_params.m_compression);
+}
+
+Expected<void> Writer::copy(const QList<Image> &layers, quint64 size,
+		const Abort::token_type &token)
+{
+	quint64 clusterSize = getClusterSize();
+	// O_DIRECT needs aligned offsets and sizes.
+	bool direct = clusterSize >= AsyncIO::DIRECT_ALIGNMENT;
+	QList<QVector<quint64> > l1s;
+	QList<boost::shared_ptr<File> > files;
+	Q_FOREACH(const Image &layer, layers)
+	{
+		if (layer.getHeader().m_clusterBits != m_params.m_clusterBits)
+			return Expected<void>::fromMessage("Cluster size mismatch", ERR_UNSUPPORTED_IMAGE);
+		Expected<QVector<quint64> > l1 = layer.readL1();
+		if (!l1.isOk())
+			return l1;
+		l1s << l1.get();
+		Expected<boost::shared_ptr<File> > file = File::open(layer.getPath(), false, direct);
+		if (!file.isOk())
+			return file;
+		files << file.get();
+	}
+
+	quint64 l2Entries = clusterSize / sizeof(quint64);
+	quint64 clusters = (size + clusterSize - 1) / clusterSize;
+	quint64 maxRun = qMax<quint64>(COPY_BATCH_SIZE / clusterSize, 1);
+	quint64 batch = qMax<quint64>(CHAIN_BATCH_SIZE / clusterSize, 1);
+	// Last run may grow past the batch.
+	Expected<boost::shared_ptr<AsyncIO::Buffer> > buffer =
+		AsyncIO::Buffer::create((batch + maxRun) * clusterSize);
+	if (!buffer.isOk())
+		return buffer;
+	Expected<boost::shared_ptr<AsyncIO::Queue> > queue = AsyncIO::Queue::create(COPY_QUEUE_DEPTH);
+	if (!queue.isOk())
+		return queue;
+	Expected<void> res = queue.get()->registerBuffer(buffer.get());
+	if (!res.isOk())
+		return res;
+
+	quint64 pending = 0;
+	QList<Run> runs;
+	for (quint64 i = 0; i * l2Entries < clusters; ++i)
+	{
+		if (isCancelled(token))
+			return cancelled();
+
+		// Topmost allocated entry for each cluster of the table.
+		QVector<Cluster> entries(l2Entries);
+		QVector<int> owners(l2Entries, -1);
+		for (int k = layers.size() - 1; k >= 0; --k)
+		{
+			if (i >= (quint64)l1s[k].size())
+				continue;
+			if (i % L2_PREFETCH == 0)
+				layers[k].prefetchL2(l1s[k], i);
+			quint64 l2Offset = Image::getL2Offset(l1s[k][i]);
+			if (l2Offset == 0)
+				continue;
+			Expected<QVector<quint64> > l2 = layers[k].readL2(l2Offset);
+			if (!l2.isOk())
+				return l2;
+			for (quint64 j = 0; j < l2Entries; ++j)
+			{
+				if (owners[j] >= 0)
+					continue;
+				Cluster c = layers[k].decode(l2.get()[j]);
+				if (c.m_type == Cluster::UNALLOCATED)
+					continue;
+				entries[j] = c;
+				owners[j] = k;
+			}
+		}
+
+		quint64 base = i * l2Entries;
+		quint64 end = qMin(l2Entries, clusters - base);
+		for (quint64 j = 0; j < end; ++j)
+		{
+			const Cluster &c = entries[j];
+			// Zero clusters hide backing file data.
+			if (c.m_type == Cluster::ZERO && !m_params.m_backingFile.isEmpty())
+				writeZero(base + j);
+			if (!c.hasData())
+				continue;
+			const Image *image = &layers[owners[j]];
+			if (!runs.isEmpty())
+			{
+				Run &last = runs.last();
+				if (c.m_type == Cluster::NORMAL && last.m_host.m_type == Cluster::NORMAL &&
+					last.m_image == image && last.m_count < maxRun &&
+					last.m_cluster + last.m_count == base + j &&
+					last.m_host.m_offset + last.m_count * clusterSize == c.m_offset)
+				{
+					++last.m_count;
+					++pending;
+					continue;
+				}
+			}
+
+			if (pending >= batch)
+			{
+				if (!(res = writeRuns(*this, runs, *queue.get(), *buffer.get())).isOk())
+					return res;
+				pending = 0;
+			}
+			Run run;
+			run.m_cluster = base + j;
+			run.m_count = 1;
+			run.m_host = c;
+			run.m_image = image;
+			run.m_file = files[owners[j]];
+			run.m_raw = (c.m_type == Cluster::COMPRESSED &&
+					image->getHeader().m_compressionType == m_params.m_compression);
+			run.m_data = NULL;
+			runs << run;
+			++pending;
+		}
+	}
+	return writeRuns(*this, runs, *queue.get(), *buffer.get());
+}
+
+Expected<void> Writer::align()
+{
+	if (m_pos % getClusterSize() == 0)
+		return Expected<void>();
+	QByteArray pad(getClusterSize() - m_pos % getClusterSize(), 0);
+	return append(pad.constData(), pad.size());
+}
+
+Expected<quint64> Writer::writeTable(const QVector<quint64> &table)
+{
+	Expected<void> res = align();
+	if (!res.isOk())
+		return res;
+
+	quint64 clusterSize = getClusterSize();
+	quint64 size = (table.size() * sizeof(quint64) + clusterSize - 1) / clusterSize * clusterSize;
+	QByteArray data(size, 0);
+	uchar *out = reinterpret_cast<uchar *>(data.data());
+	for (int i = 0; i < table.size(); ++i)
+		qToBigEndian<quint64>(table[i], out + i * sizeof(quint64));
+
+	quint64 offset = m_pos;
+	ref(offset, size);
+	res = append(data.constData(), data.size());
+	if (!res.isOk())
+		return res;
+	return offset;
+}
+
+Expected<void> Writer::finish()
+{
+	for (QMap<quint64, QVector<quint64> >::const_iterator it = m_l2.constBegin();
+		 it != m_l2.constEnd(); ++it)
+	{
+		Expected<quint64> offset = writeTable(it.value());
+		if (!offset.isOk())
+			return offset;
+		m_l1[it.key()] = offset.get() | OFLAG_COPIED;
+	}
+	Expected<quint64> l1Offset = writeTable(m_l1);
+	if (!l1Offset.isOk())
+		return l1Offset;
+
+	// Refcount table and blocks cover themselves too.
+	quint64 clusterSize = getClusterSize();
+	quint64 perBlock = clusterSize / sizeof(quint16);
+	quint64 blocks = 0, tableClusters = 0;
+	for (;;)
+	{
+		quint64 total = m_pos / clusterSize + tableClusters + blocks;
+		quint64 b = (total + perBlock - 1) / perBlock;
+		quint64 t = (b * sizeof(quint64) + clusterSize - 1) / clusterSize;
+		if (b == blocks && t == tableClusters)
+			break;
+		blocks = b;
+		tableClusters = t;
+	}
+
+	quint64 tableOffset = m_pos;
+	quint64 blocksOffset = tableOffset + tableClusters * clusterSize;
+	ref(blocksOffset, blocks * clusterSize);
+	QVector<quint64> table(blocks, 0);
+	for (quint64 i = 0; i < blocks; ++i)
+		table[i] = blocksOffset + i * clusterSize;
+	Expected<quint64> written = writeTable(table);
+	if (!written.isOk())
+		return written;
+
+	m_refcounts.resize(blocks * perBlock);
+	QByteArray block(clusterSize, 0);
+	uchar *out = reinterpret_cast<uchar *>(block.data());
+	for (quint64 i = 0; i < blocks; ++i)
+	{
+		for (quint64 j = 0; j < perBlock; ++j)
+			qToBigEndian<quint16>(m_refcounts[i * perBlock + j], out + j * sizeof(quint16));
+		Expected<void> res = append(block.constData(), block.size());
+		if (!res.isOk())
+			return res;
+	}
+
+	Expected<void> res = flush();
+	if (!res.isOk())
+		return res;
+	// Header goes last, the image is invalid until it is written.
+	if (!(res = writeHeader(l1Offset.get(), tableOffset, tableClusters)).isOk())
+		return res;
+	return m_file->sync();
+}
+
+Expected<void> Writer::writeHeader(quint64 l1Offset, quint64 refcountOffset,
+		quint32 refcountClusters)
+{
+	QByteArray header(getClusterSize(), 0);
+	uchar *out = reinterpret_cast<uchar *>(header.data());
+	QByteArray format = m_params.m_backingFormat.toUtf8();
+	QByteArray backing = m_params.m_backingFile.toUtf8();
+
+	// Extensions follow the header, backing file name follows extensions.
+	quint32 headerLength = HEADER_V3_LENGTH;
+	if (m_params.m_compression != COMPRESSION_ZLIB)
+	{
+		headerLength = HEADER_V3_COMPRESSION_LENGTH;
+		qToBigEndian<quint64>(INCOMPAT_COMPRESSION, out + 72);
+		out[HEADER_V3_LENGTH] = m_params.m_compression;
+	}
+	quint64 pos = headerLength;
+	if (!format.isEmpty())
+	{
+		qToBigEndian<quint32>(EXT_BACKING_FORMAT, out + pos);
+		qToBigEndian<quint32>(format.size(), out + pos + 4);
+		if (pos + EXT_HEADER_SIZE + align8(format.size()) > (quint64)header.size())
+			return Expected<void>::fromMessage("Backing file format is too long");
+		memcpy(out + pos + EXT_HEADER_SIZE, format.constData(), format.size());
+		pos += EXT_HEADER_SIZE + align8(format.size());
+	}
+	// End of extensions.
+	pos += EXT_HEADER_SIZE;
+	if (pos + backing.size() > (quint64)header.size())
+		return Expected<void>::fromMessage("Backing file name is too long");
+	if (!backing.isEmpty())
+	{
+		memcpy(out + pos, backing.constData(), backing.size());
+		qToBigEndian<quint64>(pos, out + 8);
+		qToBigEndian<quint32>(backing.size(), out + 16);
+	}
+
+	qToBigEndian<quint32>(QCOW2_MAGIC, out);
+	qToBigEndian<quint32>(3, out + 4);
+	qToBigEndian<quint32>(m_params.m_clusterBits, out + 20);
+	qToBigEndian<quint64>(m_params.m_size, out + 24);
+	qToBigEndian<quint32>(m_l1.size(), out + 36);
+	qToBigEndian<quint64>(l1Offset, out + 40);
+	qToBigEndian<quint64>(refcountOffset, out + 48);
+	qToBigEndian<quint32>(refcountClusters, out + 56);
+	qToBigEndian<quint32>(REFCOUNT_ORDER, out + 96);
+	qToBigEndian<quint32>(headerLength, out + 100);
+	return m_file->write(0, header.constData(), pos + backing.size());
+}
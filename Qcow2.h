@@ -0,0 +1,512 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Qcow2.h
+///
+/// Native read access to qcow2 image metadata and clusters.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#ifndef QCOW2_H
+#define QCOW2_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QVector>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+
+#include <boost/shared_ptr.hpp>
+
+#include "Expected.h"
+#include "Abort.h"
+
+namespace Qcow2
+{
+
+////////////////////////////////////////////////////////////
+// File
+
+struct File
+{
+	/* O_DIRECT is silently dropped if not supported. */
+	static Expected<boost::shared_ptr<File> > open(const QString &path, bool writable = false,
+			bool direct = false);
+	/* Creates new file or truncates existing one. */
+	static Expected<boost::shared_ptr<File> > create(const QString &path);
+
+	~File();
+
+	/* Reads exactly 'size' bytes, fails on short read. */
+	Expected<void> read(quint64 offset, char *buf, quint64 size) const;
+	/* Same, but through the file mapping created on first use. Pages read
+	 * are released from the mapping. Falls back to read() beyond the
+	 * mapping or if mmap fails. */
+	Expected<void> readMapped(quint64 offset, char *buf, quint64 size) const;
+	/* Asks the kernel to read the range ahead, mapping is used if present. */
+	void prefetch(quint64 offset, quint64 size) const;
+	Expected<void> write(quint64 offset, const char *buf, quint64 size) const;
+	Expected<quint64> getSize() const;
+	Expected<void> sync() const;
+
+	int getFd() const
+	{
+		return m_fd;
+	}
+
+	/* Unique within the process, unlike fd. */
+	quint64 getId() const
+	{
+		return m_id;
+	}
+
+	const QString& getPath() const
+	{
+		return m_path;
+	}
+
+private:
+	File(const QString &path, int fd);
+
+	const char* map() const;
+
+	QString m_path;
+	int m_fd;
+	quint64 m_id;
+	mutable QMutex m_mapMutex;
+	mutable const char *m_map;
+	mutable quint64 m_mapSize;
+	mutable bool m_mapFailed;
+};
+
+enum CompressionType
+{
+	COMPRESSION_ZLIB = 0,
+	COMPRESSION_ZSTD = 1
+};
+
+/* zstd is supported if built with it. */
+bool isCompressionSupported(quint32 type);
+
+////////////////////////////////////////////////////////////
+// Header
+
+struct Header
+{
+	static Expected<Header> parse(const QByteArray &data);
+
+	quint64 getClusterSize() const
+	{
+		return 1ULL << m_clusterBits;
+	}
+
+	/* Number of 8-byte entries in L2 table. */
+	quint64 getL2Entries() const
+	{
+		return getClusterSize() / sizeof(quint64);
+	}
+
+	quint64 getClusterCount() const
+	{
+		return (m_size + getClusterSize() - 1) / getClusterSize();
+	}
+
+	bool hasBacking() const
+	{
+		return m_backingFileOffset != 0;
+	}
+
+	quint32 m_version;
+	quint64 m_backingFileOffset;
+	quint32 m_backingFileSize;
+	quint32 m_clusterBits;
+	quint64 m_size;
+	quint32 m_cryptMethod;
+	quint32 m_l1Size;
+	quint64 m_l1TableOffset;
+	quint64 m_refcountTableOffset;
+	quint32 m_refcountTableClusters;
+	quint32 m_nbSnapshots;
+	quint64 m_snapshotsOffset;
+	// Version 3 only, zeroes for version 2.
+	quint64 m_incompatible;
+	quint64 m_compatible;
+	quint64 m_autoclear;
+	quint32 m_refcountOrder;
+	quint32 m_headerLength;
+	quint8 m_compressionType;
+};
+
+////////////////////////////////////////////////////////////
+// Cluster
+
+/* Decoded L2 entry. */
+struct Cluster
+{
+	enum Type
+	{
+		UNALLOCATED,
+		ZERO,
+		NORMAL,
+		COMPRESSED
+	};
+
+	Cluster():
+		m_type(UNALLOCATED), m_offset(0), m_size(0)
+	{
+	}
+
+	Cluster(Type type, quint64 offset, quint64 size):
+		m_type(type), m_offset(offset), m_size(size)
+	{
+	}
+
+	/* Data is stored in this image (zero clusters are not). */
+	bool hasData() const
+	{
+		return m_type == NORMAL || m_type == COMPRESSED;
+	}
+
+	Type m_type;
+	// Host offset.
+	quint64 m_offset;
+	// Size of data on host (cluster size or compressed size).
+	quint64 m_size;
+};
+
+////////////////////////////////////////////////////////////
+// Extent
+
+/* Byte range of guest data. */
+struct Extent
+{
+	Extent(quint64 offset, quint64 size):
+		m_offset(offset), m_size(size)
+	{
+	}
+
+	quint64 getEnd() const
+	{
+		return m_offset + m_size;
+	}
+
+	/* Part of this extent within [offset, offset + size), may be empty. */
+	Extent intersect(quint64 offset, quint64 size) const;
+
+	quint64 m_offset;
+	quint64 m_size;
+};
+
+typedef QList<Extent> extentList_type;
+
+////////////////////////////////////////////////////////////
+// Bitmap
+
+/* Persistent dirty bitmap directory entry. */
+struct Bitmap
+{
+	/* Bitmap was not stored properly, content is inconsistent. */
+	bool isInUse() const;
+	/* Bitmap tracks writes. */
+	bool isEnabled() const;
+
+	QString m_name;
+	quint64 m_tableOffset;
+	quint32 m_tableSize;
+	quint32 m_flags;
+	quint8 m_type;
+	quint8 m_granularityBits;
+};
+
+////////////////////////////////////////////////////////////
+// Snapshot
+
+/* Internal snapshot table entry. */
+struct Snapshot
+{
+	QString m_id;
+	QString m_name;
+	quint64 m_l1TableOffset;
+	quint32 m_l1Size;
+};
+
+////////////////////////////////////////////////////////////
+// CheckResult
+
+struct CheckResult
+{
+	CheckResult():
+		m_clusters(0), m_leaks(0), m_corruptions(0), m_repaired(0)
+	{
+	}
+
+	// Clusters referenced by metadata.
+	quint64 m_clusters;
+	// Clusters with refcount greater than the number of references.
+	quint64 m_leaks;
+	// Clusters with refcount less than the number of references
+	// and references beyond the end of file.
+	quint64 m_corruptions;
+	quint64 m_repaired;
+	// First problems found.
+	QStringList m_messages;
+};
+
+////////////////////////////////////////////////////////////
+// Image
+
+struct Image
+{
+	static Expected<Image> open(const QString &path, bool writable = false);
+	/* L2 tables of all images are kept in one LRU cache of this size,
+	 * 64M by default. */
+	static void setL2CacheLimit(quint64 bytes);
+
+	const Header& getHeader() const
+	{
+		return m_header;
+	}
+
+	const QString& getPath() const
+	{
+		return m_file->getPath();
+	}
+
+	quint64 getClusterSize() const
+	{
+		return m_header.getClusterSize();
+	}
+
+	Expected<QVector<quint64> > readL1() const;
+	/* Cached, thread-safe. */
+	Expected<QVector<quint64> > readL2(quint64 offset) const;
+	/* Reads L2 tables of 'l1' entries starting from 'index' ahead. */
+	void prefetchL2(const QVector<quint64> &l1, int index) const;
+
+	/* Offset of L2 table referenced by L1 entry, 0 if none. */
+	static quint64 getL2Offset(quint64 l1Entry);
+	Cluster decode(quint64 l2Entry) const;
+
+	/* Reads guest data of one cluster. 'buf' must hold cluster size. */
+	Expected<void> readCluster(const Cluster &cluster, char *buf) const;
+	/* Reads compressed cluster data as stored on host. */
+	Expected<QByteArray> readCompressed(const Cluster &cluster) const;
+
+	/* Backing file name as written in the header, may be relative. */
+	Expected<QString> readBackingFile() const;
+	Expected<QString> readBackingFormat() const;
+
+	/* Consistent persistent bitmaps, empty list if there are none. */
+	Expected<QList<Bitmap> > readBitmaps() const;
+	/* Guest ranges marked in the bitmap, sorted and merged. */
+	Expected<extentList_type> readDirty(const Bitmap &bitmap) const;
+
+	Expected<QList<Snapshot> > readSnapshots() const;
+	/* Compares refcounts with references found in metadata, L2 tables are
+	 * processed on the thread pool. Leaks are repaired if 'repair' is set,
+	 * image must be opened writable then. */
+	Expected<CheckResult> check(bool repair) const;
+	/* Deletes all internal snapshots: refcounts are decremented in one pass
+	 * and written once. Image must be opened writable. */
+	Expected<void> deleteSnapshots();
+
+private:
+	friend struct Fragmentation;
+	friend struct Writer;
+	friend struct Chain;
+
+	Image(const boost::shared_ptr<File> &file, const Header &header):
+		m_file(file), m_header(header)
+	{
+	}
+
+	Expected<QVector<quint64> > readTable(quint64 offset, quint64 entries) const;
+	Expected<void> writeTable(quint64 offset, const QVector<quint64> &table) const;
+	/* Also returns size of the snapshot table in bytes. */
+	Expected<QList<Snapshot> > readSnapshotTable(quint64 &size) const;
+	Expected<QByteArray> readHeaderCluster() const;
+	Expected<QMap<quint32, QByteArray> > readExtensions() const;
+	Expected<void> decompress(const QByteArray &src, char *buf) const;
+
+	boost::shared_ptr<File> m_file;
+	Header m_header;
+};
+
+////////////////////////////////////////////////////////////
+// Allocation
+
+/* Guest ranges allocated (data or zero clusters) in each layer of
+ * a backing chain. Ranges are kept merged, so memory depends on the
+ * number of allocated extents rather than on the virtual size. */
+struct Allocation
+{
+	/* 'layers' go from base to top, they are scanned in parallel. */
+	static Expected<Allocation> build(const QList<Image> &layers);
+
+	int getLayerCount() const
+	{
+		return m_layers.size();
+	}
+
+	const extentList_type& getLayer(int layer) const
+	{
+		return m_layers[layer];
+	}
+
+	bool isAllocated(int layer, quint64 offset) const;
+	/* Topmost layer that has 'offset' allocated, -1 if none. */
+	int getOwner(quint64 offset) const;
+	/* Ranges allocated in any of layers from 'first' to 'last' inclusive. */
+	extentList_type unite(int first, int last) const;
+
+	static quint64 getSize(const extentList_type &extents);
+
+private:
+	QVector<extentList_type> m_layers;
+};
+
+////////////////////////////////////////////////////////////
+// Chain
+
+/* Guest view of a backing chain. */
+struct Chain
+{
+	/* 'paths' go from base to top. */
+	static Expected<Chain> open(const QStringList &paths);
+
+	quint64 getSize() const
+	{
+		return m_layers.last().getHeader().m_size;
+	}
+
+	/* Unallocated ranges read as zeroes. */
+	Expected<void> read(quint64 offset, char *buf, quint64 size) const;
+
+private:
+	/* Reads part of the guest cluster containing 'offset' from the topmost
+	 * layer that has it. Returns number of bytes read. */
+	Expected<quint64> readCluster(quint64 offset, char *buf, quint64 size) const;
+
+	QList<Image> m_layers;
+	QList<QVector<quint64> > m_l1;
+};
+
+////////////////////////////////////////////////////////////
+// Fragmentation
+
+struct Fragmentation
+{
+	static Expected<Fragmentation> measure(const Image &image);
+
+	/* Percentage of guest-adjacent data clusters that are not adjacent on host. */
+	double getRatio() const
+	{
+		return m_pairs ? 100.0 * m_breaks / m_pairs : 0;
+	}
+
+	quint64 m_pairs;
+	quint64 m_breaks;
+	quint64 m_fileSize;
+};
+
+////////////////////////////////////////////////////////////
+// Writer
+
+/* Writes new image sequentially: data clusters are appended in the order
+ * they are given, metadata is placed after the data on finish(). */
+struct Writer
+{
+	struct Params
+	{
+		Params(quint64 size, quint32 clusterBits):
+			m_size(size), m_clusterBits(clusterBits),
+			m_compression(COMPRESSION_ZLIB)
+		{
+		}
+
+		quint64 m_size;
+		quint32 m_clusterBits;
+		CompressionType m_compression;
+		QString m_backingFile;
+		QString m_backingFormat;
+	};
+
+	static Expected<boost::shared_ptr<Writer> > create(
+			const QString &path, const Params &params);
+
+	quint64 getClusterSize() const
+	{
+		return 1ULL << m_params.m_clusterBits;
+	}
+
+	/* Consecutive guest clusters starting from 'cluster'. */
+	Expected<void> writeData(quint64 cluster, const char *data, quint64 count);
+	/* Data as stored in qcow2 compressed cluster of the image type. */
+	Expected<void> writeCompressed(quint64 cluster, const char *data, quint64 size);
+	void writeZero(quint64 cluster);
+	/* Copies clusters allocated in the image (not in its backing files)
+	 * in guest order. Snapshots and bitmaps are not copied.
+	 * Compressed clusters of other compression type are stored uncompressed. */
+	Expected<void> copy(const Image &image, const Abort::token_type &token);
+	/* Same as copy(), but data clusters are compressed on a thread pool.
+	 * Clusters that do not compress are stored as is. */
+	Expected<void> compress(const Image &image, const Abort::token_type &token);
+	/* Copies guest data below 'size' seen through the backing chain, 'layers'
+	 * go from base to top. Unallocated clusters are skipped, zero clusters
+	 * are kept only if the new image has backing file. Host-contiguous runs
+	 * are read with deep asynchronous queue and written in guest order. */
+	Expected<void> copy(const QList<Image> &layers, quint64 size,
+			const Abort::token_type &token);
+
+	/* Writes metadata and syncs the file. */
+	Expected<void> finish();
+
+private:
+	Writer(const boost::shared_ptr<File> &file, const Params &params);
+
+	void setEntry(quint64 cluster, quint64 entry);
+	void ref(quint64 offset, quint64 size);
+	Expected<void> append(const char *data, quint64 size);
+	Expected<void> align();
+	Expected<void> flush();
+	Expected<quint64> writeTable(const QVector<quint64> &table);
+	Expected<void> writeHeader(quint64 l1Offset, quint64 refcountOffset,
+			quint32 refcountClusters);
+
+	boost::shared_ptr<File> m_file;
+	Params m_params;
+	// Next free host byte.
+	quint64 m_pos;
+	// Data not yet written, starts at m_pos - m_buffer.size().
+	QByteArray m_buffer;
+	QVector<quint64> m_l1;
+	QMap<quint64, QVector<quint64> > m_l2;
+	QVector<quint16> m_refcounts;
+};
+
+} // namespace Qcow2
+
+#endif // QCOW2_H
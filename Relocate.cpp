@@ -0,0 +1,195 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Relocate.cpp
+///
+/// Moving partition contents inside an image.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+
+#include <QByteArray>
+#include <QFileInfo>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include "Relocate.h"
+#include "Cache.h"
+#include "Util.h"
+
+namespace pt = boost::property_tree;
+using namespace Relocate;
+
+namespace
+{
+
+const char CACHE_STORE_RELOCATE[] = "relocate";
+
+enum {MOVE_CHUNK_SIZE = 4 * 1024 * 1024};
+enum {CHECKPOINT_INTERVAL = 256 * 1024 * 1024};
+
+// Same image may be given by different paths.
+QString getKey(const QString &path)
+{
+	QString canonical = QFileInfo(path).canonicalFilePath();
+	return canonical.isEmpty() ? path : canonical;
+}
+
+bool isEndBefore(const Qcow2::Extent &extent, quint64 offset)
+{
+	return extent.getEnd() <= offset;
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////
+// Checkpoint
+
+boost::optional<Checkpoint> Checkpoint::load(const QString &path)
+{
+	boost::optional<pt::ptree> data = Cache::Store::get(CACHE_STORE_RELOCATE, getKey(path));
+	if (!data)
+		return boost::none;
+
+	Checkpoint checkpoint(path);
+	try
+	{
+		checkpoint.m_snapshot = QString::fromStdString(data->get<std::string>("snapshot"));
+		checkpoint.m_size = data->get<quint64>("size");
+		checkpoint.m_gpt = data->get<bool>("gpt");
+		// Older checkpoints were saved after the table was changed.
+		checkpoint.m_table = data->get<bool>("table", true);
+		checkpoint.m_current = data->get<int>("current");
+		checkpoint.m_done = data->get<quint64>("done");
+		Q_FOREACH(const pt::ptree::value_type &v, data->get_child("moves"))
+		{
+			checkpoint.m_moves << Move(v.second.get<quint64>("src"),
+					v.second.get<quint64>("dst"), v.second.get<quint64>("size"));
+		}
+	}
+	catch (const pt::ptree_error &e)
+	{
+		Logger::error(QString("Ignoring broken relocation checkpoint of %1: %2")
+				.arg(path).arg(e.what()));
+		return boost::none;
+	}
+	return checkpoint;
+}
+
+Expected<void> Checkpoint::save() const
+{
+	pt::ptree data;
+	data.put("snapshot", m_snapshot.toStdString());
+	data.put("size", m_size);
+	data.put("gpt", m_gpt);
+	data.put("table", m_table);
+	data.put("current", m_current);
+	data.put("done", m_done);
+	pt::ptree moves;
+	Q_FOREACH(const Move &move, m_moves)
+	{
+		pt::ptree m;
+		m.put("src", move.m_src);
+		m.put("dst", move.m_dst);
+		m.put("size", move.m_size);
+		moves.push_back(std::make_pair("", m));
+	}
+	data.put_child("moves", moves);
+	return Cache::Store::put(CACHE_STORE_RELOCATE, getKey(m_path), data);
+}
+
+void Checkpoint::remove() const
+{
+	Cache::Store::remove(CACHE_STORE_RELOCATE, getKey(m_path));
+}
+
+////////////////////////////////////////////////////////////
+// Engine
+
+bool Engine::isAllocated(quint64 offset, quint64 size) const
+{
+	Qcow2::extentList_type::const_iterator it = std::lower_bound(
+			m_allocated.begin(), m_allocated.end(), offset, isEndBefore);
+	return it != m_allocated.end() && it->m_offset < offset + size;
+}
+
+Expected<void> Engine::move(Checkpoint &checkpoint)
+{
+	const Move &move = checkpoint.m_moves[checkpoint.m_current];
+	Logger::info(QString("Moving %1 bytes from %2 to %3, %4 done")
+			.arg(move.m_size).arg(move.m_src).arg(move.m_dst).arg(checkpoint.m_done));
+	if (move.getDistance() == 0)
+		return Expected<void>();
+
+	// Source of unsaved chunks must not be overwritten.
+	quint64 limit = qMin(move.getDistance(), (quint64)CHECKPOINT_INTERVAL);
+	QByteArray buf(qMin(limit, (quint64)MOVE_CHUNK_SIZE), 0);
+	quint64 saved = checkpoint.m_done;
+	Expected<void> res;
+	while (checkpoint.m_done < move.m_size)
+	{
+		if (m_token && m_token->isCancellationRequested())
+			return Expected<void>::fromMessage("Operation was cancelled");
+
+		quint64 count = qMin((quint64)buf.size(), move.m_size - checkpoint.m_done);
+		if (checkpoint.m_done - saved + count > limit)
+		{
+			if (!(res = m_disk.flush()).isOk() || !(res = checkpoint.save()).isOk())
+				return res;
+			saved = checkpoint.m_done;
+		}
+
+		quint64 offset = move.isForward() ? checkpoint.m_done :
+		                 move.m_size - checkpoint.m_done - count;
+		if (isAllocated(move.m_src + offset, count))
+		{
+			if (!(res = m_disk.read(move.m_src + offset, buf.data(), count)).isOk() ||
+				!(res = m_disk.write(move.m_dst + offset, buf.constData(), count)).isOk())
+				return res;
+		}
+		else if (!(res = m_disk.zero(move.m_dst + offset, count)).isOk())
+			return res;
+		checkpoint.m_done += count;
+	}
+	return Expected<void>();
+}
+
+Expected<void> Engine::run(Checkpoint &checkpoint)
+{
+	Expected<void> res;
+	while (checkpoint.m_current < checkpoint.m_moves.size())
+	{
+		if (!(res = move(checkpoint)).isOk())
+			return res;
+		if (!(res = m_disk.flush()).isOk())
+			return res;
+		// Repeating an overlapping move would read overwritten data.
+		++checkpoint.m_current;
+		checkpoint.m_done = 0;
+		if (!(res = checkpoint.save()).isOk())
+			return res;
+	}
+	return Expected<void>();
+}
@@ -0,0 +1,136 @@
+///////////////////////////////////////////////////////////////////////////////
+///
+/// @file Relocate.h
+///
+/// Moving partition contents inside an image.
+///
+/// @author mperevedentsev
+///
+/// Copyright (c) 2005-2016 Parallels IP Holdings GmbH
+///
+/// This file is part of Virtuozzo Core. Virtuozzo Core is free
+/// software; you can redistribute it and/or modify it under the terms
+/// of the GNU General Public License as published by the Free Software
+/// Foundation; either version 2 of the License, or (at your option) any
+/// later version.
+///
+/// This program is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with this program; if not, write to the Free Software
+/// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+/// 02110-1301, USA.
+///
+/// Our contact details: Parallels IP Holdings GmbH, Vordergasse 59, 8200
+/// Schaffhausen, Switzerland.
+///
+///////////////////////////////////////////////////////////////////////////////
+#ifndef RELOCATE_H
+#define RELOCATE_H
+
+#include <QString>
+#include <QList>
+
+#include <boost/optional.hpp>
+
+#include "Expected.h"
+#include "Abort.h"
+#include "Probe.h"
+#include "Qcow2.h"
+
+namespace Relocate
+{
+
+////////////////////////////////////////////////////////////
+// Move
+
+/* Guest byte ranges, may overlap. */
+struct Move
+{
+	Move(quint64 src, quint64 dst, quint64 size):
+		m_src(src), m_dst(dst), m_size(size)
+	{
+	}
+
+	bool isForward() const
+	{
+		return m_dst < m_src;
+	}
+
+	quint64 getDistance() const
+	{
+		return isForward() ? m_src - m_dst : m_dst - m_src;
+	}
+
+	quint64 m_src;
+	quint64 m_dst;
+	quint64 m_size;
+};
+
+////////////////////////////////////////////////////////////
+// Checkpoint
+
+/* Relocation of one image, saved often enough to be resumed after a crash.
+ * Data of the current move behind m_done is never overwritten before
+ * the checkpoint is saved. */
+struct Checkpoint
+{
+	explicit Checkpoint(const QString &path):
+		m_path(path), m_size(0), m_gpt(false), m_table(false), m_current(0), m_done(0)
+	{
+	}
+
+	/* Unfinished relocation of 'path', if any. */
+	static boost::optional<Checkpoint> load(const QString &path);
+
+	Expected<void> save() const;
+	void remove() const;
+
+	QString m_path;
+	// Internal snapshot to drop when relocation is finished.
+	QString m_snapshot;
+	// Disk size afterwards.
+	quint64 m_size;
+	bool m_gpt;
+	// Partition table is changed, data must follow. Otherwise table may be
+	// half changed and the image is rolled back to the snapshot.
+	bool m_table;
+	QList<Move> m_moves;
+	int m_current;
+	// Bytes of the current move that are already in place.
+	quint64 m_done;
+};
+
+////////////////////////////////////////////////////////////
+// Engine
+
+/* Copies allocated data, ranges not allocated in the chain are zeroed.
+ * Overlapping ranges are copied away from the destination end, in chunks
+ * not longer than the move distance. */
+struct Engine
+{
+	Engine(Probe::Disk &disk, const Qcow2::extentList_type &allocated,
+	       const Abort::token_type &token):
+		m_disk(disk), m_allocated(allocated), m_token(token)
+	{
+	}
+
+	/* Runs moves starting from the checkpointed one. */
+	Expected<void> run(Checkpoint &checkpoint);
+
+private:
+	Expected<void> move(Checkpoint &checkpoint);
+	bool isAllocated(quint64 offset, quint64 size) const;
+
+	Probe::Disk &m_disk;
+	// Sorted and merged.
+	Qcow2::extentList_type m_allocated;
+	Abort::token_type m_token;
+};
+
+} // namespace Relocate
+
+#endif // RELOCATE_H
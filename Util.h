@@ -131,6 +131,11 @@ struct Call
 		return run_prg(name, lstArgs, out, err, timeout, m_token);
 	}
 
+	const Abort::token_type& getToken() const
+	{
+		return m_token;
+	}
+
 private:
 	Abort::token_type m_token;
 };
@@ -95,7 +95,11 @@ print "{} {} {}".format(sys.argv[2], vg["extent_size"], vg.get("status"))
 # e.g. {"pv0": "/dev/sda1"}
 pv_map = {}
 for pv, pv_content in vg["physical_volumes"].items():
-	pv_map[pv] = pv_content["device"]
+	# Device is only a hint, it is missing if the volume was not found.
+	pv_map[pv] = pv_content.get("device", pv)
+	print "PV {} {} {} {}".format(
+		   pv_map[pv], pv_content["id"].replace("-", ""),
+		   pv_content["pe_start"], pv_content["pe_count"])
 
 if "logical_volumes" not in vg:
 	# Empty VG is valid
@@ -48,7 +48,10 @@ typedef boost::mpl::vector<
 	Command::Traits<Command::ResizeInfo>,
 	Command::Traits<Command::Compact>,
 	Command::Traits<Command::CompactInfo>,
-	Command::Traits<Command::MergeSnapshots>
+	Command::Traits<Command::MergeSnapshots>,
+	Command::Traits<Command::DedupInfo>,
+	Command::Traits<Command::Defrag>,
+	Command::Traits<Command::Check>
 		> desc_type;
 
 void printUsage(const OptionParser &parser)
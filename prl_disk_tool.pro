@@ -1,7 +1,25 @@
 CONFIG += qt
 
 QT = core xml
-LIBS += -lguestfs -Wl,-Bstatic -lboost_program_options -Wl,-Bdynamic
+LIBS += -lguestfs -lz -Wl,-Bstatic -lboost_program_options -Wl,-Bdynamic
+
+# io_uring is optional, thread pool I/O is used without it.
+packagesExist(liburing) {
+	DEFINES += HAVE_LIBURING
+	LIBS += -luring
+}
+
+# zstd is optional, zlib is used for compression without it.
+packagesExist(libzstd) {
+	DEFINES += HAVE_ZSTD
+	LIBS += -lzstd
+}
+
+# libnbd is optional, images unsupported by native reader need appliance without it.
+packagesExist(libnbd) {
+	DEFINES += HAVE_LIBNBD
+	LIBS += -lnbd
+}
 
 # Application name string
 DEFINES += APP_NAME_STR=\\\"$${APP_NAME}\\\"
@@ -16,7 +34,17 @@ HEADERS += GuestFSWrapper.h \
            ProgramOptions.h \
            StringTable.h \
            Errors.h \
-           Lvm.h
+           Lvm.h \
+           Qcow2.h \
+           Dedup.h \
+           AsyncIO.h \
+           Cache.h \
+           Probe.h \
+           Nbd.h \
+           Async.h \
+           PartTable.h \
+           Layout.h \
+           Relocate.h
 
 SOURCES += main.cpp \
            GuestFSWrapper.cpp \
@@ -29,7 +57,16 @@ SOURCES += main.cpp \
            Abort.cpp \
            ProgramOptions.cpp \
            StringTable.cpp \
-           Lvm.cpp
+           Lvm.cpp \
+           Qcow2.cpp \
+           Dedup.cpp \
+           AsyncIO.cpp \
+           Cache.cpp \
+           Probe.cpp \
+           Nbd.cpp \
+           PartTable.cpp \
+           Layout.cpp \
+           Relocate.cpp
 
 
 target.path = /usr/sbin/